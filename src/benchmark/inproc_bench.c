@@ -0,0 +1,348 @@
+/*
+ *	In-process RUFS microbenchmark.
+ *
+ *	Links librufs.a and calls the rufs_ope handlers directly against a
+ *	DISKFILE, so the filesystem logic can be measured and profiled without
+ *	/dev/fuse, a mount, or kernel round trips.
+ *
+ *	Usage:
+ *	  ./inproc_bench [-f diskfile] [-n files] [-d dirs] [-b io_size]
+ *	                 [-s file_size] [-p phases] [-i inode_format] [-c] [-D]
+ *	                 [-C csum] [-k]
+ *
+ *	  phases: comma separated subset of mkdir,create,stat,write,read,readdir
+ *	  (default: all of them, in that order)
+ *	  inode_format: compact (default) or legacy
+ *	  -c: create files compressed
+ *	  -D: share identical data blocks (dedup)
+ *	  csum: block checksums, off (default), meta or data
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "../block.h"
+#include "../rufs.h"
+
+#define FSPATHLEN 256
+
+struct bench_config {
+	const char	*diskfile;		/* DISKFILE to create and mount */
+	int			files;			/* files created in the create phase */
+	int			dirs;			/* directories files are spread over */
+	size_t		io_size;		/* bytes per read/write call */
+	size_t		file_size;		/* bytes written to /data */
+	const char	*phases;		/* phases to run */
+	int			keep;			/* keep DISKFILE after the run */
+};
+
+struct phase_result {
+	long		ops;
+	long		errors;
+	uint64_t	elapsed_ns;
+	uint64_t	*lat_ns;
+	size_t		bytes;
+};
+
+static struct bench_config cfg = {
+	.diskfile	= "BENCH_DISKFILE",
+	.files		= 500,
+	.dirs		= 10,
+	.io_size	= 4096,
+	.file_size	= 64 * 1024,
+	.phases		= "mkdir,create,stat,write,read,readdir",
+	.keep		= 0
+};
+
+static const struct fuse_operations *ops;
+static char *io_buf;
+static long dirents_seen;
+static int first_phase = 1;
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t parse_size(const char *s){
+	char *end = NULL;
+	unsigned long long v = strtoull(s, &end, 10);
+
+	switch(*end){
+		case 'm': case 'M': v <<= 20; break;
+		case 'k': case 'K': v <<= 10; break;
+		case '\0': break;
+		default:
+			fprintf(stderr, "invalid size: %s\n", s);
+			exit(1);
+	}
+
+	return (size_t)v;
+}
+
+static int phase_enabled(const char *name){
+	size_t len = strlen(name);
+	const char *p = cfg.phases;
+
+	while((p = strstr(p, name)) != NULL){
+		int starts = (p == cfg.phases || p[-1] == ',');
+		int ends = (p[len] == '\0' || p[len] == ',');
+		if(starts && ends){
+			return 1;
+		}
+		p += len;
+	}
+
+	return 0;
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf, off_t off, enum fuse_fill_dir_flags flags){
+	dirents_seen++;
+	return 0;
+}
+
+static void file_path(char *path, int i){
+	snprintf(path, FSPATHLEN, "/d%d/f%d", i % cfg.dirs, i);
+}
+
+static void dir_path(char *path, int i){
+	snprintf(path, FSPATHLEN, "/d%d", i);
+}
+
+/*
+ * Runs one operation of a phase, returns the handler's status
+ */
+static int run_op(const char *phase, int i){
+	char path[FSPATHLEN];
+	struct fuse_file_info fi;
+	struct stat st;
+
+	memset(&fi, 0, sizeof(fi));
+
+	if(strcmp(phase, "mkdir") == 0){
+		dir_path(path, i);
+		return ops->mkdir(path, 0755);
+	}else if(strcmp(phase, "create") == 0){
+		file_path(path, i);
+		return ops->create(path, 0644, &fi);
+	}else if(strcmp(phase, "stat") == 0){
+		file_path(path, i);
+		return ops->getattr(path, &st, NULL);
+	}else if(strcmp(phase, "write") == 0){
+		int ret = ops->write("/data", io_buf, cfg.io_size, (off_t)i * cfg.io_size, &fi);
+		return (ret == (int)cfg.io_size) ? 0 : -1;
+	}else if(strcmp(phase, "read") == 0){
+		int ret = ops->read("/data", io_buf, cfg.io_size, (off_t)i * cfg.io_size, &fi);
+		return (ret == (int)cfg.io_size) ? 0 : -1;
+	}else{
+		dir_path(path, i);
+		return ops->readdir(path, NULL, count_filler, 0, &fi, 0);
+	}
+}
+
+static long phase_count(const char *phase){
+	if(strcmp(phase, "mkdir") == 0 || strcmp(phase, "readdir") == 0){
+		return cfg.dirs;
+	}else if(strcmp(phase, "write") == 0 || strcmp(phase, "read") == 0){
+		return cfg.file_size / cfg.io_size;
+	}
+
+	return cfg.files;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, long n, double p){
+	if(n == 0){
+		return 0;
+	}
+
+	return sorted[(long)(p * (n - 1) + 0.5)];
+}
+
+static void report(const char *phase, struct phase_result *r){
+	long n = r->ops - r->errors;
+	double secs = r->elapsed_ns / 1e9;
+
+	qsort(r->lat_ns, n, sizeof(uint64_t), cmp_u64);
+
+	printf("%s    {\n", first_phase ? "" : ",\n");
+	printf("      \"phase\": \"%s\",\n", phase);
+	printf("      \"ops\": %ld,\n", r->ops);
+	printf("      \"errors\": %ld,\n", r->errors);
+	printf("      \"elapsed_sec\": %.6f,\n", secs);
+	printf("      \"ops_per_sec\": %.1f,\n", secs > 0 ? r->ops / secs : 0.0);
+	if(r->bytes){
+		printf("      \"throughput_mib_s\": %.3f,\n", secs > 0 ? r->bytes / (1024.0 * 1024.0) / secs : 0.0);
+	}
+	printf("      \"latency_ns\": { \"p50\": %lu, \"p99\": %lu, \"max\": %lu }\n",
+		(unsigned long)percentile(r->lat_ns, n, 0.50),
+		(unsigned long)percentile(r->lat_ns, n, 0.99),
+		(unsigned long)(n > 0 ? r->lat_ns[n - 1] : 0));
+	printf("    }");
+
+	first_phase = 0;
+}
+
+static void run_phase(const char *phase){
+	struct phase_result r;
+	long count = phase_count(phase);
+
+	memset(&r, 0, sizeof(r));
+	r.lat_ns = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+	if(!r.lat_ns){
+		perror("malloc");
+		exit(1);
+	}
+
+	if(strcmp(phase, "write") == 0){
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(fi));
+		ops->create("/data", 0644, &fi);
+	}
+
+	uint64_t start = now_ns();
+	for(long i = 0; i < count; i++){
+		uint64_t t0 = now_ns();
+		int ret = run_op(phase, i);
+		uint64_t t1 = now_ns();
+
+		r.ops++;
+		if(ret < 0){
+			r.errors++;
+			continue;
+		}
+		r.lat_ns[r.ops - r.errors - 1] = t1 - t0;
+	}
+	r.elapsed_ns = now_ns() - start;
+
+	if(strcmp(phase, "write") == 0 || strcmp(phase, "read") == 0){
+		r.bytes = (r.ops - r.errors) * cfg.io_size;
+	}
+
+	report(phase, &r);
+	free(r.lat_ns);
+}
+
+/*
+ * rufs_init() prints the on-disk layout, keep it out of the JSON on stdout
+ */
+static void *quiet_init(){
+	struct fuse_conn_info conn;
+	struct fuse_config fcfg;
+	memset(&conn, 0, sizeof(conn));
+	memset(&fcfg, 0, sizeof(fcfg));
+
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+
+	void *priv = ops->init(&conn, &fcfg);
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(devnull);
+	close(saved);
+	return priv;
+}
+
+int main(int argc, char **argv) {
+	static const char *phases[] = { "mkdir", "create", "stat", "write", "read", "readdir" };
+	int opt;
+
+	while((opt = getopt(argc, argv, "f:n:d:b:s:p:i:cDC:k")) != -1){
+		switch(opt){
+			case 'f': cfg.diskfile = optarg; break;
+			case 'n': cfg.files = atoi(optarg); break;
+			case 'd': cfg.dirs = atoi(optarg); break;
+			case 'b': cfg.io_size = parse_size(optarg); break;
+			case 's': cfg.file_size = parse_size(optarg); break;
+			case 'p': cfg.phases = optarg; break;
+			case 'i': rufs_conf.inode_fmt = (strcmp(optarg, "legacy") == 0) ? INODE_FMT_LEGACY : INODE_FMT_COMPACT; break;
+			case 'c': rufs_conf.compress = 1; break;
+			case 'D': rufs_conf.dedup = 1; break;
+			case 'C':
+				rufs_conf.csum = (strcmp(optarg, "off") == 0) ? CSUM_OFF :
+					(strcmp(optarg, "data") == 0) ? CSUM_DATA : CSUM_META;
+				break;
+			case 'k': cfg.keep = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-f diskfile] [-n files] [-d dirs] [-b io_size]\n"
+					"          [-s file_size] [-p phases] [-i inode_format] [-c] [-D] [-C csum] [-k]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if(cfg.dirs <= 0 || cfg.io_size == 0){
+		fprintf(stderr, "dirs and io_size must be positive\n");
+		exit(1);
+	}
+
+	if(!realpath(cfg.diskfile, diskfile_path)){
+		/* Not created yet: resolve relative to the working directory */
+		if(cfg.diskfile[0] == '/'){
+			snprintf(diskfile_path, PATH_MAX, "%s", cfg.diskfile);
+		}else{
+			getcwd(diskfile_path, PATH_MAX);
+			strncat(diskfile_path, "/", PATH_MAX - strlen(diskfile_path) - 1);
+			strncat(diskfile_path, cfg.diskfile, PATH_MAX - strlen(diskfile_path) - 1);
+		}
+	}
+
+	/* Every run starts from a fresh image */
+	unlink(diskfile_path);
+
+	io_buf = malloc(cfg.io_size);
+	if(!io_buf){
+		perror("malloc");
+		exit(1);
+	}
+	memset(io_buf, 0x61, cfg.io_size);
+
+	ops = rufs_operations();
+	void *priv = quiet_init();
+
+	printf("{\n");
+	printf("  \"diskfile\": \"%s\",\n", diskfile_path);
+	printf("  \"files\": %d,\n", cfg.files);
+	printf("  \"dirs\": %d,\n", cfg.dirs);
+	printf("  \"io_size\": %zu,\n", cfg.io_size);
+	printf("  \"file_size\": %zu,\n", cfg.file_size);
+	printf("  \"inode_format\": \"%s\",\n", rufs_conf.inode_fmt == INODE_FMT_LEGACY ? "legacy" : "compact");
+	printf("  \"compress\": %s,\n", rufs_conf.compress ? "true" : "false");
+	printf("  \"dedup\": %s,\n", rufs_conf.dedup ? "true" : "false");
+	printf("  \"csum\": \"%s\",\n", rufs_conf.csum == CSUM_OFF ? "off" : rufs_conf.csum == CSUM_DATA ? "data" : "meta");
+	printf("  \"phases\": [\n");
+
+	for(int i = 0; i < sizeof(phases) / sizeof(phases[0]); i++){
+		if(phase_enabled(phases[i])){
+			run_phase(phases[i]);
+		}
+	}
+
+	printf("\n  ],\n");
+	printf("  \"dirents_listed\": %ld\n", dirents_seen);
+	printf("}\n");
+
+	ops->destroy(priv);
+	if(!cfg.keep){
+		unlink(diskfile_path);
+	}
+	free(io_buf);
+
+	return 0;
+}
@@ -0,0 +1,518 @@
+/*
+ *	Round-trip tests for the RUFS on-disk format.
+ *
+ *	Links librufs.a and drives the rufs_ope handlers against a DISKFILE.
+ *	Every test starts from a fresh image, and once it is done the image is
+ *	unmounted and checked with rufs-fsck -f -n, which has to find it
+ *	consistent.
+ *
+ *	Usage:
+ *	  ./lib_test [-f diskfile] [-F fsck] [-M mkfs]
+ *
+ *	  fsck: path of the rufs-fsck binary (default ../rufs-fsck)
+ *	  mkfs: path of the rufs-mkfs binary (default ../rufs-mkfs)
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../block.h"
+#include "../rufs.h"
+
+#define FSPATHLEN 256
+#define CMDLEN (2 * PATH_MAX + 64)
+
+struct test {
+	const char	*name;
+	int			(*run)();
+};
+
+static const char *diskfile = "TEST_DISKFILE";
+static const char *fsck_path = "../rufs-fsck";
+static const char *mkfs_path = "../rufs-mkfs";
+static const struct fuse_operations *ops;
+static void *priv = NULL;
+
+/*
+ * Fills buf with a pattern that differs per seed and per block
+ */
+static void fill(char *buf, size_t size, int seed){
+	for(size_t i = 0; i < size; i++){
+		buf[i] = (char)((i * 7) + (i / 4096) + (seed * 31));
+	}
+}
+
+/*
+ * rufs_init() prints the on-disk layout, keep it out of the test output
+ */
+static void mount_image(){
+	struct fuse_conn_info conn;
+	struct fuse_config fcfg;
+	memset(&conn, 0, sizeof(conn));
+	memset(&fcfg, 0, sizeof(fcfg));
+
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+
+	priv = ops->init(&conn, &fcfg);
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(devnull);
+	close(saved);
+}
+
+static void unmount_image(){
+	ops->destroy(priv);
+	priv = NULL;
+}
+
+static void remount_image(){
+	unmount_image();
+	mount_image();
+}
+
+/*
+ * Creates path and writes size bytes of the seed's pattern to it
+ */
+static int write_file(const char *path, size_t size, int seed){
+	struct fuse_file_info fi;
+	char *buf = malloc(size);
+	int ret = -1;
+
+	memset(&fi, 0, sizeof(fi));
+	if(buf && ops->create(path, 0644, &fi) == 0){
+		fill(buf, size, seed);
+		ret = (ops->write(path, buf, size, 0, &fi) == (int)size) ? 0 : -1;
+		ops->release(path, &fi);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Writes size bytes of buf at offset of the existing file path
+ */
+static int write_part(const char *path, const char *buf, size_t size, off_t offset){
+	struct fuse_file_info fi;
+	int ret = -1;
+
+	memset(&fi, 0, sizeof(fi));
+	if(ops->open(path, &fi) == 0){
+		ret = (ops->write(path, buf, size, offset, &fi) == (int)size) ? 0 : -1;
+		ops->release(path, &fi);
+	}
+	return ret;
+}
+
+/*
+ * Whether path holds exactly the size bytes of want
+ */
+static int check_data(const char *path, const char *want, size_t size){
+	struct fuse_file_info fi;
+	char *got = malloc(size + 1);
+	int ret = -1;
+
+	memset(&fi, 0, sizeof(fi));
+	if(got && ops->open(path, &fi) == 0){
+		int n = ops->read(path, got, size + 1, 0, &fi);
+		ret = (n == (int)size && memcmp(got, want, size) == 0) ? 0 : -1;
+		ops->release(path, &fi);
+	}
+
+	free(got);
+	return ret;
+}
+
+/*
+ * Whether path holds exactly size bytes of the seed's pattern
+ */
+static int check_file(const char *path, size_t size, int seed){
+	char *want = malloc(size);
+	int ret = -1;
+
+	if(want){
+		fill(want, size, seed);
+		ret = check_data(path, want, size);
+	}
+
+	free(want);
+	return ret;
+}
+
+/*
+ * Runs rufs-fsck -f -n on the image, 0 if it finds no problem
+ */
+static int fsck_image(){
+	char cmd[CMDLEN];
+
+	snprintf(cmd, CMDLEN, "%s -f -n %s", fsck_path, diskfile_path);
+	int status = system(cmd);
+	return (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/*
+ * A snapshot taken after a write holds only the blocks files use
+ */
+static int test_snapshot_fsck(){
+	if(write_file("/a", 8192, 1) < 0 || ops->mkdir("/.snapshots/s1", 0755) < 0){
+		return -1;
+	}
+
+	return check_file("/.snapshots/s1/a", 8192, 1);
+}
+
+/*
+ * A snapshot taken while a block freed by a defrag waits for a read reply
+ * does not hold the block
+ */
+static int test_snapshot_held(){
+	struct fuse_file_info fi;
+	struct fuse_bufvec *bufv = NULL;
+	struct rufs_defrag_args args;
+
+	if(write_file("/a", 8192, 1) < 0 || write_file("/b", 8192, 2) < 0 || write_file("/c", 4096, 3) < 0){
+		return -1;
+	}
+
+	// Grow /a past /b so that a defrag moves its blocks
+	memset(&fi, 0, sizeof(fi));
+	char *buf = malloc(4096);
+	fill(buf, 4096, 1);
+	int ret = (buf && ops->open("/a", &fi) == 0 && ops->write("/a", buf, 4096, 8192, &fi) == 4096) ? 0 : -1;
+	free(buf);
+	if(ret < 0 || ops->read_buf("/a", &bufv, 12288, 0, &fi) < 0){
+		return -1;
+	}
+
+	memset(&args, 0, sizeof(args));
+	ret = ops->ioctl("/a", (int)RUFS_IOC_DEFRAG, NULL, &fi, 0, &args);
+	if(ret == 0){
+		ret = ops->mkdir("/.snapshots/s1", 0755);
+	}
+
+	ops->release("/a", &fi);
+	for(size_t i = 0; i < bufv->count; i++){
+		if(!(bufv->buf[i].flags & FUSE_BUF_IS_FD)){
+			free(bufv->buf[i].mem);
+		}
+	}
+	free(bufv);
+	return ret;
+}
+
+/*
+ * Inline, single block and indirect files and a subdirectory read back the
+ * same after a remount
+ */
+static int test_remount(){
+	if(write_file("/small", 50, 1) < 0 || write_file("/one", 4096, 2) < 0 ||
+		write_file("/big", 300 * 1024, 3) < 0 || ops->mkdir("/d", 0755) < 0 ||
+		write_file("/d/f", 10000, 4) < 0){
+		return -1;
+	}
+
+	remount_image();
+	return (check_file("/small", 50, 1) == 0 && check_file("/one", 4096, 2) == 0 &&
+		check_file("/big", 300 * 1024, 3) == 0 && check_file("/d/f", 10000, 4) == 0) ? 0 : -1;
+}
+
+/*
+ * A file rewritten after a snapshot keeps its old data in the snapshot, and
+ * deleting the snapshot leaves the new data alone
+ */
+static int test_snapshot_cow(){
+	struct stat st;
+	char *buf = malloc(16384);
+
+	if(!buf || write_file("/a", 16384, 1) < 0 || ops->mkdir("/.snapshots/s1", 0755) < 0){
+		free(buf);
+		return -1;
+	}
+
+	fill(buf, 16384, 2);
+	int ret = write_part("/a", buf, 16384, 0);
+	free(buf);
+	if(ret < 0 || check_file("/a", 16384, 2) < 0 || check_file("/.snapshots/s1/a", 16384, 1) < 0){
+		return -1;
+	}
+
+	remount_image();
+	if(check_file("/a", 16384, 2) < 0 || check_file("/.snapshots/s1/a", 16384, 1) < 0 ||
+		ops->rmdir("/.snapshots/s1") < 0){
+		return -1;
+	}
+
+	return (ops->getattr("/.snapshots/s1", &st, NULL) == -ENOENT) ? check_file("/a", 16384, 2) : -1;
+}
+
+/*
+ * Files cloned with RUFS_IOC_CLONE and copy_file_range share the source
+ * blocks until one of them is written
+ */
+static int test_clone_cow(){
+	struct fuse_file_info fi;
+	struct fuse_file_info fo;
+	struct rufs_clone_args args;
+
+	if(write_file("/a", 32768, 1) < 0){
+		return -1;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	memset(&args, 0, sizeof(args));
+	strcpy(args.src_path, "/a");
+	if(ops->create("/b", 0644, &fi) < 0){
+		return -1;
+	}
+	int ret = ops->ioctl("/b", (int)RUFS_IOC_CLONE, NULL, &fi, 0, &args);
+	ops->release("/b", &fi);
+
+	memset(&fi, 0, sizeof(fi));
+	memset(&fo, 0, sizeof(fo));
+	if(ret < 0 || ops->open("/a", &fi) < 0){
+		return -1;
+	}
+	if(ops->create("/c", 0644, &fo) == 0){
+		ret = (ops->copy_file_range("/a", &fi, 0, "/c", &fo, 0, 32768, 0) == 32768) ? 0 : -1;
+		ops->release("/c", &fo);
+	}else{
+		ret = -1;
+	}
+	ops->release("/a", &fi);
+
+	// Rewrite one block in the middle of the clone
+	char buf[4096];
+	fill(buf, 4096, 2);
+	if(ret < 0 || write_part("/b", buf, 4096, 8192) < 0){
+		return -1;
+	}
+
+	char *want = malloc(32768);
+	if(!want){
+		return -1;
+	}
+	fill(want, 32768, 1);
+	memcpy(want + 8192, buf, 4096);
+
+	remount_image();
+	ret = (check_file("/a", 32768, 1) == 0 && check_data("/b", want, 32768) == 0 &&
+		check_file("/c", 32768, 1) == 0) ? 0 : -1;
+	free(want);
+	return ret;
+}
+
+/*
+ * Two files written a block at a time in turn end up in several runs each,
+ * a defrag moves one into a single run without changing either file
+ */
+static int test_defrag(){
+	struct fuse_file_info fa;
+	struct fuse_file_info fb;
+	struct rufs_defrag_args args;
+	// Longer than an allocation window, which keeps a file contiguous
+	size_t size = 128 * 4096;
+	char *a = malloc(size);
+	char *b = malloc(size);
+	int ret = -1;
+
+	memset(&fa, 0, sizeof(fa));
+	memset(&fb, 0, sizeof(fb));
+	if(!a || !b || ops->create("/a", 0644, &fa) < 0){
+		goto out;
+	}
+	if(ops->create("/b", 0644, &fb) < 0){
+		ops->release("/a", &fa);
+		goto out;
+	}
+
+	fill(a, size, 1);
+	fill(b, size, 2);
+	ret = 0;
+	for(off_t off = 0; off < (off_t)size && ret == 0; off += 4096){
+		if(ops->write("/a", a + off, 4096, off, &fa) != 4096 || ops->write("/b", b + off, 4096, off, &fb) != 4096){
+			ret = -1;
+		}
+	}
+
+	memset(&args, 0, sizeof(args));
+	if(ret == 0){
+		ret = ops->ioctl("/a", (int)RUFS_IOC_DEFRAG, NULL, &fa, 0, &args);
+	}
+	ops->release("/a", &fa);
+	ops->release("/b", &fb);
+	if(ret < 0 || args.blocks != 128 || args.extents_before < 2 || args.extents_after != 1){
+		ret = -1;
+		goto out;
+	}
+
+	remount_image();
+	ret = (check_data("/a", a, size) == 0 && check_data("/b", b, size) == 0) ? 0 : -1;
+
+out:
+	free(a);
+	free(b);
+	return ret;
+}
+
+/*
+ * Preallocated blocks read back as zeros around the data written into them
+ */
+static int test_fallocate(){
+	struct fuse_file_info fi;
+	struct stat st;
+	char *want = calloc(1, 65536);
+	int ret = -1;
+
+	memset(&fi, 0, sizeof(fi));
+	if(!want || ops->create("/f", 0644, &fi) < 0){
+		free(want);
+		return -1;
+	}
+	ret = ops->fallocate("/f", 0, 0, 65536, &fi);
+	ops->release("/f", &fi);
+
+	if(ret == 0 && ops->getattr("/f", &st, NULL) == 0 && st.st_size == 65536 &&
+		check_data("/f", want, 65536) == 0){
+		fill(want + 16384, 8192, 1);
+		ret = write_part("/f", want + 16384, 8192, 16384);
+	}else{
+		ret = -1;
+	}
+
+	if(ret == 0){
+		remount_image();
+		ret = check_data("/f", want, 65536);
+	}
+
+	free(want);
+	return ret;
+}
+
+/*
+ * Creates dir/name on the host holding the size bytes of buf
+ */
+static int host_file(const char *dir, const char *name, const char *buf, size_t size){
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	FILE *f = fopen(path, "w");
+	if(!f){
+		return -1;
+	}
+
+	int ret = (fwrite(buf, 1, size, f) == size) ? 0 : -1;
+	return (fclose(f) == 0) ? ret : -1;
+}
+
+/*
+ * An image built by rufs-mkfs from a host tree mounts and reads back the
+ * host files, holes included
+ */
+static int test_mkfs_readback(){
+	char src[] = "/tmp/lib_test.XXXXXX";
+	char path[PATH_MAX];
+	char cmd[CMDLEN];
+	char *buf = malloc(100 * 1024);
+	int ret = -1;
+
+	if(!buf || !mkdtemp(src)){
+		free(buf);
+		return -1;
+	}
+
+	// The middle block of /holes is all zeros, rufs-mkfs leaves it out
+	fill(buf, 100 * 1024, 1);
+	memset(buf + 4096, 0, 4096);
+	snprintf(path, PATH_MAX, "%s/d", src);
+	if(host_file(src, "small", buf, 50) < 0 || host_file(src, "holes", buf, 12288) < 0 ||
+		host_file(src, "big", buf, 100 * 1024) < 0 || mkdir(path, 0755) < 0 ||
+		host_file(path, "f", buf, 4096) < 0){
+		goto out;
+	}
+
+	unmount_image();
+	snprintf(cmd, CMDLEN, "%s -f %s %s > /dev/null", mkfs_path, src, diskfile_path);
+	int status = system(cmd);
+	mount_image();
+	if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		goto out;
+	}
+
+	ret = (check_data("/small", buf, 50) == 0 && check_data("/holes", buf, 12288) == 0 &&
+		check_data("/big", buf, 100 * 1024) == 0 && check_data("/d/f", buf, 4096) == 0) ? 0 : -1;
+
+out:
+	snprintf(cmd, CMDLEN, "rm -rf %s", src);
+	system(cmd);
+	free(buf);
+	return ret;
+}
+
+static struct test tests[] = {
+	{ "write, snapshot, unmount, fsck", test_snapshot_fsck },
+	{ "snapshot while a defrag waits for a read reply", test_snapshot_held },
+	{ "write, read, remount", test_remount },
+	{ "snapshot copy-on-write and delete", test_snapshot_cow },
+	{ "clone and copy_file_range copy-on-write", test_clone_cow },
+	{ "defrag of interleaved files", test_defrag },
+	{ "fallocate", test_fallocate },
+	{ "rufs-mkfs image readback", test_mkfs_readback },
+};
+
+int main(int argc, char **argv) {
+	int opt;
+	int failed = 0;
+
+	while((opt = getopt(argc, argv, "f:F:M:")) != -1){
+		switch(opt){
+			case 'f': diskfile = optarg; break;
+			case 'F': fsck_path = optarg; break;
+			case 'M': mkfs_path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-f diskfile] [-F fsck] [-M mkfs]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if(diskfile[0] == '/'){
+		snprintf(diskfile_path, PATH_MAX, "%s", diskfile);
+	}else{
+		getcwd(diskfile_path, PATH_MAX);
+		strncat(diskfile_path, "/", PATH_MAX - strlen(diskfile_path) - 1);
+		strncat(diskfile_path, diskfile, PATH_MAX - strlen(diskfile_path) - 1);
+	}
+
+	ops = rufs_operations();
+
+	for(int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+		/* Every test starts from a fresh image */
+		unlink(diskfile_path);
+		mount_image();
+
+		int ret = tests[i].run();
+		unmount_image();
+		if(ret == 0){
+			ret = fsck_image();
+		}
+
+		printf("TEST %d: %s %s\n", i + 1, tests[i].name, (ret == 0) ? "Success" : "failure");
+		failed += (ret != 0);
+	}
+
+	unlink(diskfile_path);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,325 @@
+/*
+ *	Metadata-scaling benchmark for a mounted RUFS.
+ *
+ *	Measures how create, stat, readdir and unlink scale with the number of
+ *	entries in one directory (fan-out) and with the number of components
+ *	in a path (depth).
+ *
+ *	Usage:
+ *	  ./meta_bench -d <mountdir> [-f fanouts] [-l depths] [-n files_per_depth] [-i inodes]
+ *
+ *	  fanouts: comma separated entries per directory (default 10,100,500)
+ *	  depths:  comma separated path depths (default 1,2,4,8,16,32)
+ *	  inodes:  free inodes on the image (default 1023, a fresh image)
+ *
+ *	Results are printed as JSON, one record per fan-out and per depth. The
+ *	depth points run first. Inodes only come back when unlink and rmdir
+ *	really remove their entries, so a point needing more inodes than are
+ *	left is recorded as skipped instead of timing a run of failed creates.
+ *	The unlink stats of a record whose "removed" is false time a stub that
+ *	leaves the files in place and are not meaningful.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FSPATHLEN 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_POINTS 64
+
+struct op_stats {
+	long		ops;			/* attempted operations */
+	long		errors;			/* failed operations */
+	uint64_t	elapsed_ns;
+};
+
+static const char *mountdir = NULL;
+static int files_per_depth = 20;
+static long inodes_left = 1023;
+static int first_record = 1;
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_list(const char *s, long *out){
+	int n = 0;
+	char *cpy = strdup(s);
+	char *token = strtok(cpy, ",");
+
+	while(token != NULL && n < MAX_POINTS){
+		out[n++] = atol(token);
+		token = strtok(NULL, ",");
+	}
+
+	free(cpy);
+	return n;
+}
+
+static double rate(struct op_stats *s){
+	double secs = s->elapsed_ns / 1e9;
+	return secs > 0 ? (s->ops - s->errors) / secs : 0.0;
+}
+
+static void print_stats(const char *name, struct op_stats *s, int last){
+	printf("      \"%s\": { \"ops\": %ld, \"errors\": %ld, \"ops_per_sec\": %.1f }%s\n",
+		name, s->ops, s->errors, rate(s), last ? "" : ",");
+}
+
+static void create_files(const char *dir, long n, struct op_stats *s){
+	char path[FSPATHLEN];
+	uint64_t start = now_ns();
+
+	for(long i = 0; i < n; i++){
+		snprintf(path, FSPATHLEN, "%s/f%ld", dir, i);
+		int fd = creat(path, FILEPERM);
+
+		s->ops++;
+		if(fd < 0){
+			s->errors++;
+			continue;
+		}
+		close(fd);
+	}
+
+	s->elapsed_ns = now_ns() - start;
+}
+
+static void stat_files(const char *dir, long n, struct op_stats *s){
+	char path[FSPATHLEN];
+	struct stat st;
+	uint64_t start = now_ns();
+
+	for(long i = 0; i < n; i++){
+		snprintf(path, FSPATHLEN, "%s/f%ld", dir, i);
+
+		s->ops++;
+		if(stat(path, &st) < 0){
+			s->errors++;
+		}
+	}
+
+	s->elapsed_ns = now_ns() - start;
+}
+
+/*
+ * Lists the directory once, every returned entry counts as one operation
+ */
+static void list_dir(const char *dir, struct op_stats *s){
+	uint64_t start = now_ns();
+	DIR *d = opendir(dir);
+
+	if(!d){
+		s->errors++;
+		s->elapsed_ns = now_ns() - start;
+		return;
+	}
+
+	while(readdir(d) != NULL){
+		s->ops++;
+	}
+
+	closedir(d);
+	s->elapsed_ns = now_ns() - start;
+}
+
+/*
+ * Whether path is gone, the inode behind it free again
+ */
+static int removed(const char *path){
+	struct stat st;
+	return stat(path, &st) < 0 && errno == ENOENT;
+}
+
+/*
+ * Returns whether the files are really gone, unlink may be a stub that
+ * succeeds and leaves them in place
+ */
+static int remove_files(const char *dir, long n, struct op_stats *s){
+	char path[FSPATHLEN];
+	uint64_t start = now_ns();
+
+	for(long i = 0; i < n; i++){
+		snprintf(path, FSPATHLEN, "%s/f%ld", dir, i);
+
+		s->ops++;
+		if(unlink(path) < 0){
+			s->errors++;
+		}
+	}
+
+	s->elapsed_ns = now_ns() - start;
+
+	snprintf(path, FSPATHLEN, "%s/f%ld", dir, 0L);
+	return removed(path);
+}
+
+static void begin_record(const char *kind, long n){
+	printf("%s    {\n", first_record ? "" : ",\n");
+	printf("      \"kind\": \"%s\",\n", kind);
+	printf("      \"n\": %ld,\n", n);
+	first_record = 0;
+}
+
+static void end_record(struct op_stats *cr, struct op_stats *st, struct op_stats *ls, struct op_stats *rm, int removed){
+	print_stats("create", cr, 0);
+	print_stats("stat", st, 0);
+	print_stats("readdir", ls, 0);
+	print_stats("unlink", rm, 0);
+	printf("      \"removed\": %s\n", removed ? "true" : "false");
+	printf("    }");
+}
+
+/*
+ * Records a point that needs more inodes than the image has left
+ */
+static int skip_point(const char *kind, long n, long needed){
+	if(needed <= inodes_left){
+		return 0;
+	}
+
+	begin_record(kind, n);
+	printf("      \"skipped\": \"needs %ld inodes, %ld left\"\n", needed, inodes_left);
+	printf("    }");
+	return 1;
+}
+
+/*
+ * N entries in a single directory
+ */
+static void bench_fanout(long n){
+	char dir[FSPATHLEN];
+	struct op_stats cr = {0}, st = {0}, ls = {0}, rm = {0};
+
+	if(skip_point("fanout", n, n + 1)){
+		return;
+	}
+
+	snprintf(dir, FSPATHLEN, "%s/meta.%d.f%ld", mountdir, getpid(), n);
+	if(mkdir(dir, DIRPERM) < 0){
+		perror("mkdir");
+		return;
+	}
+
+	create_files(dir, n, &cr);
+	stat_files(dir, n, &st);
+	list_dir(dir, &ls);
+	int files_gone = remove_files(dir, n, &rm);
+	rmdir(dir);
+	if(!files_gone || !removed(dir)){
+		inodes_left -= n + 1;
+	}
+
+	begin_record("fanout", n);
+	end_record(&cr, &st, &ls, &rm, files_gone);
+}
+
+/*
+ * files_per_depth entries at the bottom of an n-component path
+ */
+static void bench_depth(long n){
+	char dir[FSPATHLEN];
+	struct op_stats cr = {0}, st = {0}, ls = {0}, rm = {0};
+	int len = snprintf(dir, FSPATHLEN, "%s/meta.%d.d%ld", mountdir, getpid(), n);
+
+	if(skip_point("depth", n, n + files_per_depth)){
+		return;
+	}
+
+	if(mkdir(dir, DIRPERM) < 0){
+		perror("mkdir");
+		return;
+	}
+
+	for(long i = 1; i < n && len < FSPATHLEN - 8; i++){
+		len += snprintf(dir + len, FSPATHLEN - len, "/l%ld", i);
+		if(mkdir(dir, DIRPERM) < 0){
+			perror("mkdir");
+			return;
+		}
+	}
+
+	create_files(dir, files_per_depth, &cr);
+	stat_files(dir, files_per_depth, &st);
+	list_dir(dir, &ls);
+	int files_gone = remove_files(dir, files_per_depth, &rm);
+
+	/* Tear the chain down bottom up */
+	for(long i = n; i > 0; i--){
+		rmdir(dir);
+		char *slash = strrchr(dir, '/');
+		if(slash){
+			*slash = '\0';
+		}
+	}
+
+	snprintf(dir, FSPATHLEN, "%s/meta.%d.d%ld", mountdir, getpid(), n);
+	if(!files_gone || !removed(dir)){
+		inodes_left -= n + files_per_depth;
+	}
+
+	begin_record("depth", n);
+	end_record(&cr, &st, &ls, &rm, files_gone);
+}
+
+int main(int argc, char **argv) {
+	long fanouts[MAX_POINTS];
+	long depths[MAX_POINTS];
+	int n_fanouts = parse_list("10,100,500", fanouts);
+	int n_depths = parse_list("1,2,4,8,16,32", depths);
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:f:l:n:i:")) != -1){
+		switch(opt){
+			case 'd': mountdir = optarg; break;
+			case 'f': n_fanouts = parse_list(optarg, fanouts); break;
+			case 'l': n_depths = parse_list(optarg, depths); break;
+			case 'n': files_per_depth = atoi(optarg); break;
+			case 'i': inodes_left = atol(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s -d <mountdir> [-f fanouts] [-l depths] [-n files_per_depth] [-i inodes]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if(!mountdir){
+		fprintf(stderr, "usage: %s -d <mountdir> [-f fanouts] [-l depths] [-n files_per_depth] [-i inodes]\n", argv[0]);
+		exit(1);
+	}
+
+	printf("{\n");
+	printf("  \"mount\": \"%s\",\n", mountdir);
+	printf("  \"files_per_depth\": %d,\n", files_per_depth);
+	printf("  \"inodes\": %ld,\n", inodes_left);
+	printf("  \"results\": [\n");
+
+	/* Depth points are small, they run before the fan-outs use up the inodes */
+	for(int i = 0; i < n_depths; i++){
+		if(depths[i] > 0){
+			bench_depth(depths[i]);
+			fflush(stdout);
+		}
+	}
+
+	for(int i = 0; i < n_fanouts; i++){
+		bench_fanout(fanouts[i]);
+		fflush(stdout);
+	}
+
+	printf("\n  ]\n");
+	printf("}\n");
+
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ *	Parametric throughput/latency benchmark for a mounted RUFS.
+ *
+ *	Usage:
+ *	  ./rufs_bench -d <mountdir> [-b io_size] [-s file_size] [-t threads]
+ *	               [-p pattern] [-n ops] [-r read_pct] [-k]
+ *
+ *	  pattern: seqread | seqwrite | randread | randwrite | mixed
+ *	  sizes accept K, M and G suffixes (powers of 1024)
+ *
+ *	Every thread works on its own file <mountdir>/rufs_bench.<tid>.
+ *	Results (throughput, IOPS, latency percentiles) are printed as JSON.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FSPATHLEN 256
+#define FILEPERM 0666
+
+enum pattern {
+	PAT_SEQREAD,
+	PAT_SEQWRITE,
+	PAT_RANDREAD,
+	PAT_RANDWRITE,
+	PAT_MIXED
+};
+
+static const char *pattern_names[] = {
+	"seqread", "seqwrite", "randread", "randwrite", "mixed"
+};
+
+struct bench_config {
+	const char	*dir;			/* mount point */
+	size_t		io_size;		/* bytes per read()/write() */
+	size_t		file_size;		/* bytes per thread file */
+	int			threads;		/* number of worker threads */
+	enum pattern pat;			/* access pattern */
+	long		ops;			/* operations per thread */
+	int			read_pct;		/* read percentage for mixed */
+	int			keep;			/* keep files after the run */
+};
+
+struct worker {
+	pthread_t	tid;
+	int			id;
+	char		path[FSPATHLEN];
+	long		done;			/* completed operations */
+	long		errors;			/* failed operations */
+	uint64_t	*lat_ns;		/* per operation latency */
+};
+
+static struct bench_config cfg = {
+	.dir		= NULL,
+	.io_size	= 4096,
+	.file_size	= 1024 * 1024,
+	.threads	= 1,
+	.pat		= PAT_SEQWRITE,
+	.ops		= 0,
+	.read_pct	= 70,
+	.keep		= 0
+};
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t parse_size(const char *s){
+	char *end = NULL;
+	unsigned long long v = strtoull(s, &end, 10);
+
+	switch(*end){
+		case 'g': case 'G': v <<= 30; break;
+		case 'm': case 'M': v <<= 20; break;
+		case 'k': case 'K': v <<= 10; break;
+		case '\0': break;
+		default:
+			fprintf(stderr, "invalid size: %s\n", s);
+			exit(1);
+	}
+
+	return (size_t)v;
+}
+
+static int parse_pattern(const char *s){
+	for(int i = 0; i <= PAT_MIXED; i++){
+		if(strcmp(s, pattern_names[i]) == 0){
+			return i;
+		}
+	}
+
+	fprintf(stderr, "invalid pattern: %s\n", s);
+	exit(1);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr,
+		"usage: %s -d <mountdir> [-b io_size] [-s file_size] [-t threads]\n"
+		"          [-p seqread|seqwrite|randread|randwrite|mixed] [-n ops]\n"
+		"          [-r read_pct] [-k]\n", prog);
+	exit(1);
+}
+
+/*
+ * Fills the worker's file up to file_size so read patterns have data to read
+ */
+static int prefill(struct worker *w, char *buf){
+	int fd = open(w->path, O_CREAT | O_WRONLY | O_TRUNC, FILEPERM);
+	if(fd < 0){
+		perror("open prefill");
+		return -1;
+	}
+
+	for(size_t ofs = 0; ofs < cfg.file_size; ofs += cfg.io_size){
+		size_t len = cfg.io_size;
+		if(ofs + len > cfg.file_size){
+			len = cfg.file_size - ofs;
+		}
+
+		if(pwrite(fd, buf, len, ofs) != (ssize_t)len){
+			perror("pwrite prefill");
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void *run_worker(void *arg){
+	struct worker *w = (struct worker *)arg;
+	size_t slots = cfg.file_size / cfg.io_size;
+	unsigned int seed = 0x5C3A + w->id;
+	char *buf = NULL;
+
+	if(posix_memalign((void **)&buf, 4096, cfg.io_size) != 0){
+		w->errors = cfg.ops;
+		return NULL;
+	}
+	memset(buf, 0x61 + (w->id % 26), cfg.io_size);
+
+	int fd = open(w->path, O_RDWR);
+	if(fd < 0){
+		perror("open");
+		w->errors = cfg.ops;
+		free(buf);
+		return NULL;
+	}
+
+	for(long i = 0; i < cfg.ops; i++){
+		off_t ofs;
+		int is_read;
+
+		switch(cfg.pat){
+			case PAT_SEQREAD:
+			case PAT_SEQWRITE:
+				ofs = (off_t)(i % slots) * cfg.io_size;
+				is_read = (cfg.pat == PAT_SEQREAD);
+				break;
+			case PAT_RANDREAD:
+			case PAT_RANDWRITE:
+				ofs = (off_t)(rand_r(&seed) % slots) * cfg.io_size;
+				is_read = (cfg.pat == PAT_RANDREAD);
+				break;
+			default:
+				ofs = (off_t)(rand_r(&seed) % slots) * cfg.io_size;
+				is_read = ((int)(rand_r(&seed) % 100) < cfg.read_pct);
+				break;
+		}
+
+		uint64_t start = now_ns();
+		ssize_t ret = is_read ? pread(fd, buf, cfg.io_size, ofs) : pwrite(fd, buf, cfg.io_size, ofs);
+		uint64_t end = now_ns();
+
+		if(ret != (ssize_t)cfg.io_size){
+			w->errors++;
+			continue;
+		}
+
+		w->lat_ns[w->done++] = end - start;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, long n, double p){
+	if(n == 0){
+		return 0.0;
+	}
+
+	long idx = (long)(p * (n - 1) + 0.5);
+	return sorted[idx] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:b:s:t:p:n:r:k")) != -1){
+		switch(opt){
+			case 'd': cfg.dir = optarg; break;
+			case 'b': cfg.io_size = parse_size(optarg); break;
+			case 's': cfg.file_size = parse_size(optarg); break;
+			case 't': cfg.threads = atoi(optarg); break;
+			case 'p': cfg.pat = parse_pattern(optarg); break;
+			case 'n': cfg.ops = atol(optarg); break;
+			case 'r': cfg.read_pct = atoi(optarg); break;
+			case 'k': cfg.keep = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(!cfg.dir || cfg.io_size == 0 || cfg.threads <= 0 || cfg.file_size < cfg.io_size){
+		usage(argv[0]);
+	}
+
+	if(cfg.ops <= 0){
+		cfg.ops = cfg.file_size / cfg.io_size;
+	}
+
+	struct worker *workers = calloc(cfg.threads, sizeof(struct worker));
+	char *fill = malloc(cfg.io_size);
+	if(!workers || !fill){
+		perror("malloc");
+		exit(1);
+	}
+	memset(fill, 0x5a, cfg.io_size);
+
+	/* Setup: every pattern starts from a fully written file */
+	for(int i = 0; i < cfg.threads; i++){
+		struct worker *w = &workers[i];
+		w->id = i;
+		snprintf(w->path, FSPATHLEN, "%s/rufs_bench.%d", cfg.dir, i);
+
+		w->lat_ns = malloc(cfg.ops * sizeof(uint64_t));
+		if(!w->lat_ns || prefill(w, fill) < 0){
+			exit(1);
+		}
+	}
+
+	uint64_t start = now_ns();
+	for(int i = 0; i < cfg.threads; i++){
+		pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+	}
+	for(int i = 0; i < cfg.threads; i++){
+		pthread_join(workers[i].tid, NULL);
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	/* Merge per-thread latencies */
+	long total = 0;
+	long errors = 0;
+	for(int i = 0; i < cfg.threads; i++){
+		total += workers[i].done;
+		errors += workers[i].errors;
+	}
+
+	uint64_t *lat = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+	long n = 0;
+	for(int i = 0; i < cfg.threads; i++){
+		memcpy(lat + n, workers[i].lat_ns, workers[i].done * sizeof(uint64_t));
+		n += workers[i].done;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	double secs = elapsed / 1e9;
+	double bytes = (double)total * cfg.io_size;
+
+	printf("{\n");
+	printf("  \"mount\": \"%s\",\n", cfg.dir);
+	printf("  \"pattern\": \"%s\",\n", pattern_names[cfg.pat]);
+	printf("  \"io_size\": %zu,\n", cfg.io_size);
+	printf("  \"file_size\": %zu,\n", cfg.file_size);
+	printf("  \"threads\": %d,\n", cfg.threads);
+	if(cfg.pat == PAT_MIXED){
+		printf("  \"read_pct\": %d,\n", cfg.read_pct);
+	}
+	printf("  \"ops\": %ld,\n", total);
+	printf("  \"errors\": %ld,\n", errors);
+	printf("  \"elapsed_sec\": %.6f,\n", secs);
+	printf("  \"throughput_mib_s\": %.3f,\n", secs > 0 ? bytes / (1024.0 * 1024.0) / secs : 0.0);
+	printf("  \"iops\": %.1f,\n", secs > 0 ? total / secs : 0.0);
+	printf("  \"latency_us\": {\n");
+	printf("    \"min\": %.3f,\n", n > 0 ? lat[0] / 1000.0 : 0.0);
+	printf("    \"p50\": %.3f,\n", percentile_us(lat, n, 0.50));
+	printf("    \"p99\": %.3f,\n", percentile_us(lat, n, 0.99));
+	printf("    \"p999\": %.3f,\n", percentile_us(lat, n, 0.999));
+	printf("    \"max\": %.3f\n", n > 0 ? lat[n - 1] / 1000.0 : 0.0);
+	printf("  }\n");
+	printf("}\n");
+
+	for(int i = 0; i < cfg.threads; i++){
+		if(!cfg.keep){
+			unlink(workers[i].path);
+		}
+		free(workers[i].lat_ns);
+	}
+	free(workers);
+	free(fill);
+	free(lat);
+
+	return errors ? 1 : 0;
+}
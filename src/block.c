@@ -7,28 +7,203 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "crc32c.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+//Checksums held by one checksum table block
+#define CSUMS_PER_BLOCK	(BLOCK_SIZE / sizeof(uint32_t))
 
 int diskfile = -1;
 
+#ifndef RUFS_BLOCK_SIZE
+int block_size = BLOCK_SIZE_MIN;
+#endif
+
+/* DISKFILE opened with O_DIRECT, and whether dev_open() should try to */
+static int direct = 0;
+static int direct_wanted = 0;
+
+/*
+ * Aligned block buffer pool. O_DIRECT transfers need block aligned memory,
+ * so scratch buffers come from here. Buffers are carved POOL_CHUNK at a time
+ * from one aligned allocation and freed ones are kept for reuse.
+ */
+#define POOL_CHUNK 16
+
+struct pool_blk {
+    struct pool_blk *next;
+};
+
+static struct pool_blk *pool_free = NULL;
+static int pool_carved = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Block checksum table, one CRC32C per block number. Changed table blocks
+ * go to disk with the blocks they cover, in the same dev_flush() or right
+ * after an unplugged write, so a block torn by a crash fails its check
+ * instead of being trusted. An entry of 0 marks a block that is not
+ * verified on read.
+ */
+static uint32_t *csum_table = NULL;
+static char *csum_dirty = NULL;
+static int csum_start = 0;
+static int csum_nblocks = 0;
+static int csum_mode = CSUM_OFF;
+
+/*
+ * Write queue. While plugged, block writes are held here instead of going
+ * to the DISKFILE: a block written again replaces its queued copy, reads
+ * are served from the queue and never wait behind it, and dev_unplug()
+ * sorts the queue and writes each run of consecutive blocks with a single
+ * pwritev(). Callers serialize plugged I/O.
+ */
+struct queued_write {
+    int		block_num;
+    int		checked;	/* checksum computed when the queue is flushed */
+    char	*buf;
+};
+
+static struct queued_write wqueue[WQUEUE_MAX];
+static char *wqueue_bufs = NULL;
+static int wqueue_len = 0;
+static int plugged = 0;
+
+//Aligned buffer of one block, NULL if out of memory
+void *dev_alloc_block() {
+    pthread_mutex_lock(&pool_lock);
+    if (!pool_free) {
+		char *chunk = NULL;
+		if (posix_memalign((void **)&chunk, BLOCK_SIZE, POOL_CHUNK * BLOCK_SIZE) != 0) {
+			pthread_mutex_unlock(&pool_lock);
+			return NULL;
+		}
+		pool_carved = 1;
+		for (int i = 0; i < POOL_CHUNK; i++) {
+			struct pool_blk *b = (struct pool_blk *)(chunk + (i * BLOCK_SIZE));
+			b->next = pool_free;
+			pool_free = b;
+		}
+    }
+
+    struct pool_blk *b = pool_free;
+    pool_free = b->next;
+    pthread_mutex_unlock(&pool_lock);
+    return b;
+}
+
+//Returns a buffer from dev_alloc_block() to the pool
+void dev_free_block(void *buf) {
+    if (!buf) {
+		return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    struct pool_blk *b = (struct pool_blk *)buf;
+    b->next = pool_free;
+    pool_free = b;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Sets the block size of the DISKFILE, from its superblock or for mkfs.
+ * Pool buffers are carved at the block size, so it cannot change once the
+ * first one is handed out.
+ */
+int dev_set_block_size(int size) {
+    if (!block_size_ok(size) || (pool_carved && size != BLOCK_SIZE)) {
+		return -1;
+    }
+
+#ifndef RUFS_BLOCK_SIZE
+    block_size = size;
+#endif
+    return 0;
+}
+
+//Makes dev_init() and dev_open() bypass the host page cache with O_DIRECT
+void dev_set_direct(int on) {
+    direct_wanted = on;
+}
+
+//Whether the DISKFILE bypasses the host page cache, all transfers must then be aligned
+int dev_direct() {
+    return direct;
+}
+
+static int open_disk(const char *diskfile_path, int flags) {
+    direct = 0;
+    if (direct_wanted) {
+		int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			direct = 1;
+			return fd;
+		}
+		if (errno != EINVAL) {
+			return fd;
+		}
+		fprintf(stderr, "disk_open: %s does not support O_DIRECT, using the page cache\n", diskfile_path);
+    }
+    return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+//One block transfer, through an aligned bounce buffer if O_DIRECT needs one
+static ssize_t disk_pread(void *buf, off_t pos) {
+    if (!direct || ((uintptr_t)buf % BLOCK_SIZE) == 0) {
+		return pread(diskfile, buf, BLOCK_SIZE, pos);
+    }
+
+    void *bounce = dev_alloc_block();
+    if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+    }
+    ssize_t ret = pread(diskfile, bounce, BLOCK_SIZE, pos);
+    if (ret > 0) {
+		memcpy(buf, bounce, ret);
+    }
+    dev_free_block(bounce);
+    return ret;
+}
+
+static ssize_t disk_pwrite(const void *buf, off_t pos) {
+    if (!direct || ((uintptr_t)buf % BLOCK_SIZE) == 0) {
+		return pwrite(diskfile, buf, BLOCK_SIZE, pos);
+    }
+
+    void *bounce = dev_alloc_block();
+    if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+    }
+    memcpy(bounce, buf, BLOCK_SIZE);
+    ssize_t ret = pwrite(diskfile, bounce, BLOCK_SIZE, pos);
+    dev_free_block(bounce);
+    return ret;
+}
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open_disk(diskfile_path, O_CREAT | O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
@@ -43,7 +218,7 @@ int dev_open(const char* diskfile_path) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open_disk(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
@@ -52,31 +227,346 @@ int dev_open(const char* diskfile_path) {
 }
 
 void dev_close() {
+    dev_flush();
+    for (int i = 0; wqueue_bufs && i < WQUEUE_MAX; i++) {
+		dev_free_block(wqueue[i].buf);
+    }
+    wqueue_bufs = NULL;
+    plugged = 0;
+    dev_csum_detach();
     if (diskfile >= 0) {
 		close(diskfile);
+		diskfile = -1;
+    }
+}
+
+static uint32_t block_csum(const void *buf) {
+    uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+    return crc ? crc : 1;
+}
+
+static int csum_covers(int block_num) {
+    return csum_table && block_num >= 0 && block_num < (csum_nblocks * CSUMS_PER_BLOCK);
+}
+
+static void csum_set(int block_num, uint32_t crc) {
+    if (csum_table[block_num] != crc) {
+		csum_table[block_num] = crc;
+		csum_dirty[block_num / CSUMS_PER_BLOCK] = 1;
     }
 }
 
+static struct queued_write *wqueue_find(int block_num) {
+    for (int i = 0; i < wqueue_len; i++) {
+		if (wqueue[i].block_num == block_num) {
+			return &wqueue[i];
+		}
+    }
+    return NULL;
+}
+
+static int wqueue_cmp(const void *a, const void *b) {
+    return ((const struct queued_write *)a)->block_num - ((const struct queued_write *)b)->block_num;
+}
+
+//Writes the queued blocks out in block order, merging consecutive ones, then the table entries of the blocks
+int dev_flush() {
+    int ret = 0;
+
+    // Blocks written many times in a request are checksummed once
+    for (int i = 0; i < wqueue_len; i++) {
+		if (csum_covers(wqueue[i].block_num)) {
+			csum_set(wqueue[i].block_num, wqueue[i].checked ? block_csum(wqueue[i].buf) : 0);
+		}
+    }
+
+    qsort(wqueue, wqueue_len, sizeof(struct queued_write), wqueue_cmp);
+
+    struct iovec iov[WQUEUE_MAX];
+    for (int i = 0; i < wqueue_len; ) {
+		int n = 0;
+		do {
+			iov[n].iov_base = wqueue[i + n].buf;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < wqueue_len && wqueue[i + n].block_num == wqueue[i].block_num + n);
+
+		ssize_t len = (ssize_t)n * BLOCK_SIZE;
+		if (pwritev(diskfile, iov, n, (off_t)wqueue[i].block_num * BLOCK_SIZE) != len) {
+			perror("block_flush failed");
+			ret = -1;
+		}
+		i += n;
+    }
+
+    wqueue_len = 0;
+    return (dev_csum_flush() < 0) ? -1 : ret;
+}
+
+//Starts holding writes in the queue, plugs nest
+void dev_plug() {
+    if (!wqueue_bufs) {
+		// Buffers stay with their slot, sorting moves only the pointers
+		for (int i = 0; i < WQUEUE_MAX; i++) {
+			wqueue[i].buf = dev_alloc_block();
+			if (!wqueue[i].buf) {
+				while (i-- > 0) {
+					dev_free_block(wqueue[i].buf);
+				}
+				return;
+			}
+		}
+		wqueue_bufs = wqueue[0].buf;
+    }
+    plugged++;
+}
+
+//Ends the outermost plug by flushing the queue
+int dev_unplug() {
+    if (plugged == 0 || --plugged > 0) {
+		return 0;
+    }
+    return dev_flush();
+}
+
+//Descriptor of the emulated disk, for callers that splice blocks directly. Queued writes must be flushed first
+int dev_fd() {
+    return diskfile;
+}
+
+//Whether reads of block_num are verified, such blocks must go through bio_read()
+int bio_checked(const int block_num) {
+    struct queued_write *q = plugged ? wqueue_find(block_num) : NULL;
+    if (q) {
+		return csum_mode != CSUM_OFF && q->checked;
+    }
+    return csum_mode != CSUM_OFF && csum_covers(block_num) && csum_table[block_num] != 0;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
+    struct queued_write *q = plugged ? wqueue_find(block_num) : NULL;
+    if (q) {
+		memcpy(buf, q->buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    retstat = disk_pread(buf, (off_t)block_num * BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
+		return retstat;
+    }
+
+    if (bio_checked(block_num) && block_csum(buf) != csum_table[block_num]) {
+		fprintf(stderr, "block_read: checksum mismatch in block %d\n", block_num);
+		errno = EIO;
+		return -1;
     }
 
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+static int write_block(const int block_num, const void *buf, int checked) {
+    int retstat = BLOCK_SIZE;
+    if (plugged) {
+		struct queued_write *q = wqueue_find(block_num);
+		if (!q) {
+			if (wqueue_len == WQUEUE_MAX && dev_flush() < 0) {
+				return -1;
+			}
+			q = &wqueue[wqueue_len++];
+			q->block_num = block_num;
+		}
+		memcpy(q->buf, buf, BLOCK_SIZE);
+		q->checked = checked;
+		return retstat;
+    }
+
+    retstat = disk_pwrite(buf, (off_t)block_num * BLOCK_SIZE);
     if (retstat < 0) {
 		perror("block_write failed");
+		return retstat;
+    }
+
+    if (csum_covers(block_num)) {
+		csum_set(block_num, checked ? block_csum(buf) : 0);
+		if (dev_csum_flush() < 0) {
+			return -1;
+		}
     }
     return retstat;
 }
 
+//Write a metadata block to the disk
+int bio_write(const int block_num, const void *buf) {
+    return write_block(block_num, buf, csum_mode != CSUM_OFF);
+}
+
+//Write a file data block to the disk
+int bio_write_data(const int block_num, const void *buf) {
+    return write_block(block_num, buf, csum_mode == CSUM_DATA);
+}
+
+/*
+ * Marks blocks written through dev_fd() instead of bio_write_data() as not
+ * verified. The entries reach the disk with the next flush, which has to
+ * come before the blocks are written.
+ */
+void bio_unchecked(const int block_num, int nblocks) {
+    for (int i = block_num; i < block_num + nblocks; i++) {
+		if (csum_covers(i)) {
+			csum_set(i, 0);
+		}
+    }
+
+    if (!plugged) {
+		dev_csum_flush();
+    }
+}
+
+/*
+ * Zeroes nblocks file data blocks from block_num. The range is punched out
+ * of the DISKFILE, so the host frees it and reads return zeros without
+ * touching the device; hosts without hole punching get zeros written.
+ */
+int bio_zero_data(const int block_num, int nblocks) {
+    // Queued copies of the blocks would land on top of the zeros
+    if (dev_flush() < 0) {
+		return -1;
+    }
+
+    off_t pos = (off_t)block_num * BLOCK_SIZE;
+    off_t len = (off_t)nblocks * BLOCK_SIZE;
+
+    if (fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) < 0) {
+		static char zeros[BLOCK_SIZE_MAX] __attribute__((aligned(BLOCK_SIZE_MIN)));
+		while (len > 0) {
+			size_t chunk = (len < (off_t)sizeof(zeros)) ? len : sizeof(zeros);
+			ssize_t ret = pwrite(diskfile, zeros, chunk, pos);
+			if (ret <= 0) {
+				perror("block_zero failed");
+				return -1;
+			}
+			pos += ret;
+			len -= ret;
+		}
+    }
+
+    // A punched range past the end of the DISKFILE is still past it, extend
+    // the file so readers that stop at the end, like rufs-fsck, see the blocks
+    struct stat st;
+    off_t end = (off_t)(block_num + nblocks) * BLOCK_SIZE;
+    if (fstat(diskfile, &st) < 0 || (st.st_size < end && ftruncate(diskfile, end) < 0)) {
+		perror("block_zero failed");
+		return -1;
+    }
+
+    uint32_t crc = 0;
+    if (csum_mode == CSUM_DATA) {
+		static const char zero_blk[BLOCK_SIZE_MAX];
+		crc = block_csum(zero_blk);
+    }
+    for (int i = block_num; i < block_num + nblocks; i++) {
+		if (csum_covers(i)) {
+			csum_set(i, crc);
+		}
+    }
+    return dev_csum_flush();
+}
+
+/*
+ * Starts checksumming with the nblocks table blocks at start_blk, loading
+ * the table from disk or, with format set, starting from an empty one
+ */
+int dev_csum_attach(int start_blk, int nblocks, int mode, int format) {
+    dev_csum_detach();
+
+    if (posix_memalign((void **)&csum_table, BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE) != 0) {
+		csum_table = NULL;
+    } else {
+		memset(csum_table, 0, (size_t)nblocks * BLOCK_SIZE);
+    }
+    csum_dirty = (char *)calloc(nblocks, 1);
+    if (!csum_table || !csum_dirty) {
+		perror("csum_attach failed");
+		dev_csum_detach();
+		return -1;
+    }
+
+    for (int i = 0; i < nblocks; i++) {
+		char *blk = (char *)csum_table + (i * BLOCK_SIZE);
+		if (format) {
+			csum_dirty[i] = 1;
+		} else if (disk_pread(blk, (off_t)(start_blk + i) * BLOCK_SIZE) < 0) {
+			perror("csum_attach failed");
+			dev_csum_detach();
+			return -1;
+		}
+    }
+
+    csum_start = start_blk;
+    csum_nblocks = nblocks;
+    csum_mode = mode;
+    return 0;
+}
+
+/*
+ * Recomputes every checked entry from the blocks on disk, for tables that
+ * were left stale by writes that bypass them, like rufs-fsck repairs
+ */
+int dev_csum_rebuild() {
+    char *buf = dev_alloc_block();
+    if (!buf) {
+		return -1;
+    }
+
+    for (int i = 0; i < csum_nblocks * CSUMS_PER_BLOCK; i++) {
+		if (csum_table[i] == 0) {
+			continue;
+		}
+
+		if (disk_pread(buf, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) {
+			csum_set(i, 0);
+		} else {
+			csum_set(i, block_csum(buf));
+		}
+    }
+
+    dev_free_block(buf);
+    return dev_csum_flush();
+}
+
+//Writes back the checksum table blocks changed since the last flush
+int dev_csum_flush() {
+    for (int i = 0; i < csum_nblocks; i++) {
+		if (!csum_dirty[i]) {
+			continue;
+		}
+
+		char *blk = (char *)csum_table + (i * BLOCK_SIZE);
+		if (disk_pwrite(blk, (off_t)(csum_start + i) * BLOCK_SIZE) < 0) {
+			perror("csum_flush failed");
+			return -1;
+		}
+		csum_dirty[i] = 0;
+    }
+
+    return 0;
+}
+
+void dev_csum_detach() {
+    if (csum_table) {
+		dev_csum_flush();
+		free(csum_table);
+		free(csum_dirty);
+    }
+
+    csum_table = NULL;
+    csum_dirty = NULL;
+    csum_nblocks = 0;
+    csum_mode = CSUM_OFF;
+}
+
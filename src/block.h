@@ -8,12 +8,65 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 4096
+/*
+ * Bytes per block. The block size of an image is chosen at mkfs, from
+ * BLOCK_SIZE_MIN to BLOCK_SIZE_MAX, and recorded in its superblock;
+ * block_size holds the one of the open image. Building with
+ * -DRUFS_BLOCK_SIZE=<size> makes it a constant, so the block arithmetic is
+ * folded at compile time, and such a build only opens images of that size.
+ */
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX 65536
+
+#ifdef RUFS_BLOCK_SIZE
+#define BLOCK_SIZE RUFS_BLOCK_SIZE
+#else
+#define BLOCK_SIZE block_size
+extern int block_size;
+#endif
+
+/* Whether images with blocks of size bytes can be opened */
+static inline int block_size_ok(int size) {
+#ifdef RUFS_BLOCK_SIZE
+    return size == RUFS_BLOCK_SIZE;
+#else
+    return size >= BLOCK_SIZE_MIN && size <= BLOCK_SIZE_MAX && (size & (size - 1)) == 0;
+#endif
+}
+
+/* Size of a new DISKFILE, 32MB */
+#define DISK_SIZE (32*1024*1024)
+
+/* Blocks held by the write queue between dev_plug() and dev_unplug() */
+#define WQUEUE_MAX	64
+
+/* Block checksum modes */
+#define CSUM_OFF	0			/* nothing is verified */
+#define CSUM_META	1			/* blocks written with bio_write() */
+#define CSUM_DATA	2			/* bio_write_data() blocks as well */
 
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_fd();
+int dev_set_block_size(int size);
+void dev_set_direct(int on);
+int dev_direct();
+void *dev_alloc_block();
+void dev_free_block(void *buf);
+void dev_plug();
+int dev_unplug();
+int dev_flush();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_write_data(const int block_num, const void *buf);
+int bio_checked(const int block_num);
+void bio_unchecked(const int block_num, int nblocks);
+int bio_zero_data(const int block_num, int nblocks);
+
+int dev_csum_attach(int start_blk, int nblocks, int mode, int format);
+int dev_csum_rebuild();
+int dev_csum_flush();
+void dev_csum_detach();
 
 #endif
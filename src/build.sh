@@ -1,8 +1,13 @@
 make clean
 make
+make rufs_clone
+make rufs_defrag
+make rufs-fsck
+make rufs-mkfs
 cd benchmark
 make clean
 make
 cd ..
-./rufs -s -d /tmp/csp126/mountdir
+[ -f DISKFILE ] && ./rufs-fsck -p DISKFILE
+./rufs -d /tmp/csp126/mountdir
 
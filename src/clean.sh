@@ -2,5 +2,5 @@ make clean
 cd benchmark/
 make clean
 cd ..
-fusermount -u /tmp/csp126/mountdir
+fusermount3 -u /tmp/csp126/mountdir
 rm DISKFILE
@@ -0,0 +1,156 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	crc32c.c
+ *
+ *	CRC32C with runtime dispatch. The hardware path runs three independent
+ *	crc32 instruction streams over a buffer and merges them with a table
+ *	driven shift, which hides the instruction latency on 4 KB blocks. The
+ *	software path is slicing-by-8.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+/* Reflected CRC32C polynomial */
+#define POLY 0x82F63B78
+
+/* Bytes per stream in the three way hardware loop, a multiple of 8 */
+#define STREAM_LEN 1360
+
+static uint32_t sw_table[8][256];
+
+/* shift_table[k][b] advances the register (b << 8k) over STREAM_LEN zero bytes */
+static uint32_t shift_table[4][256];
+
+static uint32_t (*crc_raw)(uint32_t, const uint8_t *, size_t) = NULL;
+
+/*
+ * The raw functions work on the CRC register without the initial and final
+ * inversion, like the crc32 instruction does
+ */
+static uint32_t crc_raw_sw(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = sw_table[7][v & 0xff] ^ sw_table[6][(v >> 8) & 0xff] ^
+			sw_table[5][(v >> 16) & 0xff] ^ sw_table[4][(v >> 24) & 0xff] ^
+			sw_table[3][(v >> 32) & 0xff] ^ sw_table[2][(v >> 40) & 0xff] ^
+			sw_table[1][(v >> 48) & 0xff] ^ sw_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+static inline uint32_t crc_shift(uint32_t crc) {
+	return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+		shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc_raw_hw(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+	while (len >= 3 * STREAM_LEN) {
+		uint64_t c0 = crc, c1 = 0, c2 = 0;
+		const uint8_t *p1 = p + STREAM_LEN;
+		const uint8_t *p2 = p + 2 * STREAM_LEN;
+
+		for (int i = 0; i < STREAM_LEN; i += 8) {
+			c0 = _mm_crc32_u64(c0, *(const uint64_t *)(p + i));
+			c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p1 + i));
+			c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p2 + i));
+		}
+
+		// The register is linear, so streams merge with a shift and xor
+		crc = crc_shift(crc_shift((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+		p += 3 * STREAM_LEN;
+		len -= 3 * STREAM_LEN;
+	}
+
+	uint64_t c = crc;
+	while (len >= 8) {
+		c = _mm_crc32_u64(c, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c;
+
+	while (len--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+
+	return crc;
+}
+#endif
+
+static void crc32c_init() {
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+		}
+		sw_table[0][i] = crc;
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int k = 1; k < 8; k++) {
+			uint32_t prev = sw_table[k - 1][i];
+			sw_table[k][i] = sw_table[0][prev & 0xff] ^ (prev >> 8);
+		}
+	}
+
+	static const uint8_t zeros[STREAM_LEN];
+	for (int k = 0; k < 4; k++) {
+		for (int b = 0; b < 256; b++) {
+			shift_table[k][b] = crc_raw_sw((uint32_t)b << (8 * k), zeros, STREAM_LEN);
+		}
+	}
+
+	crc_raw = crc_raw_sw;
+#ifdef HAVE_SSE42_CRC
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_raw = crc_raw_hw;
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	if (!crc_raw) {
+		crc32c_init();
+	}
+
+	return ~crc_raw(~crc, (const uint8_t *)buf, len);
+}
+
+int crc32c_hw_enabled() {
+	if (!crc_raw) {
+		crc32c_init();
+	}
+
+	return crc_raw != crc_raw_sw;
+}
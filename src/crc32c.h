@@ -0,0 +1,22 @@
+/*
+ *	Tiny File System
+ *	File:	crc32c.h
+ *
+ *	CRC32C (Castagnoli) used for block checksums. Uses the SSE4.2 crc32
+ *	instruction when the CPU has it and a table driven fallback otherwise.
+ *
+ */
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extends crc with len bytes of buf, start with crc = 0 */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Non-zero if crc32c() runs on the hardware instruction */
+int crc32c_hw_enabled();
+
+#endif
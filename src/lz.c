@@ -0,0 +1,230 @@
+/*
+ *	Tiny File System
+ *
+ *	File:	lz.c
+ *
+ *	Greedy single-pass LZ77 compressor producing the LZ4 block format:
+ *	a sequence is a token (literal length << 4 | match length - 4),
+ *	optional length extension bytes, the literals, and a 2 byte little
+ *	endian match offset. The last sequence carries literals only.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH	4
+#define HASH_BITS	12
+#define MAX_OFFSET	65535
+
+/* The last match must start this many bytes before the end of the input */
+#define MF_LIMIT	12
+
+/* The last bytes of the input are always emitted as literals */
+#define LAST_LITERALS	5
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Writes the 255-run extension of a length field, returns the new output position */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, int len) {
+	while (len >= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+		len -= 255;
+	}
+
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Emits one sequence, returns the new output position or NULL if dst is full */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len, int offset, int match_len) {
+	if (op >= oend) {
+		return NULL;
+	}
+
+	uint8_t *token = op++;
+	int ml = match_len ? (match_len - MIN_MATCH) : 0;
+
+	*token = (uint8_t)(((lit_len >= 15 ? 15 : lit_len) << 4) | (ml >= 15 ? 15 : ml));
+	if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15))) {
+		return NULL;
+	}
+
+	if (op + lit_len > oend) {
+		return NULL;
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len) {
+		return op;
+	}
+
+	if (op + 2 > oend) {
+		return NULL;
+	}
+	*op++ = (uint8_t)(offset & 0xff);
+	*op++ = (uint8_t)(offset >> 8);
+
+	if (ml >= 15 && !(op = put_length(op, oend, ml - 15))) {
+		return NULL;
+	}
+
+	return op;
+}
+
+/*
+ * Compresses src_len bytes of src into dst.
+ * Returns the compressed size, or 0 if it does not fit in dst_cap bytes.
+ */
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap) {
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *base = ip;
+	const uint8_t *anchor = ip;
+	const uint8_t *iend = ip + src_len;
+	const uint8_t *mflimit = iend - MF_LIMIT;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *oend = op + dst_cap;
+	int table[1 << HASH_BITS];
+
+	for (int i = 0; i < (1 << HASH_BITS); i++) {
+		table[i] = -1;
+	}
+
+	if (src_len > MF_LIMIT) {
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash32(seq);
+			int cand = table[h];
+			table[h] = (int)(ip - base);
+
+			if (cand < 0 || (ip - base) - cand > MAX_OFFSET || read32(base + cand) != seq) {
+				ip++;
+				continue;
+			}
+
+			// Extend the match forward, keeping the last literals
+			const uint8_t *match = base + cand;
+			const uint8_t *limit = iend - LAST_LITERALS;
+			int len = MIN_MATCH;
+			while (ip + len < limit && ip[len] == match[len]) {
+				len++;
+			}
+
+			op = put_sequence(op, oend, anchor, (int)(ip - anchor), (int)(ip - match), len);
+			if (!op) {
+				return 0;
+			}
+
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	// Trailing literals
+	op = put_sequence(op, oend, anchor, (int)(iend - anchor), 0, 0);
+	if (!op) {
+		return 0;
+	}
+
+	return (int)(op - (uint8_t *)dst);
+}
+
+/* Reads a 255-run length extension, returns -1 on truncated input */
+static int get_length(const uint8_t **ipp, const uint8_t *iend) {
+	const uint8_t *ip = *ipp;
+	int len = 0;
+	uint8_t b;
+
+	do {
+		if (ip >= iend) {
+			return -1;
+		}
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+
+	*ipp = ip;
+	return len;
+}
+
+/*
+ * Decompresses src_len bytes of src into dst.
+ * Returns the decompressed size, or -1 if src is malformed or dst is too small.
+ */
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap) {
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *iend = ip + src_len;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *oend = op + dst_cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int lit_len = token >> 4;
+
+		if (lit_len == 15) {
+			int ext = get_length(&ip, iend);
+			if (ext < 0) {
+				return -1;
+			}
+			lit_len += ext;
+		}
+
+		if (ip + lit_len > iend || op + lit_len > oend) {
+			return -1;
+		}
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		// The last sequence has no match
+		if (ip >= iend) {
+			break;
+		}
+
+		if (ip + 2 > iend) {
+			return -1;
+		}
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		int match_len = (token & 15);
+		if (match_len == 15) {
+			int ext = get_length(&ip, iend);
+			if (ext < 0) {
+				return -1;
+			}
+			match_len += ext;
+		}
+		match_len += MIN_MATCH;
+
+		if (offset == 0 || offset > op - (uint8_t *)dst || op + match_len > oend) {
+			return -1;
+		}
+
+		// Byte copy, matches may overlap their own output
+		const uint8_t *match = op - offset;
+		for (int i = 0; i < match_len; i++) {
+			op[i] = match[i];
+		}
+		op += match_len;
+	}
+
+	return (int)(op - (uint8_t *)dst);
+}
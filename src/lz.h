@@ -0,0 +1,19 @@
+/*
+ *	Tiny File System
+ *	File:	lz.h
+ *
+ *	Self-contained LZ77 block codec (LZ4 block format) used for
+ *	compressed file clusters.
+ *
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/* Worst case compressed size of len input bytes */
+#define LZ_BOUND(len) ((len) + ((len) / 255) + 16)
+
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);
+
+#endif
@@ -5,7 +5,7 @@
  *
  */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 #include <fuse.h>
 #include <stdlib.h>
@@ -16,23 +16,27 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <linux/falloc.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "block.h"
 #include "rufs.h"
+#include "lz.h"
 
 /* The total number of blocks on disk */
 // #define BLOCKS (DISK_SIZE / BLOCK_SIZE)
 
 /* The number of bytes needed to store MAX_INUM inodes in the inode region of disk */
-#define INODE_BYTES (MAX_INUM * sizeof(struct inode))
+#define INODE_BYTES (MAX_INUM * inode_size)
 
 /* The number of blocks needed to store MAX_INUM inodes in the inode region of disk */
 #define INODE_BLOCKS ((INODE_BYTES % BLOCK_SIZE) == 0 ? (INODE_BYTES / BLOCK_SIZE) : ((INODE_BYTES / BLOCK_SIZE) + 1))
 
 /* The number of Inodes per block */
-#define INODES (BLOCK_SIZE / sizeof(struct inode))
+#define INODES (BLOCK_SIZE / inode_size)
 
 /* The number of chars to store in inode_bitmap */
 #define IBMAP_BYTES ((MAX_INUM % 8) == 0 ? (MAX_INUM / 8) : ((MAX_INUM / 8) + 1))
@@ -44,7 +48,46 @@
 
 #define PTRS (BLOCK_SIZE / sizeof(int))
 
-#define MAX_FSIZE (16 * BLOCK_SIZE)
+/* file_bmap_locate() flags */
+#define BMAP_ALLOC 0x1		/* allocate missing pointer blocks */
+#define BMAP_COW 0x2		/* copy shared pointer blocks before they are modified */
+
+/* The number of data blocks a regular file can address */
+#define MAX_FBLOCKS (DIRECT_PTRS + (FILE_IND_PTRS * PTRS) + (PTRS * PTRS))
+
+#define MAX_FSIZE ((off_t)MAX_FBLOCKS * BLOCK_SIZE)
+
+/* Files up to this many bytes keep their data inside the inode */
+#define INLINE_MAX (sizeof(((struct inode *)0)->inline_data))
+
+/* The number of pointer blocks kept in the pointer block cache */
+#define PTR_CACHE_SIZE 16
+
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+/* Largest write request the kernel is asked to send */
+#define RUFS_MAX_WRITE (1024 * 1024)
+
+/* Blocks left free in front of a run reserved for a write past the mapped part of a file */
+#define RSV_GAP (RUFS_MAX_WRITE / BLOCK_SIZE)
+
+/* Data blocks per allocation group */
+#define AG_BLOCKS 2048
+
+/* The number of allocation groups */
+#define AG_COUNT (MAX_DNUM / AG_BLOCKS)
+
+/* Blocks a thread takes from a group at once for its single block allocations */
+#define AG_WINDOW 64
+
+/* Allocation windows, threads beyond this many share them */
+#define AG_WINDOWS 16
+
+/* Bytes moved per step when a copy goes through the read and write paths */
+#define COPY_CHUNK (16 * BLOCK_SIZE)
+
+/* Bytes of request temporaries the arena serves without malloc() */
+#define ARENA_SIZE (64 * BLOCK_SIZE_MIN)
 
 /* Index of super block */
 #define SU_BLK_IDX 0
@@ -58,11 +101,69 @@
 /* Index of start of Inode region */
 #define INODE_IDX 3
 
+/* Index of start of block reference count region */
+#define REFCNT_IDX (INODE_IDX + INODE_BLOCKS)
+
+/* The number of blocks holding one uint16_t reference count per data block */
+#define REFCNT_BLOCKS (((MAX_DNUM * sizeof(uint16_t)) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+/* Index of start of block checksum region */
+#define CSUM_IDX (REFCNT_IDX + REFCNT_BLOCKS)
+
+/* The number of blocks holding one CRC32C per block number */
+#define CSUM_BLOCKS (((MAX_DNUM * sizeof(uint32_t)) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+/* Index of start of snapshot region: the live inode map followed by one record per snapshot */
+#define SNAP_IDX (CSUM_IDX + CSUM_BLOCKS)
+
+#define SNAP_BLOCKS (1 + MAX_SNAPSHOTS)
+
 /* Index of start of data region */
-#define DATA_IDX (INODE_IDX + INODE_BLOCKS)
+#define DATA_IDX (SNAP_IDX + SNAP_BLOCKS)
+
+/* Hidden directory snapshots are browsed under */
+#define SNAP_DIR ".snapshots"
+
+/*
+ * Inodes read through snapshot s carry s + 1 above the inode number bits, so
+ * lookups below a snapshot root stay in that snapshot
+ */
+#define INO_BITS 10
+#define INO_MASK ((1 << INO_BITS) - 1)
+#define SNAP_OF(ino) ((int)((ino) >> INO_BITS) - 1)
+#define SNAP_INO(s, ino) ((((s) + 1) << INO_BITS) | ((ino) & INO_MASK))
+
+#if MAX_INUM > (1 << INO_BITS)
+#error "MAX_INUM does not fit in INO_BITS"
+#endif
+
+/* Slots in the in-memory dedup index, a power of two above MAX_DNUM */
+#define DEDUP_SLOTS (2 * MAX_DNUM)
 
 char diskfile_path[PATH_MAX];
 
+/*
+ * Options given on the command line, new images use compact inodes by
+ * default and block checksums only when csum= asks for them. Names,
+ * attributes and file data only change through kernel requests or are
+ * invalidated by the daemon, so the kernel may cache all of them for long.
+ */
+struct rufs_config rufs_conf = {
+	.inode_fmt			= INODE_FMT_COMPACT,
+	.csum				= CSUM_OFF,
+	.entry_timeout		= 60.0,
+	.attr_timeout		= 60.0,
+	.negative_timeout	= 60.0,
+	.file_cache			= CACHE_KEEP,
+	.snap_cache			= CACHE_KEEP,
+	.writeback			= 1,
+	.disk_direct		= 0
+};
+
+/* On-disk inode format of the mounted image and the size of one on-disk inode */
+int inode_fmt = INODE_FMT_LEGACY;
+size_t inode_size = sizeof(struct inode);
+
 /* Declare your in-memory data structures here */
 
 /* Pointer to block, for writing to, reading from, and initializing super block region of disk */
@@ -83,23 +184,152 @@ bitmap_t inode_bmap = NULL;
 /* Pointer to block, for writing to, reading from, and initializing data block bitmap region of disk */
 bitmap_t blk_bmap = NULL;
 
+/* Cached copy of an indirect pointer block, written through on every update */
+struct ptr_cache_entry {
+	int				blkno;			/* block number, 0 if the entry is unused */
+	unsigned long	last_use;		/* ptr_cache_clock value at last access */
+	int				*ptrs;			/* contents of the pointer block, a pool block */
+};
+
+/* Pointer blocks recently used by the file data path */
+struct ptr_cache_entry ptr_cache[PTR_CACHE_SIZE];
+unsigned long ptr_cache_clock = 0;
+
+/* Uncompressed copy of one cluster of a compressed file, compressed on writeback */
+struct cluster_cache {
+	int		ino;					/* inode of the cached cluster, -1 if empty */
+	int		cluster;				/* cluster index within the file */
+	int		dirty;					/* data differs from disk */
+	char	*data;					/* CLUSTER_BYTES of file data */
+};
+
+struct cluster_cache ccache = { .ino = -1 };
+
+/* Scratch buffer holding one compressed cluster as stored on disk */
+char *cluster_buf = NULL;
+
+/* In-memory copy of the reference count region, NULL on images without one */
+uint16_t *refcnt = NULL;
+
+/* Fingerprint of a file data block in the dedup index */
+struct dedup_entry {
+	uint64_t	hash;				/* block_hash() of the block contents */
+	int			blkno;				/* data block, 0 if the slot is empty */
+};
+
+/* Dedup index, only built when mounted with -o dedup */
+struct dedup_entry *dedup_index = NULL;
+
+/* Blocks whose dedup_index entry still matches their contents */
+bitmap_t dedup_valid = NULL;
+
+/* Inode region block i of the live file system is block imap[i], NULL on images without snapshots */
+int *imap = NULL;
+
+/* Snapshot records, a record is in use if its valid field is set */
+struct snapshot *snapshots = NULL;
+
+/* Blocks held by at least one snapshot, they are copied before being written */
+bitmap_t frozen_bmap = NULL;
+
+/* Free blocks of each allocation group */
+int ag_free[AG_COUNT];
+
+/* No block of group g below ag_hint[g] is free */
+int ag_hint[AG_COUNT];
+
+/* Group the current request allocates from */
+int ag_goal = 0;
+
+/* Blocks taken from the bitmap but not yet handed out, one run per window */
+struct ag_window {
+	int next;
+	int end;
+} ag_win[AG_WINDOWS];
+
+/* Window of the calling thread, -1 until its first allocation */
+__thread int ag_slot = -1;
+
+/* Windows handed to threads so far */
+int ag_slots = 0;
+
+/* Open handles of each inode, snapshot inodes included */
+uint16_t open_refs[(MAX_SNAPSHOTS + 1) << INO_BITS];
+
+/* Inode + 1 whose last read reply spliced each data block from the DISKFILE, 0 if none */
+uint16_t fd_reader[MAX_DNUM];
+
+/* Freed blocks kept allocated until the replies that may still splice them are done */
+uint8_t held_bmap[MAX_DNUM / 8];
+int held_count = 0;
+
+/* No inode below ino_hint is free */
+int ino_hint = 0;
+
+/* Held by every handler, rufs_write_buf() drops it while its data is in flight */
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held shared by rufs_write_buf() while its data is in flight, see drain_writes() */
+pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Block range of a file held by a read or write */
+struct range_lock {
+	uint16_t	ino;				/* inode of the file */
+	int			first;				/* first block index of the range */
+	int			last;				/* last block index of the range */
+	int			shared;				/* held by a read */
+	struct range_lock *next;
+};
+
+/* Range locks held, guarded by range_mutex */
+struct range_lock *range_locks = NULL;
+pthread_mutex_t range_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t range_cond = PTHREAD_COND_INITIALIZER;
+
+// Request arena, guarded by fs_lock
+struct arena_big {
+	struct arena_big	*next;
+	char				data[];
+};
+
+char arena_buf[ARENA_SIZE] __attribute__((aligned(16)));
+size_t arena_used = 0;
+struct arena_big *arena_overflow = NULL;
+
 /*_______________________HELPER FUNCTIONS_______________________*/
 
 int get_avail_ino();
 int get_avail_blkno();
+int ag_load();
+void drain_writes();
+int readi(uint16_t ino, struct inode *inode);
+int writei(uint16_t ino, struct inode *inode);
+int ccache_writeback(struct inode *cur, int *cur_dirty);
+void ptr_cache_invalidate(int blkno);
+void dedup_forget(int blkno);
+int *ptr_cache_get(int blkno);
+int get_file_blkno(struct inode *node, int blk_index, int alloc, int *is_new);
+int get_file_entry(struct inode *node, int blk_index, int *entry);
 char *get_dirname(const char *path);
 char *get_basename(const char *path);
+void *arena_alloc(size_t len);
+void arena_reset();
 int total_blocks_used();
 
 void print_macros(){
 	printf("\n______________________MACROS______________________\n");
+	printf("Block size: %d\n", BLOCK_SIZE);
 	printf("Super block index: %d\n", SU_BLK_IDX);
 	printf("Inode bitmap index: %d\n", IBMAP_IDX);
 	printf("Data block bitmap index: %d\n", DBMAP_IDX);
 	printf("Inodes region index: %d\n", INODE_IDX);
 	printf("Inode blocks: %ld\n", INODE_BLOCKS);
+	printf("Inode format: %s (%ld bytes)\n", inode_fmt == INODE_FMT_COMPACT ? "compact" : "legacy", inode_size);
 	printf("Inodes per block: %ld\n", INODES);
-	printf("Data region index: %ld\n", DATA_IDX);
+	printf("Refcount region index: %d (%d blocks)\n", su_blk->rc_start_blk, su_blk->rc_blocks);
+	printf("Checksum region index: %d (%d blocks)\n", su_blk->cs_start_blk, su_blk->cs_blocks);
+	printf("Snapshot region index: %d (%d blocks)\n", su_blk->sn_start_blk, su_blk->sn_blocks);
+	printf("Data region index: %d\n", su_blk->d_start_blk);
 	printf("Total blocks used after operation: %d\n", total_blocks_used());
 	printf("____________________END MACROS____________________\n\n");
 }
@@ -122,6 +352,7 @@ int format_dir_block(int blkno){
 }
 
 int format_ptr_block(int blkno){
+	ptr_cache_invalidate(blkno);
 	if(bio_read(blkno, ptr_blk) < 0){
 		return -1;
 	}
@@ -153,37 +384,37 @@ int format_data_block(int blkno){
 }
 
 int init_data_structures(){
-	su_blk = (struct superblock *)malloc(BLOCK_SIZE);
+	su_blk = (struct superblock *)dev_alloc_block();
 	if(!su_blk){
 		perror("Malloc failure: super block initialization\n");
 		return -1;
 	}
 
-	inode_bmap = (bitmap_t)malloc(BLOCK_SIZE);
+	inode_bmap = (bitmap_t)dev_alloc_block();
 	if(!inode_bmap){
 		perror("Malloc failure: Inode bitmap initialization\n");
 		return -1;
 	}
 
-	blk_bmap = (bitmap_t)malloc(BLOCK_SIZE);
+	blk_bmap = (bitmap_t)dev_alloc_block();
 	if(!blk_bmap){
 		perror("Malloc failure: data block bitmap initialization\n");
 		return -1;
 	}
 
-	inode_blk = (struct inode *)malloc(BLOCK_SIZE);
+	inode_blk = (struct inode *)dev_alloc_block();
 	if(!inode_blk){
 		perror("Malloc failure: inode block initialization\n");
 		return -1;
 	}
 
-	data_blk = malloc(BLOCK_SIZE);
+	data_blk = dev_alloc_block();
 	if(!data_blk){
 		perror("Malloc failure: data block initialization\n");
 		return -1;
 	}
 
-	ptr_blk = malloc(BLOCK_SIZE);
+	ptr_blk = dev_alloc_block();
 	if(!ptr_blk){
 		perror("Malloc failure: pointer block initialization\n");
 		return -1;
@@ -192,13 +423,29 @@ int init_data_structures(){
 	return 0;
 }
 
+/*
+ * Selects the on-disk inode format used by readi() and writei()
+ */
+void set_inode_format(int fmt){
+	if(fmt == INODE_FMT_COMPACT){
+		inode_fmt = INODE_FMT_COMPACT;
+		inode_size = sizeof(struct dinode);
+	}else{
+		inode_fmt = INODE_FMT_LEGACY;
+		inode_size = sizeof(struct inode);
+	}
+}
+
 int init_superblock(){
-	su_blk = (struct superblock *)malloc(BLOCK_SIZE);
+	su_blk = (struct superblock *)dev_alloc_block();
 	if(!su_blk){
 		perror("Malloc failure: super block initialization\n");
 		return -1;
 	}
 
+	// The inode format decides the size of the inode region
+	set_inode_format(rufs_conf.inode_fmt);
+
 	memset(su_blk, '\0', BLOCK_SIZE);
 	su_blk->magic_num = MAGIC_NUM;
 	su_blk->max_inum = MAX_INUM;
@@ -207,12 +454,27 @@ int init_superblock(){
 	su_blk->d_bitmap_blk = DBMAP_IDX;
 	su_blk->i_start_blk = INODE_IDX;
 	su_blk->d_start_blk = DATA_IDX;
+	su_blk->inode_fmt = inode_fmt;
+	su_blk->inode_size = inode_size;
+	su_blk->block_size = BLOCK_SIZE;
+	su_blk->rc_start_blk = REFCNT_IDX;
+	su_blk->rc_blocks = REFCNT_BLOCKS;
+	su_blk->cs_start_blk = CSUM_IDX;
+	su_blk->cs_blocks = CSUM_BLOCKS;
+	su_blk->cs_state = CSUM_CLEAN;
+	su_blk->sn_start_blk = SNAP_IDX;
+	su_blk->sn_blocks = (INODE_BLOCKS <= MAX_INODE_BLOCKS) ? SNAP_BLOCKS : 0;
+
+	// Every block written from here on gets a checksum
+	if(dev_csum_attach(su_blk->cs_start_blk, su_blk->cs_blocks, rufs_conf.csum, 1) < 0){
+		return -1;
+	}
 
 	return bio_write(0, su_blk);
 }
 
 int init_inode_bitmap(){
-	inode_bmap = (bitmap_t)malloc(BLOCK_SIZE);
+	inode_bmap = (bitmap_t)dev_alloc_block();
 	if(!inode_bmap){
 		perror("Malloc failure: Inode bitmap initialization\n");
 		return -1;
@@ -223,7 +485,7 @@ int init_inode_bitmap(){
 }
 
 int init_data_bitmap(){
-	blk_bmap = (bitmap_t)malloc(BLOCK_SIZE);
+	blk_bmap = (bitmap_t)dev_alloc_block();
 	if(!blk_bmap){
 		perror("Malloc failure: data block bitmap initialization\n");
 		return -1;
@@ -242,7 +504,11 @@ int init_data_bitmap(){
 		set_bitmap(blk_bmap, count++);
 	}
 
-	return bio_write(su_blk->d_bitmap_blk, blk_bmap);
+	if(bio_write(su_blk->d_bitmap_blk, blk_bmap) < 0){
+		return -1;
+	}
+
+	return ag_load();
 }
 
 /*
@@ -250,13 +516,19 @@ int init_data_bitmap(){
  * Initializes first inode to root
 */
 int init_inode_region(){
-	inode_blk = (struct inode *)malloc(BLOCK_SIZE);
+	inode_blk = (struct inode *)dev_alloc_block();
 	if(!inode_blk){
 		perror("Malloc failure: inode block initialization\n");
 		return -1;
 	}
 	memset(inode_blk, '\0', BLOCK_SIZE);
 
+	for(int count = INODE_IDX; count < (INODE_IDX + INODE_BLOCKS); count++){
+		if(bio_write(count, inode_blk) < 0){
+			return -1;
+		}
+	}
+
 	int ino = get_avail_ino();
 	int blk_no = get_avail_blkno();
 	if(ino < 0 || blk_no < 0){
@@ -268,12 +540,14 @@ int init_inode_region(){
 		return -1;
 	}
 
-	inode_blk[ino].ino = ino;
-	inode_blk[ino].valid = 1;
-	inode_blk[ino].size = 1;
-	inode_blk[ino].type = S_IFDIR;
-	inode_blk[ino].link = 0;
-	inode_blk[ino].direct_ptr[0] = blk_no;
+	struct inode root;
+	memset(&root, '\0', sizeof(struct inode));
+	root.ino = ino;
+	root.valid = 1;
+	root.size = 1;
+	root.type = S_IFDIR;
+	root.link = 0;
+	root.direct_ptr[0] = blk_no;
 
 	if(bio_read(blk_no, data_blk) < 0){
 		return -1;
@@ -291,25 +565,70 @@ int init_inode_region(){
 		return -1;
 	}
 
-	time(&(inode_blk[ino].vstat.st_atime));
-	time(&(inode_blk[ino].vstat.st_mtime));
+	time(&(root.vstat.st_atime));
+	time(&(root.vstat.st_mtime));
 
-	for(int i = 1; i < 24; i++){
-		if(i < 16){
-			inode_blk[ino].direct_ptr[i] = 0;
-		}else{
-			inode_blk[ino].indirect_ptr[i - 16] = 0;
+	return writei(ino, &root);
+}
+
+/*
+ * Zeroes the reference count region and loads it into memory
+ */
+int init_refcnt_region(){
+	refcnt = (uint16_t *)calloc(su_blk->rc_blocks, BLOCK_SIZE);
+	if(!refcnt){
+		perror("Malloc failure: reference count initialization\n");
+		return -1;
+	}
+
+	for(int i = 0; i < su_blk->rc_blocks; i++){
+		if(bio_write(su_blk->rc_start_blk + i, (char *)refcnt + (i * BLOCK_SIZE)) < 0){
+			return -1;
 		}
 	}
 
-	if(bio_write(INODE_IDX, inode_blk) < 0){
+	return 0;
+}
+
+/*
+ * Loads the checksum table of a mounted image. The table is written with
+ * the blocks it covers, so it is trusted even after a crash; only tables
+ * left stale by a rufs-fsck repair are recomputed.
+ */
+int load_csum_region(){
+	if(su_blk->cs_blocks == 0){
+		return 0;
+	}
+
+	if(dev_csum_attach(su_blk->cs_start_blk, su_blk->cs_blocks, rufs_conf.csum, 0) < 0){
+		return -1;
+	}
+
+	if(su_blk->cs_state & CSUM_CLEAN){
+		return 0;
+	}
+
+	if(dev_csum_rebuild() < 0 || bio_read(SU_BLK_IDX, su_blk) < 0){
+		return -1;
+	}
+
+	su_blk->cs_state |= CSUM_CLEAN;
+	return bio_write(SU_BLK_IDX, su_blk);
+}
+
+int load_refcnt_region(){
+	if(su_blk->rc_blocks == 0){
+		return 0;
+	}
+
+	refcnt = (uint16_t *)malloc(su_blk->rc_blocks * BLOCK_SIZE);
+	if(!refcnt){
+		perror("Malloc failure: reference count initialization\n");
 		return -1;
 	}
-	memset(&inode_blk[ino], '\0', sizeof(struct inode));
 
-	int count = INODE_IDX + 1;
-	while(count < INODE_BLOCKS){
-		if(bio_write(count++, inode_blk) < 0){
+	for(int i = 0; i < su_blk->rc_blocks; i++){
+		if(bio_read(su_blk->rc_start_blk + i, (char *)refcnt + (i * BLOCK_SIZE)) < 0){
 			return -1;
 		}
 	}
@@ -318,7 +637,7 @@ int init_inode_region(){
 }
 
 int init_data_block(){
-	data_blk = malloc(BLOCK_SIZE);
+	data_blk = dev_alloc_block();
 	if(!data_blk){
 		perror("Malloc failure: data block initialization\n");
 		return -1;
@@ -328,7 +647,7 @@ int init_data_block(){
 }
 
 int init_ptr_block(){
-	ptr_blk = malloc(BLOCK_SIZE);
+	ptr_blk = dev_alloc_block();
 	if(!ptr_blk){
 		perror("Malloc failure: pointer block initialization\n");
 		return -1;
@@ -338,11 +657,18 @@ int init_ptr_block(){
 }
 
 int get_inode_block(uint16_t ino){
-	return ((ino / INODES) + INODE_IDX);
+	int s = SNAP_OF(ino);
+	int idx = (ino & INO_MASK) / INODES;
+
+	if(s >= 0){
+		return snapshots[s].imap[idx];
+	}
+
+	return imap ? imap[idx] : (idx + INODE_IDX);
 }
 
 int get_inode_offset(uint16_t ino){
-	return (ino % INODES);
+	return ((ino & INO_MASK) % INODES);
 }
 
 
@@ -374,9 +700,9 @@ int get_avail_ino() {
 		return -1;
 	}
 
-	// Step 2: Traverse inode bitmap to find an available slot
+	// Step 2: Traverse inode bitmap to find an available slot, past the ones known to be taken
 	int ino = -1;
-	for(int i = 0; i < MAX_INUM; i++){
+	for(int i = ino_hint; i < MAX_INUM; i++){
 		if(get_bitmap(inode_bmap, i) == 0){
 			ino = i;
 			break;
@@ -393,930 +719,3838 @@ int get_avail_ino() {
 		return -1;
 	}
 
+	ino_hint = ino + 1;
 	return ino;
 }
 
+/*
+ * allocation groups
+ *
+ * The data bitmap is split into AG_COUNT groups of AG_BLOCKS blocks, each
+ * with its free block count and a hint below which it has no free block.
+ * A request allocates from the group ag_goal names: the group of the block
+ * in front of the write, or for a file without one the group its inode
+ * number picks. Files written side by side fill disjoint ranges instead of
+ * interleaving at the front of the bitmap, an allocation resumes the scan at
+ * the hint instead of block 0, and full groups are skipped without reading
+ * their bits. A request whose group has filled moves on to the group with
+ * the most free blocks.
+ *
+ * Single blocks come from a window of up to AG_WINDOW free blocks that the
+ * thread takes from the group in one bitmap write and hands out without
+ * scanning or writing the bitmap again, so requests running side by side
+ * hold fs_lock only briefly to allocate and each fills its own run. A window
+ * outside the request's group goes back to the bitmap and a new one is taken,
+ * and once no group has a free block left the windows of every thread are
+ * returned before the allocation fails. The blocks of a window are marked
+ * allocated until then, ag_drain_windows() returns them before anything that
+ * treats a marked but unreferenced block as garbage.
+ */
+int ag_load(){
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -1;
+	}
+
+	// Nothing is handed out yet, hints left by an earlier mount do not apply
+	ino_hint = 0;
+	memset(ag_win, 0, sizeof(ag_win));
+	memset(open_refs, 0, sizeof(open_refs));
+	memset(fd_reader, 0, sizeof(fd_reader));
+	memset(held_bmap, 0, sizeof(held_bmap));
+	held_count = 0;
+
+	for(int g = 0; g < AG_COUNT; g++){
+		ag_free[g] = 0;
+		ag_hint[g] = g * AG_BLOCKS;
+		for(int i = g * AG_BLOCKS; i < (g + 1) * AG_BLOCKS; i++){
+			ag_free[g] += !get_bitmap(blk_bmap, i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sets the group the blocks of node are allocated from, prev being the block
+ * mapped in front of the ones about to be written, 0 if there is none
+ */
+void ag_set_goal(struct inode *node, int prev){
+	ag_goal = (prev > 0) ? (prev / AG_BLOCKS) : (node->ino % AG_COUNT);
+}
+
+/*
+ * Group with the most free blocks, -1 once every group is full
+ */
+int ag_emptiest(){
+	int best = -1;
+
+	for(int g = 0; g < AG_COUNT; g++){
+		if(ag_free[g] > 0 && (best == -1 || ag_free[g] > ag_free[best])){
+			best = g;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Marks blkno allocated, or free, in blk_bmap and its group
+ */
+void bmap_take(int blkno){
+	int g = blkno / AG_BLOCKS;
+
+	set_bitmap(blk_bmap, blkno);
+	ag_free[g]--;
+	if(ag_hint[g] == blkno){
+		ag_hint[g]++;
+	}
+	ptr_cache_invalidate(blkno);
+}
+
+void bmap_free(int blkno){
+	int g = blkno / AG_BLOCKS;
+
+	unset_bitmap(blk_bmap, blkno);
+	ag_free[g]++;
+	if(ag_hint[g] > blkno){
+		ag_hint[g] = blkno;
+	}
+	ptr_cache_invalidate(blkno);
+}
+
+/*
+ * Window of the calling thread
+ */
+struct ag_window *ag_window(){
+	if(ag_slot == -1){
+		ag_slot = ag_slots++ % AG_WINDOWS;
+	}
+
+	return &ag_win[ag_slot];
+}
+
+/*
+ * Returns the unused blocks of window w to blk_bmap, the caller writes it
+ */
+void ag_put_window(struct ag_window *w){
+	for(int i = w->next; i < w->end; i++){
+		bmap_free(i);
+	}
+
+	w->next = 0;
+	w->end = 0;
+}
+
+/*
+ * Returns the unused blocks of every window to the bitmap
+ */
+int ag_drain_windows(){
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -1;
+	}
+
+	for(int i = 0; i < AG_WINDOWS; i++){
+		ag_put_window(&ag_win[i]);
+	}
+
+	return bio_write(DBMAP_IDX, blk_bmap);
+}
+
 /* 
  * Get available data block number from bitmap
  */
 int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
+	// Step 1: Hand out the thread's window while it is in the request's group
+	struct ag_window *w = ag_window();
+	if(w->next < w->end && ((w->next / AG_BLOCKS) == ag_goal || ag_free[ag_goal] == 0)){
+		return w->next++;
+	}
+
+	// Step 2: Read data block bitmap from disk and return what is left of the window
 	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
 		return -1;
 	}
+	ag_put_window(w);
 	
-	// Step 2: Traverse data block bitmap to find an available slot
+	// Step 3: Pick the group, the request's own unless it is full
+	int g = ag_goal;
+	if(ag_free[g] == 0){
+		g = ag_emptiest();
+		for(int i = 0; g == -1 && i < AG_WINDOWS; i++){
+			// The last free blocks may sit in the windows of other threads
+			ag_put_window(&ag_win[i]);
+			g = ag_emptiest();
+		}
+		if(g == -1){
+			bio_write(DBMAP_IDX, blk_bmap);
+			return -1;
+		}
+		ag_goal = g;
+	}
+
+	// Step 4: Traverse the group's bitmap from its hint to find an available slot
 	int blk = -1;
-	for(int i = 0; i < MAX_DNUM; i++){
+	for(int i = ag_hint[g]; i < (g + 1) * AG_BLOCKS; i++){
 		if(get_bitmap(blk_bmap, i) == 0){
 			blk = i;
 			break;
 		}
 	}
 
-	// Step 3: Update data block bitmap and write to disk 
 	if(blk == -1){
+		bio_write(DBMAP_IDX, blk_bmap);
 		return -1;
 	}
+	ag_hint[g] = blk;
+
+	// Step 5: Take the free run there as the new window, dropping any stale cached copy of its blocks
+	int end = blk;
+	while(end < blk + AG_WINDOW && end < (g + 1) * AG_BLOCKS && get_bitmap(blk_bmap, end) == 0){
+		bmap_take(end++);
+	}
 
-	set_bitmap(blk_bmap, blk);
+	// Step 6: Write the data block bitmap to disk
 	if(bio_write(DBMAP_IDX, blk_bmap) < 0){
 		return -1;
 	}
 
+	w->next = blk + 1;
+	w->end = end;
 	return blk;
 }
 
-/* 
- * inode operations
+/*
+ * First run of count free blocks in blk_bmap at or after block from, -1 if
+ * there is none
  */
-int readi(uint16_t ino, struct inode *inode) {
-  // Step 1: Get the inode's on-disk block number
-  // Step 2: Get offset of the inode in the inode on-disk block
-  // Step 3: Read the block from disk and then copy into inode structure
-	int block = get_inode_block(ino);
-	int offset = get_inode_offset(ino);
+int find_blkrun(int from, int count){
+	int run = 0;
+
+	for(int i = (from > 0) ? from : 0; i < MAX_DNUM; i++){
+		// A full group ends any run and holds none
+		if((i % AG_BLOCKS) == 0 && ag_free[i / AG_BLOCKS] == 0){
+			run = 0;
+			i += AG_BLOCKS - 1;
+			continue;
+		}
 
-	if(bio_read(block, inode_blk) < 0){
-		return -1;
+		if(get_bitmap(blk_bmap, i) != 0){
+			run = 0;
+			continue;
+		}
+
+		if(++run == count){
+			return i - count + 1;
+		}
 	}
 
-	memcpy(inode, &inode_blk[offset], sizeof(struct inode));
-	return 0;
+	return -1;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
-	// Step 1: Get the block number where this inode resides on disk
-	// Step 2: Get the offset in the block where this inode resides on disk
-	// Step 3: Write inode to disk
- 	int block = get_inode_block(ino);
-	int offset = get_inode_offset(ino);
+/*
+ * First run of count free blocks from the start of the request's group,
+ * wrapping around to the front of the bitmap
+ */
+int find_blkrun_goal(int count){
+	int start = find_blkrun(ag_goal * AG_BLOCKS, count);
+	return (start != -1) ? start : find_blkrun(0, count);
+}
 
-	if(bio_read(block, inode_blk) < 0){
+/*
+ * Allocates the count blocks at start, found free in blk_bmap
+ */
+int take_blkrun(int start, int count){
+	for(int i = start; i < start + count; i++){
+		bmap_take(i);
+	}
+
+	if(bio_write(DBMAP_IDX, blk_bmap) < 0){
 		return -1;
 	}
 
-	memcpy(&inode_blk[offset], inode, sizeof(struct inode));
+	return start;
+}
 
-	if(bio_write(block, inode_blk) < 0){
+/*
+ * Get count contiguous available data blocks from bitmap, returns the first one
+ */
+int get_avail_blkrun(int count) {
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
 		return -1;
 	}
-	
-	return 0;
-}
 
-int get_dirent_from_block(void *blk, const char *fname, size_t name_len, struct dirent *dirent){
-	struct dirent *dir_ents = (struct dirent *)blk;
-	for(int i = 0; i < DIRENTS; i++){
-		if(!dir_ents[i].valid){
-			continue;
-		}else if(name_len == dir_ents[i].len && strcmp(dir_ents[i].name, fname) == 0){
-			memcpy(dirent, &dir_ents[i], sizeof(struct dirent));
-			return 1;
-		}
+	int start = find_blkrun_goal(count);
+	if(start == -1){
+		return -1;
 	}
 
-	return 0;
+	return take_blkrun(start, count);
 }
 
+/*
+ * held blocks
+ *
+ * read_buf replies with DISKFILE ranges that libfuse splices only after the
+ * handler has returned and the locks are dropped, so a block freed in the
+ * meantime by a defrag, a clone, a dedup or CoW write or a snapshot deletion
+ * must not be handed to another file yet. fd_reader records the inode whose
+ * reply last pointed at each block. A block freed while that inode is open
+ * is held: it stays allocated until the inode's last handle is released,
+ * which the kernel only does once the replies read through it are done.
+ */
 
-/* 
- * directory operations
+/*
+ * Whether a read reply may still splice blkno
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	// Step 2: Get data block of current directory from inode
-	// Step 3: Read directory's data block and check each directory entry.
-	// If the name matches, then copy directory entry to dirent structure
-	struct inode dir_inode;
-	if(readi(ino, &dir_inode) < 0){
-		return -1;
-	}
+int block_in_reply(int blkno){
+	int reader = fd_reader[blkno];
 
-	if(!dir_inode.valid || dir_inode.size <= 0 || dir_inode.type != S_IFDIR){
-		return -1;
+	if(reader > 0 && open_refs[reader - 1] > 0){
+		return 1;
 	}
 
-	int blk_ptr = 0;
-	int indir_ptr = 0;
-	for(int i = 0; i < 24; i++){
-		if(i < 16){
-			blk_ptr = dir_inode.direct_ptr[i];
-			if(blk_ptr == 0){
-				return -1;
-			}else if(bio_read(blk_ptr, data_blk) < 0){
-				return -1;
-			}
-		
-			if(get_dirent_from_block(data_blk, fname, name_len, dirent)){
-				return 0;
+	fd_reader[blkno] = 0;
+	return 0;
+}
+
+/*
+ * Frees blkno in blk_bmap, or holds it while a read reply may still splice it
+ */
+void bmap_release(int blkno){
+	dedup_forget(blkno);
+
+	if(block_in_reply(blkno)){
+		set_bitmap(held_bmap, blkno);
+		held_count++;
+		return;
+	}
+
+	bmap_free(blkno);
+}
+
+/*
+ * Frees the blocks held for the replies of ino, all of them if ino is -1
+ */
+int release_held(int ino){
+	if(held_count == 0){
+		return 0;
+	}
+
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -1;
+	}
+
+	for(int blkno = 0; blkno < MAX_DNUM; blkno++){
+		if(get_bitmap(held_bmap, blkno) && (ino == -1 || fd_reader[blkno] == ino + 1)){
+			unset_bitmap(held_bmap, blkno);
+			held_count--;
+			fd_reader[blkno] = 0;
+			bmap_free(blkno);
+		}
+	}
+
+	return bio_write(DBMAP_IDX, blk_bmap);
+}
+
+/*
+ * Counts an open handle of node, fi->fh keeps its inode for rufs_release()
+ */
+void open_ref(struct inode *node, struct fuse_file_info *fi){
+	if(!fi){
+		return;
+	}
+
+	fi->fh = node->ino;
+	open_refs[node->ino]++;
+}
+
+/*
+ * Return a data block to the bitmap
+ */
+int release_blkno(int blkno) {
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -1;
+	}
+
+	bmap_release(blkno);
+
+	return bio_write(DBMAP_IDX, blk_bmap);
+}
+
+/*
+ * block reference counts
+ *
+ * Data blocks shared by several files (dedup) have their number of owners
+ * in the reference count region. 0 stands for a single owner, so images and
+ * blocks that never get shared need no updates there. A shared block is never
+ * written in place: writers copy it first and drop their reference.
+ */
+int write_refcnt(int blkno){
+	int blk = (blkno * sizeof(uint16_t)) / BLOCK_SIZE;
+	return bio_write(su_blk->rc_start_blk + blk, (char *)refcnt + (blk * BLOCK_SIZE));
+}
+
+int block_refs(int blkno){
+	if(!refcnt || refcnt[blkno] == 0){
+		return 1;
+	}
+
+	return refcnt[blkno];
+}
+
+/*
+ * Adds an owner to blkno, fails if the image has no reference counts or the
+ * count is saturated
+ */
+int block_ref(int blkno){
+	if(!refcnt || refcnt[blkno] == UINT16_MAX){
+		return -1;
+	}
+
+	refcnt[blkno] = block_refs(blkno) + 1;
+	return write_refcnt(blkno);
+}
+
+/*
+ * Whether blkno must be copied before it is written: it has several owners
+ * or a snapshot holds it
+ */
+int block_shared(int blkno){
+	if(frozen_bmap && get_bitmap(frozen_bmap, blkno)){
+		return 1;
+	}
+
+	return block_refs(blkno) > 1;
+}
+
+/*
+ * Drops an owner of blkno and frees it with the last one, returns 1 if freed.
+ * Blocks held by a snapshot stay allocated until the snapshot is deleted.
+ */
+int block_unref(int blkno){
+	int refs = block_refs(blkno);
+
+	if(refs <= 1 && frozen_bmap && get_bitmap(frozen_bmap, blkno)){
+		dedup_forget(blkno);
+		return 0;
+	}
+
+	if(refs <= 1){
+		return (release_blkno(blkno) < 0) ? -1 : 1;
+	}
+
+	refcnt[blkno] = (refs == 2) ? 0 : (refs - 1);
+	return (write_refcnt(blkno) < 0) ? -1 : 0;
+}
+
+/*
+ * dedup index
+ *
+ * Maps block_hash() fingerprints to data blocks holding that content. The
+ * index lives in memory and is rebuilt from the file block maps at mount.
+ * Entries are only trusted while the block's dedup_valid bit is set, and a
+ * candidate is compared byte for byte before it is shared.
+ */
+uint64_t block_hash(const void *blk){
+	const uint64_t *words = (const uint64_t *)blk;
+	uint64_t h = 0x9E3779B97F4A7C15ULL;
+
+	for(int i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++){
+		h ^= words[i] * 0xC2B2AE3D27D4EB4FULL;
+		h = ((h << 31) | (h >> 33)) * 0x9E3779B97F4A7C15ULL;
+	}
+
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+void dedup_forget(int blkno){
+	if(dedup_valid){
+		unset_bitmap(dedup_valid, blkno);
+	}
+}
+
+void dedup_insert(uint64_t hash, int blkno){
+	if(!dedup_index){
+		return;
+	}
+
+	uint32_t slot = hash & (DEDUP_SLOTS - 1);
+	for(int i = 0; i < DEDUP_SLOTS; i++){
+		struct dedup_entry *e = &dedup_index[(slot + i) & (DEDUP_SLOTS - 1)];
+
+		// Reuse empty and stale slots
+		if(e->blkno == 0 || !get_bitmap(dedup_valid, e->blkno) || e->blkno == blkno){
+			e->hash = hash;
+			e->blkno = blkno;
+			set_bitmap(dedup_valid, blkno);
+			return;
+		}
+	}
+}
+
+/*
+ * Returns a data block whose contents equal blk, 0 if there is none.
+ * Uses ptr_blk as scratch space.
+ */
+int dedup_lookup(uint64_t hash, const void *blk){
+	uint32_t slot = hash & (DEDUP_SLOTS - 1);
+
+	for(int i = 0; i < DEDUP_SLOTS; i++){
+		struct dedup_entry *e = &dedup_index[(slot + i) & (DEDUP_SLOTS - 1)];
+
+		if(e->blkno == 0){
+			return 0;
+		}
+
+		if(e->hash != hash || !get_bitmap(dedup_valid, e->blkno) || block_refs(e->blkno) >= UINT16_MAX){
+			continue;
+		}
+
+		if(bio_read(e->blkno, ptr_blk) >= 0 && memcmp(ptr_blk, blk, BLOCK_SIZE) == 0){
+			return e->blkno;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Builds the dedup index from the data blocks of every uncompressed file
+ */
+int dedup_init(){
+	if(!refcnt){
+		fprintf(stderr, "rufs: dedup needs an image with a reference count region\n");
+		return -1;
+	}
+
+	dedup_index = (struct dedup_entry *)calloc(DEDUP_SLOTS, sizeof(struct dedup_entry));
+	dedup_valid = (bitmap_t)calloc(1, BLOCK_SIZE);
+	if(!dedup_index || !dedup_valid){
+		perror("Malloc failure: dedup index initialization\n");
+		return -1;
+	}
+
+	if(bio_read(IBMAP_IDX, inode_bmap) < 0){
+		return -1;
+	}
+
+	for(int ino = 0; ino < MAX_INUM; ino++){
+		struct inode node;
+		if(!get_bitmap(inode_bmap, ino) || readi(ino, &node) < 0){
+			continue;
+		}
+
+		if(!node.valid || node.type != S_IFREG || (node.flags & (INODE_INLINE | INODE_COMPRESSED))){
+			continue;
+		}
+
+		for(int i = 0; i < node.size; i++){
+			int blkno = get_file_blkno(&node, i, 0, NULL);
+			if(blkno > 0 && !get_bitmap(dedup_valid, blkno) && bio_read(blkno, data_blk) >= 0){
+				dedup_insert(block_hash(data_blk), blkno);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* 
+ * inode operations
+ */
+int readi(uint16_t ino, struct inode *inode) {
+  // Step 1: Get the inode's on-disk block number
+  // Step 2: Get offset of the inode in the inode on-disk block
+  // Step 3: Read the block from disk and then copy into inode structure
+	int block = get_inode_block(ino);
+	int offset = get_inode_offset(ino);
+
+	if(bio_read(block, inode_blk) < 0){
+		return -1;
+	}
+
+	void *disk_inode = (char *)inode_blk + (offset * inode_size);
+	if(inode_fmt == INODE_FMT_COMPACT){
+		dinode_to_inode((struct dinode *)disk_inode, inode);
+	}else{
+		memcpy(inode, disk_inode, sizeof(struct inode));
+	}
+
+	// Keep the snapshot the inode was read through
+	inode->ino = ino;
+	return 0;
+}
+
+int writei(uint16_t ino, struct inode *inode) {
+	// Step 1: Get the block number where this inode resides on disk
+	// Step 2: Get the offset in the block where this inode resides on disk
+	// Step 3: Write inode to disk
+	if(SNAP_OF(ino) >= 0){
+		return -1;
+	}
+
+ 	int block = get_inode_block(ino);
+	int offset = get_inode_offset(ino);
+
+	if(bio_read(block, inode_blk) < 0){
+		return -1;
+	}
+
+	void *disk_inode = (char *)inode_blk + (offset * inode_size);
+	if(inode_fmt == INODE_FMT_COMPACT){
+		inode_to_dinode(inode, (struct dinode *)disk_inode);
+	}else{
+		memcpy(disk_inode, inode, sizeof(struct inode));
+	}
+
+	// Inode blocks held by a snapshot move to a new block
+	if(imap && block_shared(block)){
+		int idx = ino / INODES;
+		int new_blk = get_avail_blkno();
+		if(new_blk == -1 || bio_write(new_blk, inode_blk) < 0){
+			return -1;
+		}
+
+		imap[idx] = new_blk;
+		if(bio_write(su_blk->sn_start_blk, imap) < 0){
+			return -1;
+		}
+
+		return (block_unref(block) < 0) ? -1 : 0;
+	}
+
+	if(bio_write(block, inode_blk) < 0){
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * pointer block cache
+ */
+void ptr_cache_invalidate(int blkno){
+	for(int i = 0; i < PTR_CACHE_SIZE; i++){
+		if(ptr_cache[i].blkno == blkno){
+			ptr_cache[i].blkno = 0;
+		}
+	}
+}
+
+/*
+ * Returns the cached contents of pointer block blkno, reading it on a miss.
+ * The returned array is only valid until the next ptr_cache call.
+ */
+int *ptr_cache_get(int blkno){
+	struct ptr_cache_entry *victim = &ptr_cache[0];
+
+	for(int i = 0; i < PTR_CACHE_SIZE; i++){
+		if(ptr_cache[i].blkno == blkno){
+			ptr_cache[i].last_use = ++ptr_cache_clock;
+			return ptr_cache[i].ptrs;
+		}
+
+		if(ptr_cache[i].last_use < victim->last_use){
+			victim = &ptr_cache[i];
+		}
+	}
+
+	if(!victim->ptrs && !(victim->ptrs = (int *)dev_alloc_block())){
+		return NULL;
+	}
+
+	if(bio_read(blkno, victim->ptrs) < 0){
+		victim->blkno = 0;
+		return NULL;
+	}
+
+	victim->blkno = blkno;
+	victim->last_use = ++ptr_cache_clock;
+	return victim->ptrs;
+}
+
+/*
+ * Sets entry index of pointer block blkno to val and writes the block to disk
+ */
+int ptr_cache_set(int blkno, int index, int val){
+	int *ptrs = ptr_cache_get(blkno);
+	if(!ptrs){
+		return -1;
+	}
+
+	ptrs[index] = val;
+	if(bio_write(blkno, ptrs) < 0){
+		ptr_cache_invalidate(blkno);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocates a new block and formats it as an empty pointer block
+ */
+int alloc_ptr_block(){
+	int blkno = get_avail_blkno();
+	if(blkno == -1){
+		return -1;
+	}
+
+	if(format_ptr_block(blkno) < 0){
+		return -1;
+	}
+
+	return blkno;
+}
+
+/*
+ * Returns a private copy of pointer block blkno if a snapshot holds it,
+ * blkno itself otherwise. Returns -1 on error.
+ */
+int cow_ptr_block(int blkno){
+	if(!block_shared(blkno)){
+		return blkno;
+	}
+
+	int new_blkno = get_avail_blkno();
+	if(new_blkno == -1){
+		return -1;
+	}
+
+	int *ptrs = ptr_cache_get(blkno);
+	if(!ptrs || bio_write(new_blkno, ptrs) < 0){
+		release_blkno(new_blkno);
+		return -1;
+	}
+
+	if(block_unref(blkno) < 0){
+		return -1;
+	}
+
+	return new_blkno;
+}
+
+/*
+ * file block map
+ *
+ * Maps block blk_index of regular file node to its data block number. Blocks
+ * 0-15 are direct, the next FILE_IND_PTRS * PTRS go through single indirect
+ * blocks and the rest through the double indirect block. Directories use all
+ * DIR_IND_PTRS slots as single indirect.
+ *
+ * file_bmap_locate() finds the slot holding the map entry of blk_index: direct
+ * pointer *ptr_index of node (*ptr_blkno is 0) or entry *ptr_index of pointer
+ * block *ptr_blkno. With BMAP_ALLOC, missing pointer blocks on the way are
+ * allocated, with BMAP_COW pointer blocks held by a snapshot are replaced by
+ * copies (the caller writes node back). Returns 1 if a pointer block on the
+ * way does not exist, 0 on success and -1 on error.
+ */
+int file_bmap_locate(struct inode *node, int blk_index, int flags, int *ptr_blkno, int *ptr_index){
+	int ind_ptrs = (node->type == S_IFDIR) ? DIR_IND_PTRS : FILE_IND_PTRS;
+
+	if(blk_index < 0 || blk_index >= MAX_FBLOCKS){
+		return -1;
+	}
+
+	// Direct pointer
+	if(blk_index < DIRECT_PTRS){
+		*ptr_blkno = 0;
+		*ptr_index = blk_index;
+		return 0;
+	}
+
+	// Single indirect pointer
+	blk_index -= DIRECT_PTRS;
+	if(blk_index < (ind_ptrs * PTRS)){
+		int slot = blk_index / PTRS;
+		if(node->indirect_ptr[slot] == 0){
+			if(!(flags & BMAP_ALLOC)){
+				return 1;
+			}
+
+			int ind_blk = alloc_ptr_block();
+			if(ind_blk == -1){
+				return -1;
+			}
+			node->indirect_ptr[slot] = ind_blk;
+		}else if(flags & BMAP_COW){
+			int ind_blk = cow_ptr_block(node->indirect_ptr[slot]);
+			if(ind_blk == -1){
+				return -1;
+			}
+			node->indirect_ptr[slot] = ind_blk;
+		}
+
+		*ptr_blkno = node->indirect_ptr[slot];
+		*ptr_index = blk_index % PTRS;
+		return 0;
+	}
+
+	// Double indirect pointer, regular files only
+	blk_index -= (FILE_IND_PTRS * PTRS);
+	if(node->type == S_IFDIR){
+		return -1;
+	}
+
+	if(node->indirect_ptr[FILE_DIND_SLOT] == 0){
+		if(!(flags & BMAP_ALLOC)){
+			return 1;
+		}
+
+		int dind_blk = alloc_ptr_block();
+		if(dind_blk == -1){
+			return -1;
+		}
+		node->indirect_ptr[FILE_DIND_SLOT] = dind_blk;
+	}else if(flags & BMAP_COW){
+		int dind_blk = cow_ptr_block(node->indirect_ptr[FILE_DIND_SLOT]);
+		if(dind_blk == -1){
+			return -1;
+		}
+		node->indirect_ptr[FILE_DIND_SLOT] = dind_blk;
+	}
+
+	int dind_blk = node->indirect_ptr[FILE_DIND_SLOT];
+	int *ptrs = ptr_cache_get(dind_blk);
+	if(!ptrs){
+		return -1;
+	}
+
+	int ind_blk = ptrs[blk_index / PTRS];
+	if(ind_blk == 0){
+		if(!(flags & BMAP_ALLOC)){
+			return 1;
+		}
+
+		ind_blk = alloc_ptr_block();
+		if(ind_blk == -1 || ptr_cache_set(dind_blk, blk_index / PTRS, ind_blk) < 0){
+			return -1;
+		}
+	}else if(flags & BMAP_COW){
+		int new_blk = cow_ptr_block(ind_blk);
+		if(new_blk == -1 || (new_blk != ind_blk && ptr_cache_set(dind_blk, blk_index / PTRS, new_blk) < 0)){
+			return -1;
+		}
+		ind_blk = new_blk;
+	}
+
+	*ptr_blkno = ind_blk;
+	*ptr_index = blk_index % PTRS;
+	return 0;
+}
+
+int file_bmap_get(struct inode *node, int ptr_blkno, int ptr_index, int *entry){
+	if(ptr_blkno == 0){
+		*entry = node->direct_ptr[ptr_index];
+		return 0;
+	}
+
+	int *ptrs = ptr_cache_get(ptr_blkno);
+	if(!ptrs){
+		return -1;
+	}
+
+	*entry = ptrs[ptr_index];
+	return 0;
+}
+
+int file_bmap_set(struct inode *node, int ptr_blkno, int ptr_index, int entry){
+	if(ptr_blkno == 0){
+		node->direct_ptr[ptr_index] = entry;
+		return 0;
+	}
+
+	return ptr_cache_set(ptr_blkno, ptr_index, entry);
+}
+
+/*
+ * Reads the raw map entry of block blk_index, 0 if it was never mapped
+ */
+int get_file_entry(struct inode *node, int blk_index, int *entry){
+	int ptr_blkno, ptr_index;
+	int ret = file_bmap_locate(node, blk_index, 0, &ptr_blkno, &ptr_index);
+
+	*entry = 0;
+	if(ret != 0){
+		return (ret == 1) ? 0 : -1;
+	}
+
+	return file_bmap_get(node, ptr_blkno, ptr_index, entry);
+}
+
+/*
+ * Sets the raw map entry of block blk_index, allocating pointer blocks as needed
+ */
+int set_file_entry(struct inode *node, int blk_index, int entry){
+	int ptr_blkno, ptr_index;
+	int ret = file_bmap_locate(node, blk_index, BMAP_COW | ((entry != 0) ? BMAP_ALLOC : 0), &ptr_blkno, &ptr_index);
+
+	if(ret != 0){
+		return (ret == 1) ? 0 : -1;
+	}
+
+	return file_bmap_set(node, ptr_blkno, ptr_index, entry);
+}
+
+/*
+ * Returns the data block of block blk_index. If alloc is set, a missing data
+ * block is allocated and *is_new is set (the caller writes node back).
+ * Returns 0 for a hole and -1 on error.
+ */
+int get_file_blkno(struct inode *node, int blk_index, int alloc, int *is_new){
+	int ptr_blkno, ptr_index, entry;
+
+	if(is_new){
+		*is_new = 0;
+	}
+
+	int ret = file_bmap_locate(node, blk_index, alloc ? (BMAP_ALLOC | BMAP_COW) : 0, &ptr_blkno, &ptr_index);
+	if(ret != 0){
+		return (ret == 1) ? 0 : -1;
+	}
+
+	if(file_bmap_get(node, ptr_blkno, ptr_index, &entry) < 0){
+		return -1;
+	}
+
+	if(entry != 0 || !alloc){
+		return entry;
+	}
+
+	entry = get_avail_blkno();
+	if(entry == -1 || file_bmap_set(node, ptr_blkno, ptr_index, entry) < 0){
+		return -1;
+	}
+
+	if(is_new){
+		*is_new = 1;
+	}
+
+	return entry;
+}
+
+/*
+ * write reservations
+ *
+ * Before a write of several blocks, reserve_blocks() takes one run for all
+ * the blocks the write will allocate, starting right after the block that
+ * precedes the write in the file, or ending right before the one following
+ * it when the kernel flushes a file out of order. file_block_for_write()
+ * hands the run out in file order, so the data lands contiguous and the
+ * bitmap is written once per write instead of once per block.
+ * release_reserve() frees what the write did not use.
+ */
+int rsv_next = 0;
+int rsv_end = 0;
+
+void release_reserve(){
+	if(rsv_next < rsv_end && bio_read(DBMAP_IDX, blk_bmap) >= 0){
+		for(int i = rsv_next; i < rsv_end; i++){
+			bmap_free(i);
+		}
+		bio_write(DBMAP_IDX, blk_bmap);
+	}
+
+	rsv_next = 0;
+	rsv_end = 0;
+}
+
+/*
+ * Reserves a run for the blocks of [blk_index, blk_index + count) of node
+ * that a write of all of them allocates: holes and shared blocks. Without a
+ * free run large enough, blocks are allocated one by one as before.
+ */
+int reserve_blocks(struct inode *node, int blk_index, int count){
+	int need = 0;
+	int entry;
+	int prev = 0;
+	int next = 0;
+
+	release_reserve();
+
+	// Single blocks and pointer blocks come from the group as well
+	if(blk_index > 0){
+		get_file_entry(node, blk_index - 1, &prev);
+	}
+	ag_set_goal(node, prev);
+
+	for(int i = blk_index; i < blk_index + count; i++){
+		if(get_file_entry(node, i, &entry) < 0){
+			return -1;
+		}
+		if(entry <= 0 || block_shared(entry)){
+			need++;
+		}
+	}
+
+	if(need < 2){
+		return 0;
+	}
+
+	get_file_entry(node, blk_index + count, &next);
+
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -1;
+	}
+
+	int start = -1;
+	if(prev > 0){
+		start = find_blkrun(prev + 1, need);
+	}else if(next > need && find_blkrun(next - need, need) == next - need){
+		start = next - need;
+	}else if(blk_index > 0){
+		// The blocks in front arrive later, leave them room before this run
+		int gap = (blk_index < RSV_GAP) ? blk_index : RSV_GAP;
+		start = find_blkrun_goal(gap + need);
+		if(start != -1){
+			start += gap;
+		}
+	}
+
+	if(start == -1){
+		start = find_blkrun_goal(need);
+	}
+
+	if(start == -1){
+		return 0;
+	}
+
+	if(take_blkrun(start, need) < 0){
+		return -1;
+	}
+
+	rsv_next = start;
+	rsv_end = start + need;
+	return 0;
+}
+
+/*
+ * Returns the block that block blk_index of node, currently mapped to blkno,
+ * is written to: blkno itself if the file owns it alone, otherwise a newly
+ * mapped block that replaces the shared one or the hole (blkno 0). The caller
+ * writes the whole block and writes node back if the result differs.
+ */
+int file_block_for_write(struct inode *node, int blk_index, int blkno){
+	if(blkno > 0 && !block_shared(blkno)){
+		return blkno;
+	}
+
+	int new_blkno = (rsv_next < rsv_end) ? rsv_next++ : get_avail_blkno();
+	if(new_blkno == -1){
+		return -1;
+	}
+
+	if(set_file_entry(node, blk_index, new_blkno) < 0){
+		release_blkno(new_blkno);
+		return -1;
+	}
+
+	// Drop this file's reference to the shared copy
+	if(blkno > 0 && block_unref(blkno) < 0){
+		return -1;
+	}
+
+	return new_blkno;
+}
+
+/*
+ * Stores blk as block blk_index of node, currently mapped to blkno (0 for a
+ * hole). Identical blocks found in the dedup index are shared instead of
+ * written, and shared blocks are copied before they are modified.
+ */
+int store_file_block(struct inode *node, int blk_index, int blkno, const void *blk, int *node_dirty){
+	uint64_t hash = 0;
+
+	if(dedup_index){
+		hash = block_hash(blk);
+		int dup = dedup_lookup(hash, blk);
+		if(dup > 0 && dup == blkno){
+			// Contents unchanged
+			return 0;
+		}
+
+		if(dup > 0 && block_ref(dup) >= 0){
+			if(set_file_entry(node, blk_index, dup) < 0){
+				block_unref(dup);
+				return -1;
+			}
+			*node_dirty = 1;
+
+			return (blkno > 0 && block_unref(blkno) < 0) ? -1 : 0;
+		}
+	}
+
+	int new_blkno = file_block_for_write(node, blk_index, blkno);
+	if(new_blkno == -1){
+		return -1;
+	}
+
+	if(new_blkno == blkno){
+		dedup_forget(blkno);
+	}else{
+		*node_dirty = 1;
+		blkno = new_blkno;
+	}
+
+	if(bio_write_data(blkno, blk) < 0){
+		return -1;
+	}
+
+	if(dedup_index){
+		dedup_insert(hash, blkno);
+	}
+
+	return 0;
+}
+
+/*
+ * snapshots
+ *
+ * A snapshot records the live inode map and the data bitmap, so taking one
+ * writes a single block. Every block allocated at that point is frozen: the
+ * live file system copies it before writing (inode blocks through imap,
+ * pointer, directory and data blocks through their parent) and keeps it
+ * allocated when it drops it. Deleting a snapshot frees the blocks nothing
+ * reaches anymore.
+ */
+int write_snapshot(int s){
+	memset(data_blk, '\0', BLOCK_SIZE);
+	memcpy(data_blk, &snapshots[s], sizeof(struct snapshot));
+	return bio_write(su_blk->sn_start_blk + 1 + s, data_blk);
+}
+
+void update_frozen_bmap(){
+	memset(frozen_bmap, '\0', BLOCK_SIZE);
+
+	for(int s = 0; s < MAX_SNAPSHOTS; s++){
+		if(!snapshots[s].valid){
+			continue;
+		}
+
+		for(int i = 0; i < (MAX_DNUM / 8); i++){
+			frozen_bmap[i] |= snapshots[s].dbmap[i];
+		}
+	}
+}
+
+int find_snapshot(const char *name){
+	for(int s = 0; s < MAX_SNAPSHOTS; s++){
+		if(snapshots && snapshots[s].valid && strcmp(snapshots[s].name, name) == 0){
+			return s;
+		}
+	}
+
+	return -1;
+}
+
+int snapshot_alloc_buffers(){
+	imap = (int *)calloc(1, BLOCK_SIZE);
+	snapshots = (struct snapshot *)calloc(MAX_SNAPSHOTS, sizeof(struct snapshot));
+	frozen_bmap = (bitmap_t)calloc(1, BLOCK_SIZE);
+	if(!imap || !snapshots || !frozen_bmap){
+		perror("Malloc failure: snapshot initialization\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps the inode region in place and clears the snapshot records
+ */
+int init_snapshot_region(){
+	if(su_blk->sn_blocks == 0){
+		return 0;
+	}
+
+	if(snapshot_alloc_buffers() < 0){
+		return -1;
+	}
+
+	for(int i = 0; i < INODE_BLOCKS; i++){
+		imap[i] = INODE_IDX + i;
+	}
+
+	if(bio_write(su_blk->sn_start_blk, imap) < 0){
+		return -1;
+	}
+
+	for(int s = 0; s < MAX_SNAPSHOTS; s++){
+		if(write_snapshot(s) < 0){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int load_snapshot_region(){
+	if(su_blk->sn_blocks == 0){
+		return 0;
+	}
+
+	if(snapshot_alloc_buffers() < 0 || bio_read(su_blk->sn_start_blk, imap) < 0){
+		return -1;
+	}
+
+	for(int s = 0; s < MAX_SNAPSHOTS; s++){
+		if(bio_read(su_blk->sn_start_blk + 1 + s, data_blk) < 0){
+			return -1;
+		}
+		memcpy(&snapshots[s], data_blk, sizeof(struct snapshot));
+	}
+
+	update_frozen_bmap();
+	return 0;
+}
+
+int snapshot_create(const char *name){
+	if(!snapshots){
+		return -EPERM;
+	}
+
+	// Blocks written in place after this point would change the snapshot
+	drain_writes();
+
+	if(strlen(name) >= SNAP_NAME_LEN){
+		return -ENAMETOOLONG;
+	}
+
+	if(find_snapshot(name) >= 0){
+		return -EEXIST;
+	}
+
+	int s = 0;
+	while(s < MAX_SNAPSHOTS && snapshots[s].valid){
+		s++;
+	}
+
+	if(s == MAX_SNAPSHOTS){
+		return -ENOSPC;
+	}
+
+	// Cached compressed data has to be on disk before it is frozen, and blocks
+	// waiting in a window belong to no file the snapshot could hold
+	if(ccache_writeback(NULL, NULL) < 0 || ag_drain_windows() < 0 || bio_read(DBMAP_IDX, blk_bmap) < 0){
+		return -EIO;
+	}
+
+	struct snapshot *snap = &snapshots[s];
+	memset(snap, '\0', sizeof(struct snapshot));
+	snap->valid = 1;
+	snap->ctime = time(NULL);
+	strcpy(snap->name, name);
+	for(int i = 0; i < INODE_BLOCKS; i++){
+		snap->imap[i] = imap[i];
+	}
+	memcpy(snap->dbmap, blk_bmap, MAX_DNUM / 8);
+
+	// Held blocks are already freed, they only wait for read replies
+	for(int i = 0; i < (MAX_DNUM / 8); i++){
+		snap->dbmap[i] &= ~held_bmap[i];
+	}
+
+	if(write_snapshot(s) < 0){
+		snap->valid = 0;
+		return -EIO;
+	}
+
+	update_frozen_bmap();
+	return 0;
+}
+
+void mark_block(bitmap_t bmap, int blkno){
+	if(blkno > 0 && blkno < MAX_DNUM){
+		set_bitmap(bmap, blkno);
+	}
+}
+
+/*
+ * Marks the blocks an array of map entries points to. The second entry of a
+ * compressed cluster holds minus the length of the run the first one starts.
+ */
+void mark_entries(bitmap_t bmap, const int *ptrs, int n){
+	for(int i = 0; i < n; i++){
+		if(ptrs[i] > 0){
+			mark_block(bmap, ptrs[i]);
+		}else if(ptrs[i] < 0 && i > 0){
+			for(int j = 1; j < -ptrs[i]; j++){
+				mark_block(bmap, ptrs[i - 1] + j);
+			}
+		}
+	}
+}
+
+void mark_inode_blocks(bitmap_t bmap, struct inode *node){
+	int ind_ptrs = (node->type == S_IFDIR) ? DIR_IND_PTRS : FILE_IND_PTRS;
+
+	mark_entries(bmap, node->direct_ptr, DIRECT_PTRS);
+
+	for(int i = 0; i < ind_ptrs; i++){
+		int *ptrs = node->indirect_ptr[i] ? ptr_cache_get(node->indirect_ptr[i]) : NULL;
+		if(ptrs){
+			mark_block(bmap, node->indirect_ptr[i]);
+			mark_entries(bmap, ptrs, PTRS);
+		}
+	}
+
+	if(node->type == S_IFDIR || node->indirect_ptr[FILE_DIND_SLOT] == 0){
+		return;
+	}
+
+	int *dptrs = ptr_cache_get(node->indirect_ptr[FILE_DIND_SLOT]);
+	int *ind = (int *)dev_alloc_block();
+	if(!dptrs || !ind){
+		dev_free_block(ind);
+		return;
+	}
+	mark_block(bmap, node->indirect_ptr[FILE_DIND_SLOT]);
+	memcpy(ind, dptrs, BLOCK_SIZE);
+
+	for(int i = 0; i < PTRS; i++){
+		int *ptrs = ind[i] ? ptr_cache_get(ind[i]) : NULL;
+		if(ptrs){
+			mark_block(bmap, ind[i]);
+			mark_entries(bmap, ptrs, PTRS);
+		}
+	}
+	dev_free_block(ind);
+}
+
+/*
+ * Marks every block reachable from the live file system (s is -1) or snapshot s
+ */
+int mark_reachable(int s, bitmap_t bmap){
+	int blocks = INODE_BLOCKS;
+	for(int i = 0; i < blocks; i++){
+		mark_block(bmap, (s < 0) ? imap[i] : snapshots[s].imap[i]);
+	}
+
+	for(int ino = 0; ino < MAX_INUM; ino++){
+		struct inode node;
+		if(readi((s < 0) ? ino : SNAP_INO(s, ino), &node) < 0){
+			return -1;
+		}
+
+		if(!node.valid || (node.type == S_IFREG && (node.flags & INODE_INLINE))){
+			continue;
+		}
+
+		if(node.type == S_IFDIR || node.type == S_IFREG){
+			mark_inode_blocks(bmap, &node);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the data blocks that neither the live file system nor a remaining
+ * snapshot reaches, and narrows each snapshot to the blocks it reaches
+ */
+int snapshot_collect(){
+	bitmap_t reach = (bitmap_t)dev_alloc_block();
+	bitmap_t view = (bitmap_t)dev_alloc_block();
+	int ret = -1;
+
+	// Blocks waiting in a window are reached by nothing yet
+	if(ag_drain_windows() < 0){
+		goto out;
+	}
+
+	if(reach){
+		memset(reach, '\0', BLOCK_SIZE);
+	}
+
+	if(!reach || !view || mark_reachable(-1, reach) < 0){
+		goto out;
+	}
+
+	for(int s = 0; s < MAX_SNAPSHOTS; s++){
+		if(!snapshots[s].valid){
+			continue;
+		}
+
+		memset(view, '\0', BLOCK_SIZE);
+		if(mark_reachable(s, view) < 0){
+			goto out;
+		}
+
+		for(int i = 0; i < (MAX_DNUM / 8); i++){
+			reach[i] |= view[i];
+		}
+
+		memcpy(snapshots[s].dbmap, view, MAX_DNUM / 8);
+		if(write_snapshot(s) < 0){
+			goto out;
+		}
+	}
+
+	if(bio_read(DBMAP_IDX, blk_bmap) < 0){
+		goto out;
+	}
+
+	for(int blkno = su_blk->d_start_blk; blkno < MAX_DNUM; blkno++){
+		if(!get_bitmap(blk_bmap, blkno) || get_bitmap(reach, blkno) || get_bitmap(held_bmap, blkno)){
+			continue;
+		}
+
+		bmap_release(blkno);
+		if(refcnt && refcnt[blkno]){
+			refcnt[blkno] = 0;
+			write_refcnt(blkno);
+		}
+	}
+
+	if(bio_write(DBMAP_IDX, blk_bmap) < 0){
+		goto out;
+	}
+
+	update_frozen_bmap();
+	ret = 0;
+
+out:
+	dev_free_block(reach);
+	dev_free_block(view);
+	return ret;
+}
+
+int snapshot_delete(const char *name){
+	int s = find_snapshot(name);
+	if(s < 0){
+		return -ENOENT;
+	}
+
+	if(ccache_writeback(NULL, NULL) < 0){
+		return -EIO;
+	}
+
+	// Forget cached clusters read through the snapshot
+	if(SNAP_OF(ccache.ino) == s){
+		ccache.ino = -1;
+	}
+
+	snapshots[s].valid = 0;
+	if(write_snapshot(s) < 0 || snapshot_collect() < 0){
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int get_dirent_from_block(void *blk, const char *fname, size_t name_len, struct dirent *dirent){
+	struct dirent *dir_ents = (struct dirent *)blk;
+	for(int i = 0; i < DIRENTS; i++){
+		if(!dir_ents[i].valid){
+			continue;
+		}else if(name_len == dir_ents[i].len && strcmp(dir_ents[i].name, fname) == 0){
+			memcpy(dirent, &dir_ents[i], sizeof(struct dirent));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* 
+ * directory operations
+ */
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	// Step 2: Get data block of current directory from inode
+	// Step 3: Read directory's data block and check each directory entry.
+	// If the name matches, then copy directory entry to dirent structure
+	struct inode dir_inode;
+	if(readi(ino, &dir_inode) < 0){
+		return -1;
+	}
+
+	if(!dir_inode.valid || dir_inode.size <= 0 || dir_inode.type != S_IFDIR){
+		return -1;
+	}
+
+	for(int i = 0; i < dir_inode.size; i++){
+		int blk_ptr = get_file_blkno(&dir_inode, i, 0, NULL);
+		if(blk_ptr < 0){
+			return -1;
+		}else if(blk_ptr == 0){
+			continue;
+		}else if(bio_read(blk_ptr, data_blk) < 0){
+			return -1;
+		}
+
+		if(get_dirent_from_block(data_blk, fname, name_len, dirent)){
+			return 0;
+		}
+	}
+
+	return  -1;
+}
+
+int dir_block_contains(void *blk, const char *fname, size_t name_len){
+	struct dirent *dir_ents = (struct dirent *)blk;
+	for(int i = 0; i < DIRENTS; i++){
+		if(!dir_ents[i].valid){
+			continue;
+		}else if(name_len == dir_ents[i].len && strcmp(dir_ents[i].name, fname) == 0){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int dir_contains(struct inode dir_inode, const char *fname, size_t name_len){
+	for(int i = 0; i < dir_inode.size; i++){
+		int blk_ptr = get_file_blkno(&dir_inode, i, 0, NULL);
+		if(blk_ptr < 0){
+			return 0;
+		}else if(blk_ptr == 0){
+			continue;
+		}else if(bio_read(blk_ptr, data_blk) < 0){
+			return 0;
+		}
+
+		if(dir_block_contains(data_blk, fname, name_len)){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int add_dirent_to_block(void *blk, uint16_t f_ino, const char *fname, size_t name_len){
+	struct dirent *dir_ents = (struct dirent *)blk;
+	for(int i = 0; i < DIRENTS; i++){
+		if(dir_ents[i].valid == 0){
+			dir_ents[i].ino = f_ino;
+			dir_ents[i].valid = 1;
+			memcpy(&(dir_ents[i].name), fname, name_len + 1);
+			dir_ents[i].len = name_len;
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Adds dirent to a block pointed to by dir_inode if an invalid dirent exists within a block pointed to by dir_inode.
+ * Blocks held by a snapshot are copied first, *dir_dirty is set when dir_inode changed.
+ */
+int add_dirent(struct inode *dir_inode, uint16_t f_ino, const char *fname, size_t name_len, int *dir_dirty){
+	for(int i = 0; i < dir_inode->size; i++){
+		int blk_ptr = get_file_blkno(dir_inode, i, 0, NULL);
+		if(blk_ptr < 0){
+			return -1;
+		}else if(blk_ptr == 0){
+			continue;
+		}else if(bio_read(blk_ptr, data_blk) < 0){
+			return -1;
+		}
+
+		if(!add_dirent_to_block(data_blk, f_ino, fname, name_len)){
+			continue;
+		}
+
+		int new_ptr = file_block_for_write(dir_inode, i, blk_ptr);
+		if(new_ptr == -1 || bio_write(new_ptr, data_blk) < 0){
+			return -1;
+		}
+
+		*dir_dirty |= (new_ptr != blk_ptr);
+		return 1;
+	}
+
+	return 0;
+}
+
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	// Step 2: Check if fname (directory name) is already used in other entries
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	// Allocate a new data block for this directory if it does not exist
+	// Update directory inode
+	// Write directory entry
+	if(dir_contains(dir_inode, fname, name_len)){
+		return -1;
+	}
+
+	int dir_dirty = 0;
+	ag_set_goal(&dir_inode, 0);
+	int added = add_dirent(&dir_inode, f_ino, fname, name_len, &dir_dirty);
+	if(added < 0){
+		return -1;
+	}
+
+	if(!added){
+		int blk_no = get_avail_blkno();
+		if(blk_no == -1){
+			return -1;
+		}
+
+		format_dir_block(blk_no);
+		if(bio_read(blk_no, data_blk)< 0){
+			return -1;
+		}
+		struct dirent *dir_ents = (struct dirent *)data_blk;
+
+		dir_ents[0].ino = f_ino;
+		dir_ents[0].valid = 1;
+		memcpy(&(dir_ents[0].name), fname, name_len);
+		dir_ents[0].len = name_len;
+
+		if(bio_write(blk_no, data_blk)< 0){
+			return -1;
+		}
+
+		if(set_file_entry(&dir_inode, dir_inode.size, blk_no) < 0){
+			release_blkno(blk_no);
+			return -1;
+		}
+
+		dir_inode.size++;
+		dir_dirty = 1;
+	}
+
+	if(dir_dirty && writei(dir_inode.ino, &dir_inode) < 0){
+		return -1;
+	}
+
+	return 0;
+}
+
+//OPTIONAL
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	// Step 2: Check if fname exist
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+
+	return 0;
+}
+
+/*
+ * request arena
+ *
+ * Temporaries of a request, like path copies, are carved from arena_buf and
+ * all freed at once by arena_reset() when the request ends, so the hot path
+ * makes no malloc() and free() calls. The arena is guarded by fs_lock and its
+ * memory must not be used after the handler drops fs_lock. Allocations that
+ * do not fit are malloc()ed and freed by the same reset.
+ */
+void *arena_alloc(size_t len){
+	len = (len + 15) & ~(size_t)15;
+	if(len <= (ARENA_SIZE - arena_used)){
+		void *mem = arena_buf + arena_used;
+		arena_used += len;
+		return mem;
+	}
+
+	struct arena_big *big = (struct arena_big *)malloc(sizeof(struct arena_big) + len);
+	if(!big){
+		return NULL;
+	}
+
+	big->next = arena_overflow;
+	arena_overflow = big;
+	return big->data;
+}
+
+char *arena_strdup(const char *str){
+	size_t len = strlen(str) + 1;
+	char *copy = (char *)arena_alloc(len);
+	if(copy){
+		memcpy(copy, str, len);
+	}
+	return copy;
+}
+
+void arena_reset(){
+	while(arena_overflow){
+		struct arena_big *next = arena_overflow->next;
+		free(arena_overflow);
+		arena_overflow = next;
+	}
+	arena_used = 0;
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+	// printf("get_node_by_path(): %s\n", path);
+
+	if(strcmp(path, "/" ) == 0 && ino == 0){
+		return readi(0, inode);
+	}
+
+	char *pth_cpy = arena_strdup(path);
+	if(!pth_cpy){
+		return -1;
+	}
+
+	struct dirent dir_ent;
+	int curr_ino = ino;
+	char *token = strtok(pth_cpy, "/");
+
+	// Paths below /.snapshots/<name> resolve from the root of that snapshot
+	if(snapshots && ino == 0 && token != NULL && strcmp(token, SNAP_DIR) == 0){
+		token = strtok(NULL, "/");
+		int s = (token != NULL) ? find_snapshot(token) : -1;
+		if(s < 0){
+			return -1;
+		}
+
+		curr_ino = SNAP_INO(s, 0);
+		token = strtok(NULL, "/");
+	}
+
+	while(token != NULL) {
+		int found = dir_find(curr_ino, token, strlen(token), &dir_ent);
+		if(found == -1){
+			return -1;
+		}
+
+		// Stay in the snapshot the directory was read through
+		curr_ino = (curr_ino & ~INO_MASK) | dir_ent.ino;
+        token = strtok(NULL, "/");
+    }
+
+	return readi(curr_ino, inode);
+}
+
+/*
+ * Whether path is the directory snapshots are listed in
+ */
+int is_snapshot_dir(const char *path){
+	return snapshots && strcmp(path, "/" SNAP_DIR) == 0;
+}
+
+/*
+ * kernel caches
+ *
+ * The kernel caches names, attributes and, per open file, file data. Changes
+ * made through kernel requests keep those caches right. Changes the daemon
+ * makes on its own, like the destination of a clone, are pushed out with
+ * kernel_invalidate().
+ */
+
+/*
+ * Picks how the kernel caches the data of an opened file, by its class.
+ * Files under /.snapshots never change while they are visible.
+ */
+void set_open_cache(struct inode *node, struct fuse_file_info *fi){
+	if(!fi){
+		return;
+	}
+
+	int mode = (SNAP_OF(node->ino) >= 0) ? rufs_conf.snap_cache : rufs_conf.file_cache;
+	fi->direct_io = (mode == CACHE_NONE);
+	fi->keep_cache = (mode == CACHE_KEEP);
+}
+
+/*
+ * Drops the kernel's cached attributes, data and name of path. Must not run
+ * while the kernel holds locks of path for the current request, nor under
+ * fs_lock: with the writeback cache the kernel first writes back the dirty
+ * pages of path, and those writes wait for fs_lock. Handlers leave it to
+ * their locked entry point, which calls it after dropping fs_lock.
+ */
+void kernel_invalidate(const char *path){
+#ifndef RUFS_LIB
+	struct fuse_context *ctx = fuse_get_context();
+	if(ctx && ctx->fuse){
+		fuse_invalidate_path(ctx->fuse, path);
+	}
+#endif
+}
+
+/*
+ * locking
+ *
+ * Handlers run under fs_lock, which guards the bitmaps, the shared block
+ * buffers and the caches. Reads and writes first take a range lock on the
+ * blocks they cover, shared for reads, so that writes to disjoint blocks of
+ * a file do not wait for each other. rufs_write_buf() maps its blocks under
+ * fs_lock and then drops it while splicing the data, which lets writes to
+ * the same file and to other files run in parallel. Operations that copy or
+ * share the blocks of a file call drain_writes() first. The locks are always
+ * taken in the order range lock, fs_lock, io_lock.
+ */
+int range_conflict(const struct range_lock *a, const struct range_lock *b){
+	return a->ino == b->ino && a->first <= b->last && b->first <= a->last && !(a->shared && b->shared);
+}
+
+void range_lock(struct range_lock *rl, uint16_t ino, off_t offset, size_t size, int shared){
+	rl->ino = ino;
+	rl->first = offset / BLOCK_SIZE;
+	rl->last = (size > 0) ? ((offset + size - 1) / BLOCK_SIZE) : rl->first;
+	rl->shared = shared;
+
+	pthread_mutex_lock(&range_mutex);
+	for(struct range_lock *held = range_locks; held; ){
+		if(range_conflict(rl, held)){
+			pthread_cond_wait(&range_cond, &range_mutex);
+			held = range_locks;
+			continue;
+		}
+		held = held->next;
+	}
+
+	rl->next = range_locks;
+	range_locks = rl;
+	pthread_mutex_unlock(&range_mutex);
+}
+
+void range_unlock(struct range_lock *rl){
+	pthread_mutex_lock(&range_mutex);
+	for(struct range_lock **p = &range_locks; *p; p = &(*p)->next){
+		if(*p == rl){
+			*p = rl->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&range_cond);
+	pthread_mutex_unlock(&range_mutex);
+}
+
+/*
+ * Takes the range lock of [offset, offset + size) of the file at path, then
+ * fs_lock. Returns 0 with rl held, or -1 without it if there is no such
+ * file; fs_lock is held on return either way.
+ */
+int lock_file_range(const char *path, off_t offset, size_t size, int shared, struct range_lock *rl){
+	struct inode node;
+
+	pthread_mutex_lock(&fs_lock);
+	if(!path || offset < 0 || get_node_by_path(path, 0, &node) < 0){
+		return -1;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	range_lock(rl, node.ino, offset, size, shared);
+	pthread_mutex_lock(&fs_lock);
+	return 0;
+}
+
+/*
+ * Waits for the writes rufs_write_buf() has in flight without fs_lock.
+ * Called with fs_lock held, so no new one starts until it is dropped.
+ */
+void drain_writes(){
+	pthread_rwlock_wrlock(&io_lock);
+	pthread_rwlock_unlock(&io_lock);
+}
+
+/* 
+ * Make file system
+ */
+int rufs_mkfs() {
+	// New images get the configured block size, all regions are laid out in it
+	if(dev_set_block_size(rufs_conf.block_size ? rufs_conf.block_size : BLOCK_SIZE) < 0){
+		fprintf(stderr, "rufs: cannot make an image with %d byte blocks\n", rufs_conf.block_size);
+		return -1;
+	}
+
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile_path);
+
+	// write superblock information
+	// initialize inode bitmap
+	// initialize data block bitmap
+	// update bitmap information for root directory
+	// update inode for root directory
+	if(init_superblock() < 0 || 
+		init_inode_bitmap() < 0 || 
+		init_data_bitmap() < 0 ||
+		init_data_block() < 0 ||
+		init_ptr_block() < 0 ||
+		init_snapshot_region() < 0 ||
+		init_inode_region() < 0 ||
+		init_refcnt_region() < 0
+	){
+		return - 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Reads the block size of the open DISKFILE from its superblock, which
+ * starts every image whatever its block size, and lays the file system out
+ * in it. Must run before any block buffer is allocated.
+ */
+int load_block_size(){
+	char buf[BLOCK_SIZE_MAX] __attribute__((aligned(BLOCK_SIZE_MAX)));
+	struct superblock *sb = (struct superblock *)buf;
+
+	if(bio_read(SU_BLK_IDX, buf) < 0){
+		return -1;
+	}
+
+	// Images from before the block size was recorded have 4 KB blocks
+	int size = sb->block_size ? (int)sb->block_size : BLOCK_SIZE_MIN;
+	if(dev_set_block_size(size) < 0){
+		fprintf(stderr, "rufs: %s has %d byte blocks, which this build cannot open\n", diskfile_path, size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* 
+ * FUSE file operations
+ */
+static void *rufs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	// Step 1a: If disk file is not found, call mkfs
+	// Step 1b: If disk file is found, just initialize in-memory data structures and read superblock from disk
+	dev_set_direct(rufs_conf.disk_direct);
+	if(dev_open(diskfile_path) == 0){
+		if(load_block_size() < 0){
+			exit(EXIT_FAILURE);
+		}
+
+		// read super block information
+		if(init_data_structures() < 0 || bio_read(SU_BLK_IDX, su_blk) < 0){
+			exit(EXIT_FAILURE);
+		}
+
+		// Nothing is written to a file that is not an image, a zero-filled one included
+		if(su_blk->magic_num != MAGIC_NUM){
+			fprintf(stderr, "rufs: %s is not a RUFS image\n", diskfile_path);
+			exit(EXIT_FAILURE);
+		}
+
+		set_inode_format(su_blk->inode_fmt);
+		if(load_csum_region() < 0 || load_refcnt_region() < 0 || load_snapshot_region() < 0 || ag_load() < 0){
+			fprintf(stderr, "rufs: cannot load %s\n", diskfile_path);
+			exit(EXIT_FAILURE);
+		}
+
+		if(!(su_blk->fs_state & FS_CLEAN)){
+			fprintf(stderr, "rufs: %s was not unmounted cleanly, check it with rufs-fsck\n", diskfile_path);
+		}
+
+		// The image is dirty until rufs_destroy()
+		su_blk->fs_state &= ~FS_CLEAN;
+		if(bio_write(SU_BLK_IDX, su_blk) < 0){
+			exit(EXIT_FAILURE);
+		}
+	}else{
+		if(rufs_mkfs() < 0){
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(rufs_conf.dedup && dedup_init() < 0){
+		rufs_conf.dedup = 0;
+	}
+
+	// Let read_buf replies be spliced from the DISKFILE to the kernel, and
+	// write_buf data from the kernel to the DISKFILE. An O_DIRECT DISKFILE
+	// takes only aligned memory, so it is read and written through buffers
+	if(conn && !dev_direct() && (conn->capable & FUSE_CAP_SPLICE_WRITE)){
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+
+	if(conn && !dev_direct() && (conn->capable & FUSE_CAP_SPLICE_READ)){
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	}
+
+	// Let the kernel gather writes in the page cache and send them in large
+	// requests, reserve_blocks() keeps large and out of order writes contiguous
+	if(conn){
+		if(rufs_conf.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)){
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		}
+		conn->max_write = RUFS_MAX_WRITE;
+	}
+
+	// CACHE_KEEP and CACHE_NONE are applied per file in rufs_open()
+	if(cfg){
+		cfg->entry_timeout = rufs_conf.entry_timeout;
+		cfg->attr_timeout = rufs_conf.attr_timeout;
+		cfg->negative_timeout = rufs_conf.negative_timeout;
+		cfg->auto_cache = (rufs_conf.file_cache == CACHE_AUTO || rufs_conf.snap_cache == CACHE_AUTO);
+	}
+
+	print_macros();
+	return NULL;
+}
+
+static void rufs_destroy(void *userdata) {
+	// Step 1: De-allocate in-memory data structures
+	// Step 2: Close diskfile
+	ccache_writeback(NULL, NULL);
+	ccache.ino = -1;
+
+	if(blk_bmap){
+		ag_drain_windows();
+		release_held(-1);
+	}
+
+	if(ccache.data){
+		free(ccache.data);
+		ccache.data = NULL;
+	}
+
+	if(cluster_buf){
+		free(cluster_buf);
+		cluster_buf = NULL;
+	}
+
+	if(refcnt){
+		free(refcnt);
+		refcnt = NULL;
+	}
+
+	if(dedup_index){
+		free(dedup_index);
+		free(dedup_valid);
+		dedup_index = NULL;
+		dedup_valid = NULL;
+	}
+
+	if(snapshots){
+		free(imap);
+		free(snapshots);
+		free(frozen_bmap);
+		imap = NULL;
+		snapshots = NULL;
+		frozen_bmap = NULL;
+	}
+
+	if(su_blk){
+		su_blk->fs_state |= FS_CLEAN;
+		bio_write(SU_BLK_IDX, su_blk);
+		dev_free_block(su_blk);
+	}
+
+	arena_reset();
+
+	if(inode_bmap){
+		dev_free_block(inode_bmap);
+	}
+
+	if(blk_bmap){
+		dev_free_block(blk_bmap);
+	}
+
+	if(inode_blk){
+		dev_free_block(inode_blk);
+	}
+
+	if(data_blk){
+		dev_free_block(data_blk);
+	}
+
+	if(ptr_blk){
+		dev_free_block(ptr_blk);
+	}
+
+	for(int i = 0; i < PTR_CACHE_SIZE; i++){
+		dev_free_block(ptr_cache[i].ptrs);
+		ptr_cache[i].ptrs = NULL;
+		ptr_cache[i].blkno = 0;
+	}
+
+	dev_close();
+}
+
+static int rufs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	// Step 1: call get_node_by_path() to get inode from path
+	struct inode node;
+	int err;
+
+	if(is_snapshot_dir(path)){
+		memset(stbuf, '\0', sizeof(struct stat));
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		return 0;
+	}
+
+	err = get_node_by_path(path, 0, &node);
+	if (err < 0) {
+		return -ENOENT; //error code for no such file exist
+	}
+
+	// Step 2: fill attribute of file into stbuf from inode
+	if (node.type == S_IFDIR) { //dir type
+		stbuf->st_mode   = S_IFDIR | 0755; //default permission for dir
+		stbuf->st_nlink  = 2;
+		// stbuf->st_nlink  = node.link;
+	} else if (node.type == S_IFREG) { //regular file type
+		stbuf->st_mode = S_IFREG | 0644; //default permission for regular file
+		stbuf->st_nlink = 1;
+		// stbuf->st_nlink  = node.link;
+	}
+
+	// Update size (bytes), size (512 blocks), uid, gid
+	// Regular files track their byte size in vstat.st_size, inline files use no blocks
+	if(node.type == S_IFREG){
+		stbuf->st_size = node.vstat.st_size;
+		stbuf->st_blocks = (node.flags & INODE_INLINE) ? 0 : ((off_t)node.size * (BLOCK_SIZE / 512));
+	}else{
+		stbuf->st_size = node.size * BLOCK_SIZE;
+		stbuf->st_blocks = (stbuf->st_size % 512 == 0) ? (stbuf->st_size / 512) : ((stbuf->st_size / 512) + 1);
+	}
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+
+	// Snapshots are read-only
+	if(SNAP_OF(node.ino) >= 0){
+		stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	}
+
+	// Copy last access and modification time from inode.vstat to st_buf 
+	stbuf->st_atime = node.vstat.st_atime;
+	stbuf->st_mtime = node.vstat.st_mtime;
+	
+	return 0;
+}
+
+static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+	// Step 1: Call get_node_by_path() to get inode from path
+	// Step 2: If not find, return -1
+	struct inode node;
+	int err;
+
+	if(is_snapshot_dir(path)){
+		return 0;
+	}
+
+	err = get_node_by_path(path, 0, &node);
+
+	if(err < 0){
+		return -ENOENT;
+	}
+
+    return 0;
+}
+
+void copy_names_to_buffer(void *blk, void *buffer, fuse_fill_dir_t filler){
+	struct dirent *dir_ents = (struct dirent *)blk;
+
+	for(int i = 0; i < DIRENTS; i++){
+		if(dir_ents[i].valid){
+			filler(buffer, (char *)&dir_ents[i].name, NULL, 0, 0);
+		}
+	}
+}
+
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	// Step 1: Call get_node_by_path() to get inode from path
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	struct inode node;
+	int err;
+
+	if(is_snapshot_dir(path)){
+		filler(buffer, ".", NULL, 0, 0);
+		filler(buffer, "..", NULL, 0, 0);
+		for(int s = 0; s < MAX_SNAPSHOTS; s++){
+			if(snapshots[s].valid){
+				filler(buffer, snapshots[s].name, NULL, 0, 0);
+			}
+		}
+		return 0;
+	}
+
+	err = get_node_by_path(path, 0, &node);
+	if(err < 0){
+		return -ENOENT;
+	}
+
+	for(int i = 0; i < node.size; i++){
+		int blk_ptr = get_file_blkno(&node, i, 0, NULL);
+		if(blk_ptr < 0){
+			return -1;
+		}else if(blk_ptr == 0){
+			continue;
+		}else if(bio_read(blk_ptr, data_blk) < 0){
+			return -1;
+		}
+
+		copy_names_to_buffer(data_blk, buffer, filler);
+	}
+
+	return 0;
+}
+
+int format_new_dir(struct inode*dir_node, uint16_t parent_ino){
+	if(!dir_node){
+		return 0;
+	}
+
+	if(dir_node->size == 0){
+		ag_set_goal(dir_node, 0);
+		int blkno = get_avail_blkno();
+		if(blkno == -1){
+			return 0;
+		}
+
+		format_dir_block(blkno);
+		dir_node->direct_ptr[0] = blkno;
+		if(bio_read(blkno, data_blk) < 0){
+			return 0;
+		}
+
+		struct dirent *dir_ents = (struct dirent *)data_blk; 
+		dir_ents[0].ino = dir_node->ino;
+		dir_ents[0].valid = 1;
+
+		char dir_name[2] = ".";
+		memcpy(dir_ents[0].name, &dir_name, 2);
+		dir_ents[0].len = strlen((char *)&dir_name);
+
+		dir_ents[1].ino = parent_ino;
+		dir_ents[1].valid = 1;
+
+		char par_name[3] = "..";
+		memcpy(dir_ents[1].name, &par_name, 3);
+		dir_ents[1].len = strlen((char *)&par_name);
+
+		if(bio_write(blkno, data_blk) < 0){
+			return 0;
+		}
+
+		dir_node->size++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int rufs_mkdir(const char *path, mode_t mode) {
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	// Step 3: Call get_avail_ino() to get an available inode number
+	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	// Step 5: Update inode for target directory
+	// Step 6: Call writei() to write inode to disk
+	char *parent = get_dirname(path);
+	char *dir = get_basename(path);
+	struct inode prnt_node;
+	int err;
+
+	if(!parent || !dir){
+		return -ENOMEM;
+	}
+
+	// Creating a directory under /.snapshots takes a snapshot
+	if(is_snapshot_dir(parent)){
+		return snapshot_create(dir);
+	}
+
+	err = get_node_by_path(parent, 0, &prnt_node);
+	if(err < 0){
+		return -ENOENT;
+	}
+
+	if(SNAP_OF(prnt_node.ino) >= 0 || (snapshots && prnt_node.ino == 0 && strcmp(dir, SNAP_DIR) == 0)){
+		return (SNAP_OF(prnt_node.ino) >= 0) ? -EROFS : -EEXIST;
+	}
+
+	struct inode dnode;
+	int dino = get_avail_ino();
+	if(dino == -1){
+		return -1;
+	}
+
+	memset(&dnode, '\0', sizeof(struct inode));
+	dnode.ino = dino;
+	dnode.valid = 1;
+	dnode.type = S_IFDIR;
+	dnode.size = 0;
+	dnode.link = 2;
+	time(&(dnode.vstat.st_atime));
+	time(&(dnode.vstat.st_mtime));
+
+	for(int i = 0; i < 24; i++){
+		if(i < 16){
+			dnode.direct_ptr[i] = 0;
+		}else{
+			dnode.indirect_ptr[i - 16] = 0;
+		}
+	}
+
+	if(dir_add(prnt_node, dino, dir, strlen(dir)) == -1){
+		// going to need to unset inode bitmap if fail
+		//printf("Total blocks used after operation: %d\n", total_blocks_used());
+		return -1;
+	}
+
+	format_new_dir(&dnode, prnt_node.ino);
+	writei(dino, &dnode);
+	//printf("Total blocks used after operation: %d\n", total_blocks_used());
+	return 0;
+}
+
+//OPTIONAL
+static int rufs_rmdir(const char *path) {
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+
+	// Step 2: Call get_node_by_path() to get inode of target directory
+
+	// Step 3: Clear data block bitmap of target directory
+
+	// Step 4: Clear inode bitmap and its data block
+
+	// Step 5: Call get_node_by_path() to get inode of parent directory
+
+	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+
+	// Removing a directory under /.snapshots deletes the snapshot
+	char *parent = get_dirname(path);
+	char *dir = get_basename(path);
+
+	if(!parent || !dir){
+		return -ENOMEM;
+	}
+
+	if(is_snapshot_dir(parent)){
+		return snapshot_delete(dir);
+	}
+
+	return 0;
+}
+
+static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+// Parent directory of path, in the request arena
+char *get_dirname(const char *path){
+	char *pth_cpy = arena_strdup(path);
+	return pth_cpy ? dirname(pth_cpy) : NULL;
+}
+
+// Last component of path, in the request arena
+char *get_basename(const char *path){
+	char *pth_cpy = arena_strdup(path);
+	return pth_cpy ? basename(pth_cpy) : NULL;
+}
+
+static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	// Step 3: Call get_avail_ino() to get an available inode number
+	// Step 4: Call dir_add() to add directory entry of target file to parent directory
+	// Step 5: Update inode for target file
+	// Step 6: Call writei() to write inode to disk
+	char *parent = get_dirname(path);
+	char *file = get_basename(path);
+	// printf("parent: %s\n", parent);
+	// printf("filename: %s\n", file);
+	struct inode prnt_node;
+	int err;
+
+	if(!parent || !file){
+		return -ENOMEM;
+	}
+
+	if(is_snapshot_dir(parent)){
+		return -EROFS;
+	}
+
+	err = get_node_by_path(parent, 0, &prnt_node);
+	if(err < 0){
+		return -ENOENT;
+	}
+
+	if(SNAP_OF(prnt_node.ino) >= 0 || (snapshots && prnt_node.ino == 0 && strcmp(file, SNAP_DIR) == 0)){
+		return (SNAP_OF(prnt_node.ino) >= 0) ? -EROFS : -EEXIST;
+	}
+
+	struct inode file_node;
+	int f_ino = get_avail_ino();
+	if(f_ino == -1){
+		return -1;
+	}
+
+	// New files start out empty with their data inline
+	memset(&file_node, '\0', sizeof(struct inode));
+	file_node.ino = f_ino;
+	file_node.valid = 1;
+	file_node.type = S_IFREG;
+	file_node.flags = INODE_INLINE | (rufs_conf.compress ? INODE_COMPRESSED : 0);
+	file_node.size = 0;
+	file_node.link = 1;
+	file_node.vstat.st_size = 0;
+	time(&(file_node.vstat.st_atime));
+	time(&(file_node.vstat.st_mtime));
+
+	if(dir_add(prnt_node, f_ino, file, strlen(file)) == -1){
+		// going to need to unset inode bitmap if fail
+		return -1;
+	}
+
+	writei(f_ino, &file_node);
+	set_open_cache(&file_node, fi);
+	open_ref(&file_node, fi);
+	return 0;
+}
+
+static int rufs_open(const char *path, struct fuse_file_info *fi) {
+	// Step 1: Call get_node_by_path() to get inode from path
+	// Step 2: If not find, return -1
+	struct inode node;
+	int err;
+	err = get_node_by_path(path, 0, &node);
+
+	if(err < 0){
+		return -ENOENT;
+	}
+
+	set_open_cache(&node, fi);
+	open_ref(&node, fi);
+	return 0;
+}
+
+/*
+ * compressed clusters
+ *
+ * An INODE_COMPRESSED file is stored in clusters of CLUSTER_BLOCKS blocks. A
+ * compressed cluster c is a run of contiguous blocks starting with a struct
+ * cluster_hdr; map entry c * CLUSTER_BLOCKS holds the first block of the run
+ * and entry c * CLUSTER_BLOCKS + 1 minus its length. A cluster whose second
+ * entry is not negative is stored raw, one block per entry, which is used
+ * when compressing does not save at least one block.
+ */
+int cluster_alloc_buffers(){
+	if(!ccache.data){
+		ccache.data = malloc(CLUSTER_BYTES);
+	}
+
+	if(!cluster_buf){
+		cluster_buf = malloc(CLUSTER_BYTES);
+	}
+
+	if(!ccache.data || !cluster_buf){
+		perror("Malloc failure: compression cluster buffers\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the uncompressed contents of cluster c of node into buf
+ */
+int cluster_load(struct inode *node, int c, char *buf){
+	int first = c * CLUSTER_BLOCKS;
+	int run_start, run_len;
+
+	if(get_file_entry(node, first, &run_start) < 0 || get_file_entry(node, first + 1, &run_len) < 0){
+		return -1;
+	}
+
+	if(run_len < 0){
+		struct cluster_hdr *hdr = (struct cluster_hdr *)cluster_buf;
+		int blocks = -run_len;
+
+		for(int i = 0; i < blocks; i++){
+			if(bio_read(run_start + i, cluster_buf + (i * BLOCK_SIZE)) < 0){
+				return -1;
 			}
-		}else if((i - 16) < 8){
-			indir_ptr = dir_inode.indirect_ptr[i - 16];
-			if(indir_ptr == 0){
+		}
+
+		if(hdr->magic != CLUSTER_MAGIC || hdr->clen > (blocks * BLOCK_SIZE) - sizeof(struct cluster_hdr)){
+			return -1;
+		}
+
+		int len = lz_decompress(cluster_buf + sizeof(struct cluster_hdr), hdr->clen, buf, CLUSTER_BYTES);
+		if(len < 0){
+			return -1;
+		}
+
+		memset(buf + len, '\0', CLUSTER_BYTES - len);
+		return 0;
+	}
+
+	for(int i = 0; i < CLUSTER_BLOCKS; i++){
+		int blkno = get_file_blkno(node, first + i, 0, NULL);
+		if(blkno < 0){
+			return -1;
+		}
+
+		if(blkno == 0){
+			memset(buf + (i * BLOCK_SIZE), '\0', BLOCK_SIZE);
+		}else if(bio_read(blkno, buf + (i * BLOCK_SIZE)) < 0){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the blocks of cluster c of node and clears its map entries
+ */
+int cluster_release(struct inode *node, int c){
+	int first = c * CLUSTER_BLOCKS;
+	int run_start, run_len;
+
+	if(get_file_entry(node, first, &run_start) < 0 || get_file_entry(node, first + 1, &run_len) < 0){
+		return -1;
+	}
+
+	if(run_len < 0){
+		for(int i = 0; i < -run_len; i++){
+			block_unref(run_start + i);
+		}
+
+		if(set_file_entry(node, first, 0) < 0 || set_file_entry(node, first + 1, 0) < 0){
+			return -1;
+		}
+		return 0;
+	}
+
+	for(int i = 0; i < CLUSTER_BLOCKS; i++){
+		int blkno;
+		if(get_file_entry(node, first + i, &blkno) < 0){
+			return -1;
+		}
+
+		if(blkno > 0){
+			block_unref(blkno);
+			if(set_file_entry(node, first + i, 0) < 0){
 				return -1;
-			}else if(bio_read(indir_ptr, ptr_blk) < 0){
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes buf as cluster c of node, compressed if that saves at least a block.
+ * node is updated in memory only, the caller writes it back.
+ */
+int cluster_store(struct inode *node, int c, const char *buf){
+	int first = c * CLUSTER_BLOCKS;
+	off_t c_ofs = (off_t)c * CLUSTER_BYTES;
+
+	// Only the part of the cluster below end of file is stored
+	int len = CLUSTER_BYTES;
+	if(node->vstat.st_size - c_ofs < len){
+		len = node->vstat.st_size - c_ofs;
+	}
+	if(len <= 0){
+		return 0;
+	}
+
+	int blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int cap = ((blocks - 1) * BLOCK_SIZE) - (int)sizeof(struct cluster_hdr);
+	int clen = (cap > 0) ? lz_compress(buf, len, cluster_buf + sizeof(struct cluster_hdr), cap) : 0;
+
+	if(clen > 0){
+		int run_len = (sizeof(struct cluster_hdr) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		ag_set_goal(node, 0);
+		int run_start = get_avail_blkrun(run_len);
+
+		if(run_start != -1){
+			struct cluster_hdr *hdr = (struct cluster_hdr *)cluster_buf;
+			hdr->magic = CLUSTER_MAGIC;
+			hdr->clen = clen;
+
+			for(int i = 0; i < run_len; i++){
+				if(bio_write_data(run_start + i, cluster_buf + (i * BLOCK_SIZE)) < 0){
+					return -1;
+				}
+			}
+
+			// The new copy is on disk, drop the old one
+			if(cluster_release(node, c) < 0 ||
+				set_file_entry(node, first, run_start) < 0 ||
+				set_file_entry(node, first + 1, -run_len) < 0){
 				return -1;
 			}
+			return 0;
+		}
+	}
+
+	// Incompressible or no contiguous run: store raw
+	int run_len;
+	if(get_file_entry(node, first + 1, &run_len) < 0){
+		return -1;
+	}
+
+	if(run_len < 0 && cluster_release(node, c) < 0){
+		return -1;
+	}
+
+	for(int i = 0; i < blocks; i++){
+		int blkno = get_file_blkno(node, first + i, 0, NULL);
+		if(blkno >= 0){
+			blkno = file_block_for_write(node, first + i, blkno);
+		}
+
+		if(blkno <= 0 || bio_write_data(blkno, buf + (i * BLOCK_SIZE)) < 0){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the cached cluster back if it is dirty. If it belongs to cur, cur
+ * is updated in memory and *cur_dirty is set, otherwise its inode is read
+ * and written here.
+ */
+int ccache_writeback(struct inode *cur, int *cur_dirty){
+	if(ccache.ino < 0 || !ccache.dirty){
+		return 0;
+	}
+
+	struct inode other;
+	struct inode *node = cur;
+	if(!cur || cur->ino != ccache.ino){
+		if(readi(ccache.ino, &other) < 0){
+			return -1;
+		}
+		node = &other;
+	}
+
+	if(cluster_store(node, ccache.cluster, ccache.data) < 0){
+		return -1;
+	}
+	ccache.dirty = 0;
+
+	if(node == cur){
+		*cur_dirty = 1;
+		return 0;
+	}
+
+	return writei(other.ino, &other);
+}
+
+/*
+ * Makes the cluster cache hold cluster c of node
+ */
+int ccache_get(struct inode *node, int c, int *node_dirty){
+	if(ccache.ino == node->ino && ccache.cluster == c){
+		return 0;
+	}
+
+	if(cluster_alloc_buffers() < 0 || ccache_writeback(node, node_dirty) < 0){
+		return -1;
+	}
+
+	ccache.ino = -1;
+	if(cluster_load(node, c, ccache.data) < 0){
+		return -1;
+	}
+
+	ccache.ino = node->ino;
+	ccache.cluster = c;
+	ccache.dirty = 0;
+	return 0;
+}
+
+/*
+ * Copies data between buf and a compressed file through the cluster cache.
+ * Returns the number of bytes copied or -1 if nothing could be copied.
+ */
+int compressed_rw(struct inode *node, char *buf, size_t size, off_t offset, int write, int *node_dirty){
+	int done = 0;
+
+	while(done < size){
+		off_t pos = offset + done;
+		int c = pos / CLUSTER_BYTES;
+		int c_ofs = pos % CLUSTER_BYTES;
+		int chunk = CLUSTER_BYTES - c_ofs;
+		if(chunk > (size - done)){
+			chunk = size - done;
+		}
+
+		if(ccache_get(node, c, node_dirty) < 0){
+			break;
+		}
+
+		if(write){
+			memcpy(ccache.data + c_ofs, buf + done, chunk);
+			ccache.dirty = 1;
+
+			// Writeback of this cluster needs the size covering it
+			if(node->vstat.st_size < (pos + chunk)){
+				node->vstat.st_size = (pos + chunk);
+				node->size = (node->vstat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+				*node_dirty = 1;
+			}
+		}else{
+			memcpy(buf + done, ccache.data + c_ofs, chunk);
+		}
+
+		done += chunk;
+	}
+
+	return (done > 0 || size == 0) ? done : -1;
+}
+
+/*
+ * Moves the data of an INODE_INLINE file into its first data block.
+ * node is updated in memory only, the caller writes it back.
+ */
+int inline_to_blocks(struct inode *node){
+	off_t len = node->vstat.st_size;
+
+	memset(data_blk, '\0', BLOCK_SIZE);
+	memcpy(data_blk, node->inline_data, len);
+
+	memset(node->inline_data, '\0', INLINE_MAX);
+	node->flags &= ~INODE_INLINE;
+	node->size = 0;
+
+	if(len == 0){
+		return 0;
+	}
+
+	int blkno = get_file_blkno(node, 0, 1, NULL);
+	if(blkno <= 0){
+		return -1;
+	}
+
+	if(bio_write_data(blkno, data_blk) < 0){
+		return -1;
+	}
+
+	node->size = 1;
+	return 0;
+}
+
+static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: You could call get_node_by_path() to get inode from path
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: copy the correct amount of data from offset to buffer
+	// Note: this function should return the amount of bytes you copied to buffer
+	if(!path || offset < 0){
+		return -1;
+	}
+
+	struct inode node;
+	int err;
+	err = get_node_by_path(path, 0, &node);
+	if(err < 0){
+		return -ENOENT;
+	}
 
-			int *ptrs = (int *)ptr_blk;
-			for(int i = 0; i < PTRS; i++){
-				if(ptrs[i] == 0){
-					return -1;
-				}else if(bio_read(ptrs[i], data_blk) < 0){
-					return -1;
-				}
+	// Reads stop at the end of the file
+	off_t f_size = node.vstat.st_size;
+	if(offset >= f_size){
+		return 0;
+	}
 
-				if(get_dirent_from_block(data_blk, fname, name_len, dirent)){
-					return 0;
-				}
-			}
-		}
+	if(size > (f_size - offset)){
+		size = f_size - offset;
 	}
 
-	return  -1;
-}
+	if(node.flags & INODE_INLINE){
+		memcpy(buffer, (node.inline_data + offset), size);
+		return size;
+	}
 
-int dir_block_contains(void *blk, const char *fname, size_t name_len){
-	struct dirent *dir_ents = (struct dirent *)blk;
-	for(int i = 0; i < DIRENTS; i++){
-		if(!dir_ents[i].valid){
-			continue;
-		}else if(name_len == dir_ents[i].len && strcmp(dir_ents[i].name, fname) == 0){
-			return 1;
+	if(node.flags & INODE_COMPRESSED){
+		int node_dirty = 0;
+		int ret = compressed_rw(&node, buffer, size, offset, 0, &node_dirty);
+		if(node_dirty && writei(node.ino, &node) < 0){
+			return -1;
 		}
+		return ret;
 	}
 
-	return 0;
-}
-
-int dir_contains(struct inode dir_inode, const char *fname, size_t name_len){
-	int blk_ptr = 0;
-	int indir_blk = 0;
+	int blk_index = (offset / BLOCK_SIZE);
+	int blk_ofs = (offset % BLOCK_SIZE);
+	int bytes_read = 0;
+	int bytes_left = size;
+	char *data = (char *)data_blk;
 
-	for(int i = 0; i < 24; i++){
-		if(i < 16){
-			blk_ptr = dir_inode.direct_ptr[i];
-			if(blk_ptr == 0){
-				return 0;
-			}else if(bio_read(blk_ptr, data_blk) < 0){
-				return 0;
-			}
-		
-			if(dir_block_contains(data_blk, fname, name_len)){
-				return 1;
-			}
-		}else if((i - 16) < 8){
-			indir_blk = dir_inode.indirect_ptr[i - 16];
-			if(indir_blk == 0){
-				return 0;
-			}else if(bio_read(indir_blk, ptr_blk) < 0){
-				return 0;
-			}
+	while(bytes_left > 0){
+		int chunk = (BLOCK_SIZE - blk_ofs);
+		if(chunk > bytes_left){
+			chunk = bytes_left;
+		}
 
-			int *ptrs = (int *)ptr_blk;
-			for(int i = 0; i < PTRS; i++){
-				if(ptrs[i] == 0){
-					continue;
-				}else if(bio_read(ptrs[i], data_blk) < 0){
-					return 0;
-				}
+		int blkno = get_file_blkno(&node, blk_index, 0, NULL);
+		if(blkno < 0){
+			return -1;
+		}
 
-				if(dir_block_contains(data_blk, fname, name_len)){
-					return 1;
-				}
-			}
+		// Holes read back as zeros
+		if(blkno == 0){
+			memset((buffer + bytes_read), '\0', chunk);
+		}else if(bio_read(blkno, data_blk) < 0){
+			return -1;
+		}else{
+			memcpy((buffer + bytes_read), (data + blk_ofs), chunk);
 		}
+
+		bytes_read += chunk;
+		bytes_left -= chunk;
+		blk_ofs = 0;
+		blk_index++;
 	}
 
-	return 0;
+	return bytes_read;
 }
 
-int add_dirent_to_block(void *blk, uint16_t f_ino, const char *fname, size_t name_len){
-	struct dirent *dir_ents = (struct dirent *)blk;
-	for(int i = 0; i < DIRENTS; i++){
-		if(dir_ents[i].valid == 0){
-			dir_ents[i].ino = f_ino;
-			dir_ents[i].valid = 1;
-			memcpy(&(dir_ents[i].name), fname, name_len + 1);
-			dir_ents[i].len = name_len;
+/*
+ * zero-copy reads
+ *
+ * read_buf hands libfuse the DISKFILE descriptor and offsets of the blocks a
+ * read covers, so the data is spliced from the disk image to /dev/fuse
+ * without passing through data_blk or the reply buffer. Only holes, blocks
+ * whose checksums must be verified, and inline and compressed files, which
+ * have no on-disk byte range to point at, are read into memory, along with
+ * blocks a reply could not keep from being reused (see held blocks).
+ */
+void free_bufvec(struct fuse_bufvec *bufv){
+	for(size_t i = 0; i < bufv->count; i++){
+		if(!(bufv->buf[i].flags & FUSE_BUF_IS_FD)){
+			free(bufv->buf[i].mem);
+		}
+	}
+	free(bufv);
+}
 
-			return 1;
+/*
+ * Appends len bytes at disk offset pos to bufv, extending the last buffer when
+ * it ends where this one starts
+ */
+void bufvec_add_fd(struct fuse_bufvec *bufv, off_t pos, size_t len){
+	if(bufv->count > 0){
+		struct fuse_buf *last = &bufv->buf[bufv->count - 1];
+		if((last->flags & FUSE_BUF_IS_FD) && (last->pos + (off_t)last->size) == pos){
+			last->size += len;
+			return;
 		}
 	}
 
-	return 0;
+	struct fuse_buf *buf = &bufv->buf[bufv->count++];
+	buf->size = len;
+	buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf->mem = NULL;
+	buf->fd = dev_fd();
+	buf->pos = pos;
 }
 
+/*
+ * Appends a zeroed memory buffer of len bytes (at least a block) to bufv
+ */
+char *bufvec_add_mem(struct fuse_bufvec *bufv, size_t len){
+	char *mem = calloc(1, (len > BLOCK_SIZE) ? len : BLOCK_SIZE);
+	if(!mem){
+		return NULL;
+	}
+
+	struct fuse_buf *buf = &bufv->buf[bufv->count++];
+	buf->size = len;
+	buf->flags = 0;
+	buf->mem = mem;
+	buf->fd = -1;
+	buf->pos = 0;
+	return mem;
+}
 
 /*
- * Adds dirent to a block pointed to by dir_inode if an invalid dirent exists within a block pointed to by dir_inode
+ * Whether a reply of ino may splice blkno: ino must be open, so that the
+ * block is held if freed before the reply is done, and no other open inode
+ * may have spliced it already, fd_reader only records one.
  */
-int add_dirent(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len){
-	int blk_ptr = 0;
-	int indir_blk = 0;
+int reply_may_splice(uint16_t ino, int blkno){
+	if(open_refs[ino] == 0){
+		return 0;
+	}
 
-	for(int i = 0; i < 24; i++){
-		// Direct Pointer
-		if(i < 16){
-			blk_ptr = dir_inode.direct_ptr[i];
-			if(blk_ptr == 0){
-				return 0;
-			}else if(bio_read(blk_ptr, data_blk) < 0){
-				return 0;
-			}
-		
-			if(add_dirent_to_block(data_blk, f_ino, fname, name_len) && bio_write(blk_ptr, data_blk) >= 0){
-				dir_inode.link++;
-				return 1;
-			}
+	int reader = fd_reader[blkno];
+	return reader == 0 || reader == ino + 1 || open_refs[reader - 1] == 0;
+}
 
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	if(!path || offset < 0){
+		return -EINVAL;
+	}
 
-		// Indirect Pointer
-		}else if((i - 16) < 8){
-			indir_blk = dir_inode.indirect_ptr[i - 16];
-			if(indir_blk == 0){
-				return 0;
-			}else if(bio_read(indir_blk, ptr_blk) < 0){
-				return 0;
-			}
+	struct inode node;
+	if(get_node_by_path(path, 0, &node) < 0){
+		return -ENOENT;
+	}
 
-			int *ptrs = (int *)ptr_blk;
-			for(int i = 0; i < PTRS; i++){
-				if(ptrs[i] == 0){
-					continue;
-				}else if(bio_read(ptrs[i], data_blk) < 0){
-					return 0;
-				}
+	// Reads stop at the end of the file
+	off_t f_size = node.vstat.st_size;
+	if(offset >= f_size){
+		size = 0;
+	}else if(size > (f_size - offset)){
+		size = f_size - offset;
+	}
 
-				if(add_dirent_to_block(data_blk, f_ino, fname, name_len) && bio_write(ptrs[i], data_blk) >= 0){
-					dir_inode.link++;
-					return 1;
-				}
+	int blk_index = (offset / BLOCK_SIZE);
+	int blk_ofs = (offset % BLOCK_SIZE);
+	int nbufs = (blk_ofs + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (nbufs * sizeof(struct fuse_buf)));
+	if(!bufv){
+		return -ENOMEM;
+	}
+
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if(size == 0){
+		*bufp = bufv;
+		return 0;
+	}
+	bufv->count = 0;
+
+	if(node.flags & (INODE_INLINE | INODE_COMPRESSED)){
+		char *mem = bufvec_add_mem(bufv, size);
+		int ret = mem ? rufs_read(path, mem, size, offset, fi) : -1;
+		if(ret < 0){
+			free_bufvec(bufv);
+			return mem ? -EIO : -ENOMEM;
+		}
+
+		bufv->buf[0].size = ret;
+		*bufp = bufv;
+		return 0;
+	}
+
+	size_t bytes_left = size;
+	while(bytes_left > 0){
+		size_t chunk = (BLOCK_SIZE - blk_ofs);
+		if(chunk > bytes_left){
+			chunk = bytes_left;
+		}
+
+		int blkno = get_file_blkno(&node, blk_index, 0, NULL);
+		if(blkno < 0){
+			free_bufvec(bufv);
+			return -EIO;
+		}
+
+		if(blkno > 0 && !bio_checked(blkno) && !dev_direct() && reply_may_splice(node.ino, blkno)){
+			fd_reader[blkno] = node.ino + 1;
+			bufvec_add_fd(bufv, ((off_t)blkno * BLOCK_SIZE) + blk_ofs, chunk);
+		}else{
+			// Holes read back as zeros, checked blocks are verified by bio_read()
+			char *mem = bufvec_add_mem(bufv, chunk);
+			if(!mem){
+				free_bufvec(bufv);
+				return -ENOMEM;
 			}
 
+			if(blkno > 0){
+				if(bio_read(blkno, mem) < 0){
+					free_bufvec(bufv);
+					return -EIO;
+				}
+				memmove(mem, (mem + blk_ofs), chunk);
+			}
 		}
+
+		bytes_left -= chunk;
+		blk_ofs = 0;
+		blk_index++;
 	}
 
+	*bufp = bufv;
 	return 0;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	// Step 2: Check if fname (directory name) is already used in other entries
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	// Allocate a new data block for this directory if it does not exist
-	// Update directory inode
-	// Write directory entry
-	if(dir_contains(dir_inode, fname, name_len)){
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	// Step 1: You could call get_node_by_path() to get inode from path
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: Write the correct amount of data from offset to disk
+	// Step 4: Update the inode info and write it to disk
+	// Note: this function should return the amount of bytes you write to disk
+	if(!path || offset < 0){
 		return -1;
 	}
 
-	int size = dir_inode.size;
-	if(!add_dirent(dir_inode, f_ino, fname, name_len)){
-		int blk_no = get_avail_blkno();
-		if(blk_no == -1){
-			return -1;
-		}
+	if((offset + (off_t)size) > MAX_FSIZE){
+		return -EFBIG;
+	}
 
-		format_dir_block(blk_no);
-		if(bio_read(blk_no, data_blk)< 0){
-			return -1;
+	struct inode node;
+	int err;
+	err = get_node_by_path(path, 0, &node);
+	if(err < 0){
+		return -ENOENT;
+	}
+
+	if(SNAP_OF(node.ino) >= 0){
+		return -EROFS;
+	}
+
+	int node_dirty = 0;
+	if(node.flags & INODE_INLINE){
+		// Small files are updated in place inside the inode
+		if((offset + size) <= INLINE_MAX){
+			memcpy((node.inline_data + offset), buffer, size);
+			if(node.vstat.st_size < (offset + size)){
+				node.vstat.st_size = (offset + size);
+			}
+
+			if(writei(node.ino, &node) < 0){
+				return -1;
+			}
+			return size;
 		}
-		struct dirent *dir_ents = (struct dirent *)data_blk;
 
-		dir_ents[0].ino = f_ino;
-		dir_ents[0].valid = 1;
-		memcpy(&(dir_ents[0].name), fname, name_len);
-		dir_ents[0].len = name_len;
+		if(inline_to_blocks(&node) < 0){
+			return -ENOSPC;
+		}
+		node_dirty = 1;
+	}
 
-		if(bio_write(blk_no, data_blk)< 0){
+	if(node.flags & INODE_COMPRESSED){
+		int ret = compressed_rw(&node, (char *)buffer, size, offset, 1, &node_dirty);
+		if(node_dirty && writei(node.ino, &node) < 0){
 			return -1;
 		}
-		dir_inode.link++;
+		return (ret < 0) ? -ENOSPC : ret;
+	}
 
-		if(size < 16){
-			dir_inode.direct_ptr[size] = blk_no;
-		}else{
-			int indir_blk = 0;
-			int indir_index = 0;
+	int blk_index = (offset / BLOCK_SIZE);
+	int blk_ofs = (offset % BLOCK_SIZE);
+	int bytes_written = 0;
+	int bytes_left = size;
+	char *data = (char *)data_blk;
 
-			if((size - 16) < PTRS){
-				indir_blk = dir_inode.indirect_ptr[0];
-			}else{
-				indir_index = (size - 16) / PTRS;
-				indir_blk = dir_inode.indirect_ptr[indir_index];
-			}
+	if(reserve_blocks(&node, blk_index, (blk_ofs + size + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0){
+		return -EIO;
+	}
 
-			if(indir_blk == 0){
-				indir_blk = get_avail_blkno();
-				if(indir_blk == -1){
-					return -1;
-				}
+	while(bytes_left > 0){
+		int chunk = (BLOCK_SIZE - blk_ofs);
+		if(chunk > bytes_left){
+			chunk = bytes_left;
+		}
 
-				format_ptr_block(indir_blk);
-				dir_inode.indirect_ptr[indir_index] = indir_blk;
-			}
+		int blkno = get_file_blkno(&node, blk_index, 0, NULL);
+		if(blkno < 0){
+			break;
+		}
 
-			if(bio_read(indir_blk, ptr_blk) < 0){
-				return -1;
+		// Partial block writes merge with the existing block contents
+		if(chunk < BLOCK_SIZE){
+			if(blkno == 0){
+				memset(data_blk, '\0', BLOCK_SIZE);
+			}else if(bio_read(blkno, data_blk) < 0){
+				break;
 			}
+		}
 
-			int *ptrs = (int *)ptr_blk;
-			int ptr_index = (size - 16) % PTRS;
-			ptrs[ptr_index] = blk_no;
-
-			if(bio_write(indir_blk, ptr_blk) < 0){
-				return -1;
-			}
+		memcpy((data + blk_ofs), (buffer + bytes_written), chunk);
+		if(store_file_block(&node, blk_index, blkno, data_blk, &node_dirty) < 0){
+			// Pointer blocks may have been allocated before the failure
+			node_dirty = 1;
+			break;
 		}
-		
-		dir_inode.size++;
-		writei(dir_inode.ino, &dir_inode);
 
+		bytes_written += chunk;
+		bytes_left -= chunk;
+		blk_ofs = 0;
+		blk_index++;
 	}
+	release_reserve();
 
-	return 0;
-}
+	// Grow the file to cover the last byte written
+	uint32_t end_blk = ((offset + bytes_written) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(bytes_written > 0 && node.size < end_blk){
+		node.size = end_blk;
+		node_dirty = 1;
+	}
 
-//OPTIONAL
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	// Step 2: Check if fname exist
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	if(bytes_written > 0 && node.vstat.st_size < (offset + bytes_written)){
+		node.vstat.st_size = (offset + bytes_written);
+		node_dirty = 1;
+	}
 
-	return 0;
+	if(node_dirty && writei(node.ino, &node) < 0){
+		return -1;
+	}
+
+	if(bytes_written == 0 && size > 0){
+		return -ENOSPC;
+	}
+
+	return bytes_written;
 }
 
-/* 
- * namei operation
+/*
+ * copy_file_range and clone
+ *
+ * The block aligned middle of a copy is shared with the source through the
+ * block reference counts, so it costs one map update per block and the data
+ * is copied only when either file writes it later. Unaligned edges, inline and
+ * compressed files, and images without reference counts copy the bytes inside
+ * the daemon through the read and write paths.
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	// printf("get_node_by_path(): %s\n", path);
+ssize_t copy_range_data(const char *path_in, off_t off_in, const char *path_out, off_t off_out, size_t len){
+	char *buf = (char *)arena_alloc(COPY_CHUNK);
+	ssize_t done = 0;
 
-	if(strcmp(path, "/" ) == 0 && ino == 0){
-		readi(0, inode);
-		return 0;
+	if(!buf){
+		return -ENOMEM;
 	}
 
-	char *pth_cpy = (char *)malloc(strlen(path) + 1);
-	memcpy(pth_cpy, path, strlen(path) + 1);
+	while(done < len){
+		size_t chunk = (len - done < COPY_CHUNK) ? (len - done) : COPY_CHUNK;
 
-	struct dirent dir_ent;
-	int curr_ino = ino;
-	char *token = strtok(pth_cpy, "/");
+		int n = rufs_read(path_in, buf, chunk, off_in + done, NULL);
+		if(n <= 0){
+			if(n < 0 && done == 0){
+				done = -EIO;
+			}
+			break;
+		}
 
-	while(token != NULL) {
-		int found = dir_find(curr_ino, token, strlen(token), &dir_ent);
-		if(found == -1){
-			return -1;
+		int w = rufs_write(path_out, buf, n, off_out + done, NULL);
+		if(w < 0){
+			if(done == 0){
+				done = (w == -1) ? -EIO : w;
+			}
+			break;
 		}
 
-		curr_ino = dir_ent.ino;
-        token = strtok(NULL, "/");
-    }
+		done += w;
+		if(w < n){
+			break;
+		}
+	}
 
-	free(pth_cpy);
-	readi(curr_ino, inode);
-	return 0;
+	return done;
 }
 
-/* 
- * Make file system
+/*
+ * Maps count blocks of dst starting at dst_idx to the blocks of src starting
+ * at src_idx. Returns the number of blocks shared, less than count if a
+ * reference count is saturated or an update fails. The caller writes dst back.
  */
-int rufs_mkfs() {
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
+int share_blocks(struct inode *src, int src_idx, struct inode *dst, int dst_idx, int count){
+	int i;
 
-	// write superblock information
-	// initialize inode bitmap
-	// initialize data block bitmap
-	// update bitmap information for root directory
-	// update inode for root directory
-	if(init_superblock() < 0 || 
-		init_inode_bitmap() < 0 || 
-		init_data_bitmap() < 0 ||
-		init_data_block() < 0 ||
-		init_ptr_block() < 0 ||
-		init_inode_region() < 0
-	){
-		return - 1;
+	for(i = 0; i < count; i++){
+		int blkno, old;
+
+		if(get_file_entry(src, src_idx + i, &blkno) < 0 || get_file_entry(dst, dst_idx + i, &old) < 0){
+			break;
+		}
+
+		// Already shared, or a hole on both sides
+		if(blkno == old){
+			continue;
+		}
+
+		if(blkno > 0 && block_ref(blkno) < 0){
+			break;
+		}
+
+		if(set_file_entry(dst, dst_idx + i, blkno) < 0){
+			if(blkno > 0){
+				block_unref(blkno);
+			}
+			break;
+		}
+
+		if(old > 0 && block_unref(old) < 0){
+			i++;
+			break;
+		}
 	}
 
-	return 0;
+	return i;
 }
 
-
-/* 
- * FUSE file operations
+/*
+ * Copies len bytes of path_in at off_in to path_out at off_out, sharing whole
+ * blocks where possible. Returns the bytes copied, stopping at the end of the
+ * source, or -errno.
  */
-static void *rufs_init(struct fuse_conn_info *conn) {
-	// Step 1a: If disk file is not found, call mkfs
-	// Step 1b: If disk file is found, just initialize in-memory data structures and read superblock from disk
-	if(dev_open(diskfile_path) == 0){
-		// read super block information
-		init_data_structures();
-		bio_read(SU_BLK_IDX, su_blk);
-	}else{
-		rufs_mkfs();
+ssize_t clone_range(const char *path_in, off_t off_in, const char *path_out, off_t off_out, size_t len){
+	struct inode src, dst;
+
+	if(off_in < 0 || off_out < 0){
+		return -EINVAL;
 	}
 
-	print_macros();
-	return NULL;
-}
+	// A block shared while a write is in flight to it would change both files
+	drain_writes();
 
-static void rufs_destroy(void *userdata) {
-	// Step 1: De-allocate in-memory data structures
-	// Step 2: Close diskfile
-	if(su_blk){
-		free(su_blk);
+	if(get_node_by_path(path_in, 0, &src) < 0 || get_node_by_path(path_out, 0, &dst) < 0){
+		return -ENOENT;
 	}
 
-	if(inode_bmap){
-		free(inode_bmap);
+	if(src.type != S_IFREG || dst.type != S_IFREG){
+		return -EINVAL;
 	}
 
-	if(blk_bmap){
-		free(blk_bmap);
+	if(SNAP_OF(dst.ino) >= 0){
+		return -EROFS;
 	}
 
-	if(inode_blk){
-		free(inode_blk);
+	if(off_in >= src.vstat.st_size){
+		return 0;
 	}
 
-	if(data_blk){
-		free(data_blk);
+	if(len > (src.vstat.st_size - off_in)){
+		len = src.vstat.st_size - off_in;
 	}
 
-	if(ptr_blk){
-		free(ptr_blk);
+	if((off_out + (off_t)len) > MAX_FSIZE){
+		return -EFBIG;
 	}
 
-	dev_close();
-}
+	// Snapshot blocks are left to the snapshot, copies of them are real copies
+	off_t head = (BLOCK_SIZE - (off_in % BLOCK_SIZE)) % BLOCK_SIZE;
+	int shareable = refcnt && src.ino != dst.ino && SNAP_OF(src.ino) < 0 &&
+		!(src.flags & (INODE_INLINE | INODE_COMPRESSED)) &&
+		!(dst.flags & INODE_COMPRESSED) &&
+		(off_in % BLOCK_SIZE) == (off_out % BLOCK_SIZE) &&
+		len >= head + BLOCK_SIZE;
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
-	// Step 1: call get_node_by_path() to get inode from path
-	struct inode node;
-	int err;
+	if(!shareable){
+		return copy_range_data(path_in, off_in, path_out, off_out, len);
+	}
 
-	err = get_node_by_path(path, 0, &node);
-	if (err < 0) {
-		return -ENOENT; //error code for no such file exist
+	ssize_t done = 0;
+	if(head > 0){
+		done = copy_range_data(path_in, off_in, path_out, off_out, head);
+		if(done < head){
+			return done;
+		}
+
+		// The write path updated dst on disk
+		if(get_node_by_path(path_out, 0, &dst) < 0){
+			return done;
+		}
 	}
 
-	// Step 2: fill attribute of file into stbuf from inode
-	if (node.type == S_IFDIR) { //dir type
-		stbuf->st_mode   = S_IFDIR | 0755; //default permission for dir
-		stbuf->st_nlink  = 2;
-		// stbuf->st_nlink  = node.link;
-	} else if (node.type == S_IFREG) { //regular file type
-		stbuf->st_mode = S_IFREG | 0644; //default permission for regular file
-		stbuf->st_nlink = 1;
-		// stbuf->st_nlink  = node.link;
+	int node_dirty = 0;
+	if(dst.flags & INODE_INLINE){
+		if(inline_to_blocks(&dst) < 0){
+			return (done > 0) ? done : -ENOSPC;
+		}
+		node_dirty = 1;
 	}
 
-	// Update size (bytes), size (512 blocks), uid, gid
-	stbuf->st_size = node.size * BLOCK_SIZE;
-	stbuf->st_blocks = (stbuf->st_size % 512 == 0) ? (stbuf->st_size / 512) : ((stbuf->st_size / 512) + 1);
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
+	int src_idx = (off_in + head) / BLOCK_SIZE;
+	int dst_idx = (off_out + head) / BLOCK_SIZE;
+	int count = (len - head) / BLOCK_SIZE;
 
-	// Copy last access and modification time from inode.vstat to st_buf 
-	stbuf->st_atime = node.vstat.st_atime;
-	stbuf->st_mtime = node.vstat.st_mtime;
-	
-	return 0;
-}
+	int shared = share_blocks(&src, src_idx, &dst, dst_idx, count);
+	if(shared > 0){
+		done += (ssize_t)shared * BLOCK_SIZE;
+		node_dirty = 1;
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
-	// Step 1: Call get_node_by_path() to get inode from path
-	// Step 2: If not find, return -1
-	struct inode node;
-	int err;
-	err = get_node_by_path(path, 0, &node);
+		if(dst.size < (dst_idx + shared)){
+			dst.size = dst_idx + shared;
+		}
 
-	if(err < 0){
-		return -ENOENT;
+		if(dst.vstat.st_size < (off_out + done)){
+			dst.vstat.st_size = off_out + done;
+		}
 	}
 
-    return 0;
+	if(node_dirty && writei(dst.ino, &dst) < 0){
+		return -EIO;
+	}
+
+	// Blocks that could not be shared and the unaligned tail are copied
+	if(done < len){
+		ssize_t rest = copy_range_data(path_in, off_in + done, path_out, off_out + done, len - done);
+		if(rest < 0){
+			return (done > 0) ? done : rest;
+		}
+		done += rest;
+	}
+
+	return done;
 }
 
-void copy_names_to_buffer(void *blk, void *buffer, fuse_fill_dir_t filler){
-	struct dirent *dir_ents = (struct dirent *)blk;
+static ssize_t rufs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+		struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags) {
+	if(flags != 0){
+		return -EINVAL;
+	}
 
-	for(int i = 0; i < DIRENTS; i++){
-		if(dir_ents[i].valid){
-			filler(buffer, (char *)&dir_ents[i].name, NULL, 0);
+	return clone_range(path_in, offset_in, path_out, offset_out, size);
+}
+
+/*
+ * online defragmentation
+ *
+ * RUFS_IOC_DEFRAG copies the data blocks of a file into one free run and then
+ * points the block map at the copies. Until the map is switched the old
+ * blocks are untouched, so an interrupted pass leaves every entry naming a
+ * block with the right contents and at worst both copies allocated. Blocks
+ * shared with other files stay where they are, moving them would cost a
+ * copy. Blocks only a snapshot holds are copied like a write would copy them.
+ */
+
+/*
+ * Counts the data blocks of node and the extents they form, an extent being
+ * a run of blocks at consecutive block numbers
+ */
+int file_extents(struct inode *node, int *blocks, int *extents){
+	int prev = 0;
+
+	*blocks = 0;
+	*extents = 0;
+	for(int i = 0; i < node->size; i++){
+		int blkno = get_file_blkno(node, i, 0, NULL);
+		if(blkno < 0){
+			return -1;
+		}else if(blkno == 0){
+			continue;
+		}
+
+		if(blkno != prev + 1){
+			(*extents)++;
 		}
+		(*blocks)++;
+		prev = blkno;
 	}
+
+	return 0;
 }
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: Call get_node_by_path() to get inode from path
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	struct inode node;
-	int err;
+int frag_score(int blocks, int extents){
+	return (blocks > 1) ? (((extents - 1) * 100) / (blocks - 1)) : 0;
+}
 
-	err = get_node_by_path(path, 0, &node);
-	if(err < 0){
-		return -ENOENT;
+/*
+ * Moves the count data blocks of node, block old[k] mapped at index idx[k],
+ * to the run starting at start. node is written back.
+ */
+int relocate_blocks(struct inode *node, const int *idx, const int *old, int count, int start){
+	for(int k = 0; k < count; k++){
+		if(bio_read(old[k], data_blk) < 0 || bio_write_data(start + k, data_blk) < 0){
+			for(int i = 0; i < count; i++){
+				release_blkno(start + i);
+			}
+			return -1;
+		}
 	}
 
-	int blk_ptr = 0;
-	int indir_blk = 0;
-	for(int i = 0; i < 24; i++){
-		if(i < 16){
-			blk_ptr = node.direct_ptr[i];
-			if(blk_ptr == 0){
-				break;
-			}else if(bio_read(blk_ptr, data_blk) < 0){
-				return -1;
-			}
-		
-			copy_names_to_buffer(data_blk, buffer, filler);
-		}else{
-			indir_blk = node.indirect_ptr[i - 16];
-			if(indir_blk == 0){
-				break;
-			}else if(bio_read(indir_blk, ptr_blk) < 0){
-				return -1;
-			}
+	int moved = 0;
+	while(moved < count && set_file_entry(node, idx[moved], start + moved) == 0){
+		moved++;
+	}
 
-			int *ptrs = (int *)ptr_blk;
-			for(int i = 0; i < PTRS; i++){
-				if(ptrs[i] == 0){
-					break;
-				}else if(bio_read(ptrs[i], data_blk) < 0){
-					return -1;
-				}
+	if(writei(node->ino, node) < 0){
+		return -1;
+	}
 
-				copy_names_to_buffer(data_blk, buffer, filler);
-			}
+	// Copies the map never got to are dropped, the old blocks they replace stay
+	for(int k = moved; k < count; k++){
+		release_blkno(start + k);
+	}
+
+	for(int k = 0; k < moved; k++){
+		if(block_unref(old[k]) < 0){
+			return -1;
 		}
 	}
 
-	return 0;
+	return (moved == count) ? 0 : -1;
 }
 
-int format_new_dir(struct inode*dir_node, uint16_t parent_ino){
-	if(!dir_node){
-		return 0;
+int defrag_file(const char *path, struct rufs_defrag_args *args){
+	struct inode node;
+	int blocks = 0;
+	int extents = 0;
+
+	if(get_node_by_path(path, 0, &node) < 0){
+		return -ENOENT;
 	}
 
-	if(dir_node->size == 0){
-		int blkno = get_avail_blkno();
-		if(blkno == -1){
-			return 0;
-		}
+	if(node.type != S_IFREG){
+		return -EINVAL;
+	}
 
-		format_dir_block(blkno);
-		dir_node->direct_ptr[0] = blkno;
-		if(bio_read(blkno, data_blk) < 0){
-			return 0;
-		}
+	// Inline files have no blocks, compressed clusters are not moved
+	if(!(node.flags & (INODE_INLINE | INODE_COMPRESSED)) && file_extents(&node, &blocks, &extents) < 0){
+		return -EIO;
+	}
 
-		struct dirent *dir_ents = (struct dirent *)data_blk; 
-		dir_ents[0].ino = dir_node->ino;
-		dir_ents[0].valid = 1;
+	args->blocks = blocks;
+	args->extents_before = args->extents_after = extents;
+	args->score_before = args->score_after = frag_score(blocks, extents);
 
-		char dir_name[2] = ".";
-		memcpy(dir_ents[0].name, &dir_name, 2);
-		dir_ents[0].len = strlen((char *)&dir_name);
+	if((args->flags & RUFS_DEFRAG_QUERY) || extents <= 1){
+		return 0;
+	}
 
-		dir_ents[1].ino = parent_ino;
-		dir_ents[1].valid = 1;
+	if(SNAP_OF(node.ino) >= 0){
+		return -EROFS;
+	}
 
-		char par_name[3] = "..";
-		memcpy(dir_ents[1].name, &par_name, 3);
-		dir_ents[1].len = strlen((char *)&par_name);
+	// Blocks are copied, their data must be complete
+	drain_writes();
 
-		if(bio_write(blkno, data_blk) < 0){
-			return 0;
+	int *idx = (int *)arena_alloc(blocks * sizeof(int));
+	int *old = (int *)arena_alloc(blocks * sizeof(int));
+	if(!idx || !old){
+		return -ENOMEM;
+	}
+
+	int count = 0;
+	for(int i = 0; i < node.size && count < blocks; i++){
+		int blkno = get_file_blkno(&node, i, 0, NULL);
+		if(blkno > 0 && block_refs(blkno) == 1){
+			idx[count] = i;
+			old[count++] = blkno;
 		}
+	}
 
-		dir_node->size++;
-		return 1;
+	int ret = 0;
+	ag_set_goal(&node, 0);
+	int start = (count > 0) ? get_avail_blkrun(count) : 0;
+	if(start == -1){
+		ret = -ENOSPC;
+	}else if(count > 0 && relocate_blocks(&node, idx, old, count, start) < 0){
+		ret = -EIO;
 	}
 
-	return 0;
+	if(ret == 0 && file_extents(&node, &blocks, &extents) == 0){
+		args->extents_after = extents;
+		args->score_after = frag_score(blocks, extents);
+	}
+
+	return ret;
 }
 
-static int rufs_mkdir(const char *path, mode_t mode) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	// Step 3: Call get_avail_ino() to get an available inode number
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	// Step 5: Update inode for target directory
-	// Step 6: Call writei() to write inode to disk
-	char *parent = get_dirname(path);
-	char *dir = get_basename(path);
-	struct inode prnt_node;
-	int err;
+/*
+ * RUFS_IOC_CLONE, all or nothing, unlike copy_file_range
+ */
+int clone_ioctl(const char *path, struct rufs_clone_args *args){
+	struct inode src;
 
-	err = get_node_by_path(parent, 0, &prnt_node);
-	if(err < 0){
+	args->src_path[CLONE_PATH_LEN - 1] = '\0';
+	if(args->src_path[0] != '/' || get_node_by_path(args->src_path, 0, &src) < 0){
 		return -ENOENT;
 	}
 
-	struct inode dnode;
-	int dino = get_avail_ino();
-	if(dino == -1){
-		free(parent);
-		free(dir);
-		return -1;
+	if(args->src_offset > src.vstat.st_size){
+		return -EINVAL;
 	}
 
-	dnode.ino = dino;
-	dnode.valid = 1;
-	dnode.type = S_IFDIR;
-	dnode.size = 0;
-	dnode.link = 2;
-	time(&(dnode.vstat.st_atime));
-	time(&(dnode.vstat.st_mtime));
-
-	for(int i = 0; i < 24; i++){
-		if(i < 16){
-			dnode.direct_ptr[i] = 0;
-		}else{
-			dnode.indirect_ptr[i - 16] = 0;
-		}
+	uint64_t len = src.vstat.st_size - args->src_offset;
+	if(args->length != 0 && args->length < len){
+		len = args->length;
 	}
 
-	if(dir_add(prnt_node, dino, dir, strlen(dir)) == -1){
-		// going to need to unset inode bitmap if fail
-		//printf("Total blocks used after operation: %d\n", total_blocks_used());
-		free(parent);
-		free(dir);
-		return -1;
+	// rufs_ioctl_locked() invalidates the destination in the kernel
+	ssize_t ret = clone_range(args->src_path, args->src_offset, path, args->dest_offset, len);
+	if(ret < 0){
+		return ret;
 	}
 
-	format_new_dir(&dnode, prnt_node.ino);
-	writei(dino, &dnode);
-	//printf("Total blocks used after operation: %d\n", total_blocks_used());
-	free(parent);
-	free(dir);
-	return 0;
+	return (ret == len) ? 0 : -ENOSPC;
 }
 
-//OPTIONAL
-static int rufs_rmdir(const char *path) {
+static int rufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	if(flags & FUSE_IOCTL_COMPAT){
+		return -ENOSYS;
+	}
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	if(flags & FUSE_IOCTL_DIR){
+		return -ENOTTY;
+	}
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
+	// The ioctl numbers have the direction bits set, above INT_MAX
+	switch((unsigned int)cmd){
+		case RUFS_IOC_CLONE:
+			return clone_ioctl(path, (struct rufs_clone_args *)data);
 
-	// Step 3: Clear data block bitmap of target directory
+		case RUFS_IOC_DEFRAG:
+			return defrag_file(path, (struct rufs_defrag_args *)data);
+	}
 
-	// Step 4: Clear inode bitmap and its data block
+	return -ENOTTY;
+}
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+/*
+ * spliced writes
+ *
+ * Whole blocks of a block aligned write are copied by libfuse straight from
+ * the /dev/fuse pipe to their blocks in the DISKFILE. Writes that start
+ * mid-block, the partial block at the end, inline and compressed files, and
+ * setups that need the data in memory (dedup hashing, data checksums) take
+ * the rufs_write() path.
+ */
+/* Consecutive disk blocks a write lands in */
+struct blk_run {
+	int		start;					/* first block */
+	int		len;					/* number of blocks */
+};
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+ssize_t splice_blocks(struct fuse_bufvec *buf, int blkno, int count){
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)count * BLOCK_SIZE);
 
-	return 0;
-}
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = dev_fd();
+	dst.buf[0].pos = (off_t)blkno * BLOCK_SIZE;
 
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	return fuse_buf_copy(&dst, buf, 0);
 }
 
-char *get_dirname(const char *path){
-	char *pth_cpy = (char *)malloc(strlen(path) + 1);
-	memcpy(pth_cpy, path, strlen(path) + 1);
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size(buf);
 
-	char *dname = dirname(pth_cpy);
-	char *ret = (char *)malloc(strlen(dname) + 1);
-	memcpy(ret, dname, strlen(dname) + 1);
+	if(!path || offset < 0){
+		return -EINVAL;
+	}
 
-	printf("dirname: %s\n", ret);
-	free(pth_cpy);
-	return ret;
-}
+	if((offset + (off_t)size) > MAX_FSIZE){
+		return -EFBIG;
+	}
 
-char *get_basename(const char *path){
-	char *pth_cpy = (char *)malloc(strlen(path) + 1);
-	memcpy(pth_cpy, path, strlen(path) + 1);
+	struct inode node;
+	if(get_node_by_path(path, 0, &node) < 0){
+		return -ENOENT;
+	}
+
+	if(SNAP_OF(node.ino) >= 0){
+		return -EROFS;
+	}
+
+	size_t direct = 0;
+	if((offset % BLOCK_SIZE) == 0 && !(node.flags & (INODE_INLINE | INODE_COMPRESSED)) &&
+		!dedup_index && rufs_conf.csum != CSUM_DATA && !dev_direct()){
+		direct = size - (size % BLOCK_SIZE);
+	}
+
+	size_t done = 0;
+	int node_dirty = 0;
+	int blk_index = (offset / BLOCK_SIZE);
+	int nblocks = direct / BLOCK_SIZE;
+	int nruns = 0;
+	int failed = 0;
+
+	// Runs of consecutive disk blocks the direct part goes to, one per block at worst
+	struct blk_run *runs = NULL;
+	if(nblocks > 0){
+		runs = (struct blk_run *)malloc(nblocks * sizeof(struct blk_run));
+		if(!runs){
+			return -ENOMEM;
+		}
+
+		if(reserve_blocks(&node, blk_index, nblocks) < 0){
+			free(runs);
+			return -EIO;
+		}
+	}
 
-	char *bname = basename(pth_cpy);
-	char *ret = (char *)malloc(strlen(bname) + 1);
-	memcpy(ret, bname, strlen(bname) + 1);
+	// Map the blocks first
+	for(int i = 0; i < nblocks; i++){
+		int idx = blk_index + i;
 
-	printf("basename: %s\n", ret);
-	free(pth_cpy);
-	return ret;
-}
+		int blkno = get_file_blkno(&node, idx, 0, NULL);
+		int target = (blkno < 0) ? -1 : file_block_for_write(&node, idx, blkno);
+		if(target < 0){
+			// Pointer blocks may have been allocated before the failure
+			node_dirty = 1;
+			failed = 1;
+			break;
+		}
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	// Step 3: Call get_avail_ino() to get an available inode number
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	// Step 5: Update inode for target file
-	// Step 6: Call writei() to write inode to disk
-	char *parent = get_dirname(path);
-	char *file = get_basename(path);
-	// printf("parent: %s\n", parent);
-	// printf("filename: %s\n", file);
-	struct inode prnt_node;
-	int err;
+		if(target != blkno){
+			node_dirty = 1;
+		}
+		dedup_forget(target);
 
-	err = get_node_by_path(parent, 0, &prnt_node);
-	if(err < 0){
-		return -ENOENT;
+		if(nruns > 0 && target == (runs[nruns - 1].start + runs[nruns - 1].len)){
+			runs[nruns - 1].len++;
+		}else{
+			runs[nruns].start = target;
+			runs[nruns].len = 1;
+			nruns++;
+		}
 	}
+	release_reserve();
 
-	struct inode file_node;
-	int f_ino = get_avail_ino();
-	if(f_ino == -1){
-		free(parent);
-		free(file);
-		return -1;
+	if(node_dirty && writei(node.ino, &node) < 0){
+		free(runs);
+		return -EIO;
 	}
 
-	file_node.ino = f_ino;
-	file_node.valid = 1;
-	file_node.type = S_IFREG;
-	file_node.size = 0;
-	file_node.link = 1;
-	time(&(file_node.vstat.st_atime));
-	time(&(file_node.vstat.st_mtime));
+	// Splice each run without fs_lock, the range lock keeps overlapping requests out
+	if(nruns > 0){
+		// The flush puts the runs' cleared checksums on disk before their data
+		for(int r = 0; r < nruns; r++){
+			bio_unchecked(runs[r].start, runs[r].len);
+		}
 
-	for(int i = 0; i < 24; i++){
-		if(i < 16){
-			file_node.direct_ptr[i] = 0;
-		}else{
-			file_node.indirect_ptr[i - 16] = 0;
+		// Other requests plug and flush on their own meanwhile
+		if(dev_unplug() < 0){
+			dev_plug();
+			free(runs);
+			return -EIO;
+		}
+
+		pthread_rwlock_rdlock(&io_lock);
+		pthread_mutex_unlock(&fs_lock);
+
+		for(int r = 0; r < nruns; r++){
+			ssize_t n = splice_blocks(buf, runs[r].start, runs[r].len);
+			if(n > 0){
+				done += n;
+			}
+			if(n != (ssize_t)runs[r].len * BLOCK_SIZE){
+				failed = 1;
+				break;
+			}
 		}
+
+		pthread_rwlock_unlock(&io_lock);
+		pthread_mutex_lock(&fs_lock);
+		dev_plug();
 	}
+	free(runs);
 
-	if(dir_add(prnt_node, f_ino, file, strlen(file)) == -1){
-		// going to need to unset inode bitmap if fail
-		free(parent);
-		free(file);
-		return -1;
+	if(done < direct){
+		failed = 1;
 	}
 
-	writei(f_ino, &file_node);
-	free(parent);
-	free(file);
-	return 0;
-}
+	// Grow the file to cover the last byte written, from a fresh copy of the
+	// inode as other writes may have mapped blocks meanwhile
+	uint32_t end_blk = ((offset + done) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(done > 0 && readi(node.ino, &node) < 0){
+		return -EIO;
+	}
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
-	// Step 1: Call get_node_by_path() to get inode from path
-	// Step 2: If not find, return -1
-	struct inode node;
-	int err;
-	err = get_node_by_path(path, 0, &node);
+	node_dirty = 0;
+	if(done > 0 && node.size < end_blk){
+		node.size = end_blk;
+		node_dirty = 1;
+	}
 
-	if(err < 0){
-		return -ENOENT;
+	if(done > 0 && node.vstat.st_size < (offset + (off_t)done)){
+		node.vstat.st_size = (offset + done);
+		node_dirty = 1;
 	}
 
-	return 0;
-}
+	if(node_dirty && writei(node.ino, &node) < 0){
+		return -EIO;
+	}
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: copy the correct amount of data from offset to buffer
-	// Note: this function should return the amount of bytes you copied to buffer
-	if(!path || (size + offset) > MAX_FSIZE){
-		return -1;
+	if(failed){
+		return (done > 0) ? (int)done : -ENOSPC;
 	}
 
-	struct inode node;
-	int err;
-	err = get_node_by_path(path, 0, &node);
-	if(err < 0){
-		return -ENOENT;
+	if(done == size){
+		return done;
 	}
 
-	int f_size = (node.size * BLOCK_SIZE);
-	int blk_index = (offset / BLOCK_SIZE);
-	int blk_ofs = (offset % BLOCK_SIZE);
+	// Copy path for the rest, libfuse has advanced buf past the spliced blocks
+	size_t rest = size - done;
+	char *mem = malloc(rest);
+	if(!mem){
+		return (done > 0) ? (int)done : -ENOMEM;
+	}
 
-	if(f_size < (size + offset)){
-		return 0;
+	struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(rest);
+	tmp.buf[0].mem = mem;
+
+	ssize_t n = fuse_buf_copy(&tmp, buf, 0);
+	int ret = (n > 0) ? rufs_write(path, mem, n, offset + done, fi) : (int)n;
+	free(mem);
+
+	if(ret < 0){
+		return (done > 0) ? (int)done : ((ret == -1) ? -EIO : ret);
 	}
 
-	int bytes_read = 0;
-	int bytes_left = size;
-	int bytes_till_nxt = (BLOCK_SIZE - blk_ofs);
-	char *data = (char *)data_blk;
+	return done + ret;
+}
 
-	while(bytes_left > 0){
-		int blkno = node.direct_ptr[blk_index];
-		if(bio_read(blkno, data_blk) < 0){
-			return -1;
+//OPTIONAL
+/*
+ * fallocate
+ *
+ * Preallocation maps the holes of a range ahead of the writes, so the write
+ * path finds its blocks mapped and the file stays contiguous. The whole range
+ * is reserved in one run when one is free, otherwise in smaller runs placed
+ * one after the other like write reservations. New blocks are zeroed with bio_zero_data(), which
+ * punches them out of the DISKFILE instead of writing them, so they read back
+ * as zeros without any I/O on the device.
+ */
+int prealloc_range(struct inode *node, int blk_index, int count){
+	int run_start = 0;
+	int run_len = 0;
+	int ret = 0;
+
+	for(int i = blk_index; i < blk_index + count && ret == 0; ){
+		// The largest run that is free, halving down to PTRS blocks
+		int n = blk_index + count - i;
+		while(1){
+			if(reserve_blocks(node, i, n) < 0){
+				ret = -1;
+				break;
+			}
+			if(rsv_next < rsv_end || n <= (int)PTRS){
+				break;
+			}
+			n /= 2;
 		}
-
-		if(bytes_till_nxt >= bytes_left){
-			memcpy((buffer + bytes_read), (data + blk_ofs), bytes_left);
-			bytes_read += bytes_left;
+		if(ret < 0){
 			break;
 		}
 
-		if(bytes_left > bytes_till_nxt){
-			memcpy((buffer + bytes_read), (data + blk_ofs), bytes_till_nxt);
-			bytes_left -= bytes_till_nxt;
-			bytes_read += bytes_till_nxt;
-			blk_ofs = 0;
+		for(int j = i; j < i + n; j++){
+			int entry;
+			if(get_file_entry(node, j, &entry) < 0){
+				ret = -1;
+				break;
+			}
+
+			// Mapped blocks, shared or not, keep their data
+			if(entry > 0){
+				continue;
+			}
+
+			int blkno = (rsv_next < rsv_end) ? rsv_next++ : get_avail_blkno();
+			if(blkno == -1){
+				ret = -1;
+				break;
+			}
+
+			if(set_file_entry(node, j, blkno) < 0){
+				release_blkno(blkno);
+				ret = -1;
+				break;
+			}
+			dedup_forget(blkno);
+
+			// Zero the new blocks a run at a time
+			if(blkno != run_start + run_len){
+				if(run_len > 0 && bio_zero_data(run_start, run_len) < 0){
+					ret = -1;
+					break;
+				}
+				run_start = blkno;
+				run_len = 0;
+			}
+			run_len++;
+
+			if(node->size < (uint32_t)(j + 1)){
+				node->size = j + 1;
+			}
 		}
+		release_reserve();
+		i += n;
+	}
 
-		blk_index++;
-		bytes_till_nxt = (BLOCK_SIZE - blk_ofs);
+	if(run_len > 0 && bio_zero_data(run_start, run_len) < 0){
+		ret = -1;
 	}
 
-	return bytes_read;
+	return ret;
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: Write the correct amount of data from offset to disk
-	// Step 4: Update the inode info and write it to disk
-	// Note: this function should return the amount of bytes you write to disk
-	if(!path || (size + offset) > MAX_FSIZE){
-		return -1;
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	// Only plain allocation, hole punching and range zeroing are not supported
+	if(mode & ~FALLOC_FL_KEEP_SIZE){
+		return -EOPNOTSUPP;
+	}
+
+	if(offset < 0 || length <= 0){
+		return -EINVAL;
+	}
+
+	off_t end = offset + length;
+	if(end > MAX_FSIZE){
+		return -EFBIG;
 	}
 
 	struct inode node;
-	int err;
-	err = get_node_by_path(path, 0, &node);
-	if(err < 0){
+	if(get_node_by_path(path, 0, &node) < 0){
 		return -ENOENT;
 	}
 
-	int f_size = (node.size * BLOCK_SIZE);
-	int blk_index = (offset / BLOCK_SIZE);
-	int blk_ofs = (offset % BLOCK_SIZE);
+	if(SNAP_OF(node.ino) >= 0){
+		return -EROFS;
+	}
 
-	if(f_size < (size + offset)){
-		for(int i = 0; i < 16; i++){
-			if(node.direct_ptr[i] == 0){
-				int blkno = get_avail_blkno();
-				if(blkno == -1){
-					return -1;
-				}
+	if(node.type != S_IFREG){
+		return -EISDIR;
+	}
 
-				format_data_block(blkno);
-				node.direct_ptr[i] = blkno;
-				node.size++;
-				f_size = (node.size * BLOCK_SIZE);
-			}else{
-				continue;
-			}
+	// Clusters are allocated by compressed size, there is nothing to reserve
+	if(node.flags & INODE_COMPRESSED){
+		return -EOPNOTSUPP;
+	}
 
-			if(f_size > (size + offset)){
-				break;
+	int keep_size = (mode & FALLOC_FL_KEEP_SIZE);
+	if(node.flags & INODE_INLINE){
+		if(end <= INLINE_MAX){
+			if(keep_size || node.vstat.st_size >= end){
+				return 0;
 			}
+
+			memset(node.inline_data + node.vstat.st_size, '\0', end - node.vstat.st_size);
+			node.vstat.st_size = end;
+			return (writei(node.ino, &node) < 0) ? -EIO : 0;
 		}
 
-		writei(node.ino, &node);
 	}
 
-	int bytes_written = 0;
-	int bytes_left = size;
-	int bytes_till_nxt = (BLOCK_SIZE - blk_ofs);
-	char *data = (char *)data_blk;
+	int first = offset / BLOCK_SIZE;
+	int last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	while(bytes_left > 0){
-		int blkno = node.direct_ptr[blk_index];
-		if(bio_read(blkno, data_blk) < 0){
-			return -1;
-		}
+	// An inline file moves to block 0 once the range is mapped, so its data joins the run
+	struct inode inline_node = node;
+	if(node.flags & INODE_INLINE){
+		memset(node.inline_data, '\0', INLINE_MAX);
+		node.flags &= ~INODE_INLINE;
+		node.size = 0;
+		first = 0;
+	}
 
-		if(bytes_till_nxt >= bytes_left){
-			memcpy((data + blk_ofs), (buffer + bytes_written), bytes_left);
-			bytes_written += bytes_left;
-			break;
-		}
+	int ret = prealloc_range(&node, first, last - first);
 
-		if(bytes_left > bytes_till_nxt){
-			memcpy((data + blk_ofs), (buffer + bytes_written), bytes_till_nxt);
-			bytes_left -= bytes_till_nxt;
-			bytes_written += bytes_till_nxt;
-			blk_ofs = 0;
+	if(inline_node.flags & INODE_INLINE){
+		int blkno = 0;
+		get_file_entry(&node, 0, &blkno);
+		if(blkno <= 0){
+			// Nothing was mapped, the file stays inline
+			return -ENOSPC;
 		}
 
-		blk_index++;
-		bytes_till_nxt = (BLOCK_SIZE - blk_ofs);
-		if(bio_write(blkno, data) < 0){
-			return -1;
+		memset(data_blk, '\0', BLOCK_SIZE);
+		memcpy(data_blk, inline_node.inline_data, inline_node.vstat.st_size);
+		if(bio_write_data(blkno, data_blk) < 0){
+			ret = -1;
 		}
 	}
 
-	return bytes_written;
+	// KEEP_SIZE leaves the blocks past the end of the file for later writes
+	if(ret == 0 && !keep_size && node.vstat.st_size < end){
+		node.vstat.st_size = end;
+	}
+
+	// Blocks mapped before a failure stay with the file
+	if(writei(node.ino, &node) < 0){
+		return -EIO;
+	}
+
+	return (ret < 0) ? -ENOSPC : 0;
 }
 
-//OPTIONAL
 static int rufs_unlink(const char *path) {
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
@@ -1334,63 +4568,346 @@ static int rufs_unlink(const char *path) {
 	return 0;
 }
 
-static int rufs_truncate(const char *path, off_t size) {
+static int rufs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
     return 0;
 }
 
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	// Compress the cached cluster once the file is closed
+	if(ccache_writeback(NULL, NULL) < 0){
+		return -EIO;
+	}
+
+	// The replies read through the last handle are done, its held blocks can go
+	if(fi && open_refs[fi->fh] > 0 && --open_refs[fi->fh] == 0 && release_held(fi->fh) < 0){
+		return -EIO;
+	}
 	return 0;
 }
 
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	if(ccache_writeback(NULL, NULL) < 0){
+		return -EIO;
+	}
     return 0;
 }
 
-static int rufs_utimens(const char *path, const struct timespec tv[2]) {
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	drain_writes();
+	if(ccache_writeback(NULL, NULL) < 0 || dev_csum_flush() < 0){
+		return -EIO;
+	}
+
+	// Queued writes go out first, then the host has to put the DISKFILE on stable storage
+	if(dev_flush() < 0 || (datasync ? fdatasync(dev_fd()) : fsync(dev_fd())) < 0){
+		return -EIO;
+	}
+	return 0;
+}
+
+static int rufs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
     return 0;
 }
 
 
+/*
+ * Locked entry points: the data path takes the range lock of its request
+ * before fs_lock, every other handler runs whole under fs_lock. Block writes
+ * are plugged for the length of the request, so the queue merges them and
+ * writes each block once. They only reach the disk when the request is
+ * unplugged, so a failed flush turns a successful request into -EIO.
+ */
+#define LOCKED(ret, name, params, args) \
+	static ret name##_locked params { \
+		pthread_mutex_lock(&fs_lock); \
+		dev_plug(); \
+		ret r = name args; \
+		arena_reset(); \
+		if(dev_unplug() < 0 && r >= 0){ \
+			r = -EIO; \
+		} \
+		pthread_mutex_unlock(&fs_lock); \
+		return r; \
+	}
+
+LOCKED(int, rufs_getattr, (const char *path, struct stat *stbuf, struct fuse_file_info *fi), (path, stbuf, fi))
+LOCKED(int, rufs_readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+	enum fuse_readdir_flags flags), (path, buffer, filler, offset, fi, flags))
+LOCKED(int, rufs_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(int, rufs_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(int, rufs_mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(int, rufs_rmdir, (const char *path), (path))
+LOCKED(int, rufs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+LOCKED(int, rufs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(int, rufs_unlink, (const char *path), (path))
+LOCKED(int, rufs_truncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+LOCKED(int, rufs_flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(int, rufs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+LOCKED(int, rufs_utimens, (const char *path, const struct timespec tv[2], struct fuse_file_info *fi), (path, tv, fi))
+LOCKED(int, rufs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(ssize_t, rufs_copy_file_range, (const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+	struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags), (path_in, fi_in, offset_in, path_out, fi_out, offset_out, size, flags))
+
+static int rufs_read_locked(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct range_lock rl;
+	int locked = (lock_file_range(path, offset, size, 1, &rl) == 0);
+
+	dev_plug();
+	int ret = rufs_read(path, buffer, size, offset, fi);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if(locked){
+		range_unlock(&rl);
+	}
+	return ret;
+}
+
+static int rufs_read_buf_locked(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct range_lock rl;
+	int locked = (lock_file_range(path, offset, size, 1, &rl) == 0);
+
+	dev_plug();
+	int ret = rufs_read_buf(path, bufp, size, offset, fi);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if(locked){
+		range_unlock(&rl);
+	}
+	return ret;
+}
+
+static int rufs_write_locked(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct range_lock rl;
+	int locked = (lock_file_range(path, offset, size, 0, &rl) == 0);
+
+	dev_plug();
+	int ret = rufs_write(path, buffer, size, offset, fi);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if(locked){
+		range_unlock(&rl);
+	}
+	return ret;
+}
+
+static int rufs_write_buf_locked(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	struct range_lock rl;
+	int locked = (lock_file_range(path, offset, fuse_buf_size(buf), 0, &rl) == 0);
+
+	// Returns with fs_lock held and plugged, though it drops both while splicing
+	dev_plug();
+	int ret = rufs_write_buf(path, buf, offset, fi);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if(locked){
+		range_unlock(&rl);
+	}
+	return ret;
+}
+
+static int rufs_fallocate_locked(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	struct range_lock rl;
+	int locked = (lock_file_range(path, offset, (length > 0) ? length : 0, 0, &rl) == 0);
+
+	dev_plug();
+	int ret = rufs_fallocate(path, mode, offset, length, fi);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if(locked){
+		range_unlock(&rl);
+	}
+	return ret;
+}
+
+static int rufs_ioctl_locked(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	pthread_mutex_lock(&fs_lock);
+	dev_plug();
+	int ret = rufs_ioctl(path, cmd, arg, fi, flags, data);
+
+	arena_reset();
+	if(dev_unplug() < 0 && ret >= 0){
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	// No kernel request tells the kernel that the destination of a clone changed
+	if((unsigned int)cmd == RUFS_IOC_CLONE){
+		kernel_invalidate(path);
+	}
+	return ret;
+}
+
 static struct fuse_operations rufs_ope = {
 	.init		= rufs_init,
 	.destroy	= rufs_destroy,
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
-
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
-
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.getattr	= rufs_getattr_locked,
+	.readdir	= rufs_readdir_locked,
+	.opendir	= rufs_opendir_locked,
+	.releasedir	= rufs_releasedir_locked,
+	.mkdir		= rufs_mkdir_locked,
+	.rmdir		= rufs_rmdir_locked,
+
+	.create		= rufs_create_locked,
+	.open		= rufs_open_locked,
+	.read 		= rufs_read_locked,
+	.read_buf	= rufs_read_buf_locked,
+	.write		= rufs_write_locked,
+	.write_buf	= rufs_write_buf_locked,
+	.unlink		= rufs_unlink_locked,
+
+	.truncate   = rufs_truncate_locked,
+	.fallocate	= rufs_fallocate_locked,
+	.flush      = rufs_flush_locked,
+	.fsync      = rufs_fsync_locked,
+	.utimens    = rufs_utimens_locked,
+	.release	= rufs_release_locked,
+
+	.copy_file_range	= rufs_copy_file_range_locked,
+	.ioctl		= rufs_ioctl_locked
+};
+
+const struct fuse_operations *rufs_operations(){
+	return &rufs_ope;
+}
+
+#ifndef RUFS_LIB
+
+enum {
+	KEY_INODE_FORMAT,
+	KEY_CSUM,
+	KEY_FILE_CACHE,
+	KEY_SNAP_CACHE
+};
+
+#define RUFS_OPT(t, p, v) { t, offsetof(struct rufs_config, p), v }
+
+static struct fuse_opt rufs_opts[] = {
+	FUSE_OPT_KEY("inode_format=", KEY_INODE_FORMAT),
+	FUSE_OPT_KEY("csum=", KEY_CSUM),
+	FUSE_OPT_KEY("file_cache=", KEY_FILE_CACHE),
+	FUSE_OPT_KEY("snap_cache=", KEY_SNAP_CACHE),
+	RUFS_OPT("compress", compress, 1),
+	RUFS_OPT("dedup", dedup, 1),
+	RUFS_OPT("writeback_cache", writeback, 1),
+	RUFS_OPT("no_writeback_cache", writeback, 0),
+	RUFS_OPT("disk_direct", disk_direct, 1),
+	RUFS_OPT("block_size=%d", block_size, 0),
+	RUFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	RUFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	RUFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+	FUSE_OPT_END
 };
 
+static int parse_cache_mode(const char *arg, int *mode){
+	if(strcmp(arg, "none") == 0){
+		*mode = CACHE_NONE;
+	}else if(strcmp(arg, "auto") == 0){
+		*mode = CACHE_AUTO;
+	}else if(strcmp(arg, "keep") == 0){
+		*mode = CACHE_KEEP;
+	}else{
+		fprintf(stderr, "rufs: file_cache and snap_cache must be none, auto or keep\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rufs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs){
+	struct rufs_config *conf = (struct rufs_config *)data;
+
+	switch(key){
+		case KEY_INODE_FORMAT:
+			arg += strlen("inode_format=");
+			if(strcmp(arg, "compact") == 0){
+				conf->inode_fmt = INODE_FMT_COMPACT;
+			}else if(strcmp(arg, "legacy") == 0){
+				conf->inode_fmt = INODE_FMT_LEGACY;
+			}else{
+				fprintf(stderr, "rufs: inode_format must be compact or legacy\n");
+				return -1;
+			}
+			return 0;
+
+		case KEY_CSUM:
+			arg += strlen("csum=");
+			if(strcmp(arg, "off") == 0){
+				conf->csum = CSUM_OFF;
+			}else if(strcmp(arg, "meta") == 0){
+				conf->csum = CSUM_META;
+			}else if(strcmp(arg, "data") == 0){
+				conf->csum = CSUM_DATA;
+			}else{
+				fprintf(stderr, "rufs: csum must be off, meta or data\n");
+				return -1;
+			}
+			return 0;
+
+		case KEY_FILE_CACHE:
+			return parse_cache_mode(arg + strlen("file_cache="), &conf->file_cache);
+
+		case KEY_SNAP_CACHE:
+			return parse_cache_mode(arg + strlen("snap_cache="), &conf->snap_cache);
+	}
+
+	// Everything else is passed on to FUSE
+	return 1;
+}
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	// RUFS options:
+	//   -o inode_format=compact|legacy		inode format of a new DISKFILE
+	//   -o compress						compress files created from now on
+	//   -o entry_timeout=T, attr_timeout=T, negative_timeout=T
+	//										seconds the kernel caches names, attributes and failed lookups
+	//   -o file_cache=none|auto|keep		kernel page cache use of files, snap_cache= of snapshot files
+	//   -o no_writeback_cache				send every write to the daemon as it happens
+	//   -o disk_direct						open the DISKFILE with O_DIRECT, bypassing the host page cache
+	//   -o block_size=N					bytes per block of a new DISKFILE, a power of two from 4096 to 65536
+	if(fuse_opt_parse(&args, &rufs_conf, rufs_opts, rufs_opt_proc) < 0){
+		return 1;
+	}
+
+	if(rufs_conf.block_size && !block_size_ok(rufs_conf.block_size)){
+		fprintf(stderr, "rufs: this build cannot make images with %d byte blocks\n", rufs_conf.block_size);
+		return 1;
+	}
+
+	fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
 
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
 
+#endif
@@ -8,7 +8,10 @@
 
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
 
 #ifndef _TFS_H
 #define _TFS_H
@@ -18,6 +21,10 @@
 #define MAX_DNUM 16384
 
 
+/* on-disk inode formats, selected at mkfs */
+#define INODE_FMT_LEGACY 0			/* struct inode, embeds a struct stat */
+#define INODE_FMT_COMPACT 1			/* struct dinode, 128 bytes */
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
 	uint16_t	max_inum;			/* maximum inode number */
@@ -26,19 +33,144 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint16_t	inode_fmt;			/* INODE_FMT_* of the inode region */
+	uint16_t	inode_size;			/* bytes per on-disk inode, 0 for legacy images */
+	uint32_t	rc_start_blk;		/* start block of block reference count region */
+	uint32_t	rc_blocks;			/* blocks in the reference count region, 0 if absent */
+	uint32_t	cs_start_blk;		/* start block of block checksum region */
+	uint16_t	cs_blocks;			/* blocks in the checksum region, 0 if absent */
+	uint16_t	cs_state;			/* CSUM_CLEAN while the table matches the blocks */
+	uint32_t	sn_start_blk;		/* start block of snapshot region */
+	uint32_t	sn_blocks;			/* blocks in the snapshot region, 0 if absent */
+	uint32_t	fs_state;			/* FS_CLEAN while the image is not mounted */
+	uint32_t	block_size;			/* bytes per block, 0 for images from before it was recorded (4 KB) */
 };
 
+/* superblock cs_state flags */
+#define CSUM_CLEAN 0x0001
+
+/* superblock fs_state flags */
+#define FS_CLEAN 0x0001				/* unmounted cleanly, rufs-fsck can skip the image */
+
+/* inode flags */
+#define INODE_INLINE 0x0001			/* file data is stored in inline_data */
+#define INODE_COMPRESSED 0x0002		/* file data is stored in compressed clusters */
+
+/* Number of direct pointers in an inode */
+#define DIRECT_PTRS 16
+
+/* Number of single indirect pointers of a regular file, indirect_ptr[FILE_DIND_SLOT] is double indirect */
+#define FILE_IND_PTRS 7
+
+/* Slot of the double indirect pointer of a regular file */
+#define FILE_DIND_SLOT 7
+
+/* Number of single indirect pointers of a directory, all of them are single indirect */
+#define DIR_IND_PTRS 8
+
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
 	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	type;				/* type of the file */
+	uint16_t	flags;				/* INODE_* flags */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		char	inline_data[24 * sizeof(int)];	/* data of an INODE_INLINE file */
+	};
 	struct stat	vstat;				/* inode stat */
 };
 
+/*
+ * Compact on-disk inode (INODE_FMT_COMPACT). Only the fields RUFS uses, at
+ * fixed widths, so 32 of them fit in a 4 KB block instead of 16.
+ */
+struct dinode {
+	uint16_t	ino;				/* inode number */
+	uint16_t	valid;				/* validity of the inode */
+	uint16_t	type;				/* type of the file */
+	uint16_t	flags;				/* INODE_* flags */
+	uint32_t	link;				/* link count */
+	uint32_t	size;				/* size of the file in blocks */
+	uint64_t	bytes;				/* size of a regular file in bytes */
+	uint32_t	atime;				/* last access time */
+	uint32_t	mtime;				/* last modification time */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		char	inline_data[24 * sizeof(int)];	/* data of an INODE_INLINE file */
+	};
+};
+
+/* Blocks per compression cluster of an INODE_COMPRESSED file */
+#define CLUSTER_BLOCKS 8
+
+/* Header in front of the compressed data of a file cluster */
+#define CLUSTER_MAGIC 0x4C5A
+
+struct cluster_hdr {
+	uint32_t	magic;				/* CLUSTER_MAGIC */
+	uint32_t	clen;				/* compressed bytes following the header */
+};
+
+#define MAX_SNAPSHOTS 16
+#define SNAP_NAME_LEN 64
+
+/* Largest inode region that snapshots can map, MAX_INUM legacy inodes */
+#define MAX_INODE_BLOCKS 64
+
+/*
+ * Read-only point in time copy of the file system. Blocks the snapshot
+ * shares with the live file system are never written in place.
+ */
+struct snapshot {
+	uint32_t	valid;				/* record in use */
+	uint32_t	ctime;				/* creation time */
+	char		name[SNAP_NAME_LEN];
+	uint32_t	imap[MAX_INODE_BLOCKS];		/* inode region blocks at creation */
+	uint8_t		dbmap[MAX_DNUM / 8];	/* blocks the snapshot holds */
+};
+
+/*
+ * RUFS_IOC_CLONE, issued on an open destination file: makes length bytes at
+ * dest_offset share the data of src_path at src_offset. src_path is relative
+ * to the mount point and a length of 0 clones up to the end of the source.
+ */
+#define CLONE_PATH_LEN 256
+
+struct rufs_clone_args {
+	uint64_t	src_offset;			/* first byte of the source to clone */
+	uint64_t	dest_offset;		/* where the range lands in the destination */
+	uint64_t	length;				/* bytes to clone, 0 for the rest of the source */
+	char		src_path[CLONE_PATH_LEN];	/* source file, e.g. /dir/file */
+};
+
+#define RUFS_IOC_CLONE _IOW('R', 1, struct rufs_clone_args)
+
+/*
+ * RUFS_IOC_DEFRAG, issued on an open regular file: moves its data blocks into
+ * one run of consecutive blocks, in file order. The score is 0 for a file
+ * whose blocks are all adjacent and 100 when no two of them are.
+ */
+#define RUFS_DEFRAG_QUERY 0x0001		/* only report, move nothing */
+
+struct rufs_defrag_args {
+	uint32_t	flags;				/* RUFS_DEFRAG_* */
+	uint32_t	blocks;				/* data blocks of the file, holes aside */
+	uint32_t	extents_before;		/* runs of consecutive blocks before the pass */
+	uint32_t	extents_after;		/* runs of consecutive blocks after the pass */
+	uint32_t	score_before;		/* fragmentation score before the pass */
+	uint32_t	score_after;		/* fragmentation score after the pass */
+};
+
+#define RUFS_IOC_DEFRAG _IOWR('R', 2, struct rufs_defrag_args)
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -52,16 +184,82 @@ struct dirent {
  */
 typedef unsigned char *bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * compact inode conversion
+ */
+static inline void inode_to_dinode(const struct inode *inode, struct dinode *dinode) {
+	dinode->ino = inode->ino;
+	dinode->valid = inode->valid;
+	dinode->type = inode->type;
+	dinode->flags = inode->flags;
+	dinode->link = inode->link;
+	dinode->size = inode->size;
+	dinode->bytes = inode->vstat.st_size;
+	dinode->atime = inode->vstat.st_atime;
+	dinode->mtime = inode->vstat.st_mtime;
+	memcpy(dinode->inline_data, inode->inline_data, sizeof(dinode->inline_data));
+}
+
+static inline void dinode_to_inode(const struct dinode *dinode, struct inode *inode) {
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = dinode->ino;
+	inode->valid = dinode->valid;
+	inode->type = dinode->type;
+	inode->flags = dinode->flags;
+	inode->link = dinode->link;
+	inode->size = dinode->size;
+	inode->vstat.st_size = dinode->bytes;
+	inode->vstat.st_atime = dinode->atime;
+	inode->vstat.st_mtime = dinode->mtime;
+	memcpy(inode->inline_data, dinode->inline_data, sizeof(inode->inline_data));
+}
+
+/*
+ * mount and mkfs options
+ */
+/* How the kernel page cache holds the data of a class of files */
+#define CACHE_NONE 0				/* direct_io, every read and write reaches the daemon */
+#define CACHE_AUTO 1				/* pages kept across opens while mtime and size are unchanged */
+#define CACHE_KEEP 2				/* pages kept across opens, the daemon invalidates them */
+
+struct rufs_config {
+	int		inode_fmt;			/* INODE_FMT_* used by mkfs for new images */
+	int		block_size;			/* bytes per block of new images, 0 for the build default */
+	int		compress;			/* create new files as INODE_COMPRESSED */
+	int		dedup;				/* share identical file data blocks */
+	int		csum;				/* CSUM_* blocks verified on read */
+	double	entry_timeout;		/* seconds the kernel caches names */
+	double	attr_timeout;		/* seconds the kernel caches attributes */
+	double	negative_timeout;	/* seconds the kernel caches failed lookups */
+	int		file_cache;			/* CACHE_* of live files */
+	int		snap_cache;			/* CACHE_* of files under /.snapshots */
+	int		writeback;			/* let the kernel cache writes and flush them later */
+	int		disk_direct;		/* open the DISKFILE with O_DIRECT */
+};
+
+extern struct rufs_config rufs_conf;
+
+/*
+ * library interface (librufs.a, built with -DRUFS_LIB)
+ */
+struct fuse_operations;
+
+/* Path of the DISKFILE opened by rufs_init() */
+extern char diskfile_path[PATH_MAX];
+
+/* The rufs_ope handler table, for callers driving RUFS without a mount */
+const struct fuse_operations *rufs_operations();
+
 #endif
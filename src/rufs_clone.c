@@ -0,0 +1,103 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_clone.c
+ *
+ *	Reflinks a file inside a RUFS mount: the destination shares the data
+ *	blocks of the source until either file is written.
+ *
+ *	Usage:
+ *	  ./rufs_clone <src> <dst>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "rufs.h"
+
+/*
+ * Finds the root of the mount holding path (the topmost directory on the same
+ * device) and stores path relative to it in rel
+ */
+static int mount_relative(const char *path, char *rel, size_t len){
+	char real[PATH_MAX], root[PATH_MAX], parent[PATH_MAX];
+	struct stat st, pst;
+
+	if(!realpath(path, real) || stat(real, &st) < 0){
+		return -1;
+	}
+
+	strcpy(root, real);
+	while(strcmp(root, "/") != 0){
+		strcpy(parent, root);
+		if(stat(dirname(parent), &pst) < 0){
+			return -1;
+		}
+		if(pst.st_dev != st.st_dev){
+			break;
+		}
+		strcpy(root, parent);
+	}
+
+	const char *p = real + ((strcmp(root, "/") == 0) ? 0 : strlen(root));
+	if(snprintf(rel, len, "%s", (*p == '\0') ? "/" : p) >= len){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct rufs_clone_args args;
+
+	if(argc != 3){
+		fprintf(stderr, "usage: %s <src> <dst>\n", argv[0]);
+		return 1;
+	}
+
+	memset(&args, 0, sizeof(args));
+	if(mount_relative(argv[1], args.src_path, sizeof(args.src_path)) < 0){
+		perror(argv[1]);
+		return 1;
+	}
+
+	int fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+	if(fd < 0){
+		perror(argv[2]);
+		return 1;
+	}
+
+	struct stat sst, dst;
+	if(stat(argv[1], &sst) < 0 || fstat(fd, &dst) < 0 || sst.st_dev != dst.st_dev){
+		fprintf(stderr, "%s: source and destination must be on the same RUFS mount\n", argv[0]);
+		close(fd);
+		return 1;
+	}
+
+	// The daemon clones what is on disk, write back what the kernel still caches
+	int src_fd = open(argv[1], O_RDONLY);
+	if(src_fd < 0 || fsync(src_fd) < 0 || fsync(fd) < 0){
+		perror("fsync");
+		if(src_fd >= 0){
+			close(src_fd);
+		}
+		close(fd);
+		return 1;
+	}
+	close(src_fd);
+
+	if(ioctl(fd, RUFS_IOC_CLONE, &args) < 0){
+		perror("RUFS_IOC_CLONE");
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_defrag.c
+ *
+ *	Defragments files inside a RUFS mount: each file's data blocks are moved
+ *	into one run of consecutive blocks. Prints the number of extents and the
+ *	fragmentation score (0 contiguous, 100 no two blocks adjacent) of every
+ *	file before and after.
+ *
+ *	Usage:
+ *	  ./rufs_defrag [-n] <file>...
+ *
+ *	  -n: only report, move nothing
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "rufs.h"
+
+int main(int argc, char **argv) {
+	struct rufs_defrag_args args;
+	int query = 0;
+	int failed = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n")) != -1){
+		switch(opt){
+			case 'n': query = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-n] <file>...\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind == argc){
+		fprintf(stderr, "usage: %s [-n] <file>...\n", argv[0]);
+		return 1;
+	}
+
+	for(int i = optind; i < argc; i++){
+		int fd = open(argv[i], O_RDONLY);
+		if(fd < 0){
+			perror(argv[i]);
+			failed = 1;
+			continue;
+		}
+
+		memset(&args, 0, sizeof(args));
+		args.flags = query ? RUFS_DEFRAG_QUERY : 0;
+		if(ioctl(fd, RUFS_IOC_DEFRAG, &args) < 0){
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			failed = 1;
+		}else if(query){
+			printf("%s: %u blocks, %u extents, score %u\n", argv[i], args.blocks, args.extents_before, args.score_before);
+		}else{
+			printf("%s: %u blocks, %u -> %u extents, score %u -> %u\n", argv[i], args.blocks,
+				args.extents_before, args.extents_after, args.score_before, args.score_after);
+		}
+
+		close(fd);
+	}
+
+	return failed;
+}
@@ -0,0 +1,805 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_fsck.c
+ *
+ *	Offline consistency checker for a RUFS DISKFILE. Cross-checks the inode
+ *	and data bitmaps against what the directory tree reaches, block pointers,
+ *	block reference counts, directory entries and link counts, and verifies
+ *	block checksums. Repairs are optional.
+ *
+ *	The image is mapped read-only and populated with one sequential read, the
+ *	inode table and the block maps are then scanned by several threads. All
+ *	repairs are collected during the scan and written afterwards.
+ *
+ *	Usage:
+ *	  ./rufs-fsck [-n | -y | -p] [-f] [-j threads] <diskfile>
+ *
+ *	  -n: check only, nothing is written (default)
+ *	  -y: repair everything that can be repaired
+ *	  -p: like -y, for restart scripts
+ *	  -f: check images that were unmounted cleanly as well, they are
+ *	      skipped otherwise
+ *
+ *	Exit status: 0 clean, 1 errors repaired, 4 errors left, 8 check failed
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "crc32c.h"
+#include "rufs.h"
+
+#define FSCK_OK			0
+#define FSCK_FIXED		1
+#define FSCK_UNFIXED	4
+#define FSCK_ERROR		8
+
+#define PTRS (BLOCK_SIZE / sizeof(int))
+#define DIRENTS (BLOCK_SIZE / sizeof(struct dirent))
+
+/* Problems printed per kind before they are only counted */
+#define REPORT_LIMIT 20
+
+/* Inodes or blocks a thread takes from the shared counter at a time */
+#define WORK_CHUNK 32
+
+/* An entry of a directory, with where it sits in the image */
+struct entry {
+	uint16_t	ino;				/* inode the entry names */
+	uint16_t	len;				/* length of name */
+	const char	*name;				/* name inside the mapped image */
+	off_t		pos;				/* image offset of the struct dirent */
+};
+
+struct ino_state {
+	struct inode	node;			/* decoded inode */
+	uint8_t		used;				/* set in the inode bitmap */
+	uint8_t		ok;					/* valid record of a known type */
+	uint8_t		reached;			/* named by the tree under the root */
+	uint32_t	names;				/* entries naming it, . and .. aside */
+	struct entry	*ents;			/* entries of a directory */
+	int			nents;
+	int			cap;
+};
+
+/* A repair: len bytes of val written at image offset pos */
+struct fix {
+	off_t		pos;
+	int			len;
+	uint32_t	val;
+};
+
+#ifndef RUFS_BLOCK_SIZE
+/* rufs-fsck does not link block.o */
+int block_size = BLOCK_SIZE_MIN;
+#endif
+
+static const char *img;				/* the mapped image */
+static int img_fd = -1;
+static uint32_t img_blocks;
+static struct superblock sb;
+static int isize;					/* bytes per on-disk inode */
+static int ipb;						/* inodes per inode block */
+static int inode_blocks;
+static int imap[MAX_INODE_BLOCKS];	/* inode region blocks of the live file system */
+
+static uint8_t ibmap[BLOCK_SIZE_MAX];
+static uint8_t dbmap[BLOCK_SIZE_MAX];
+static struct ino_state *inos;
+static uint32_t *refs;				/* live references per block */
+
+static int repair = 0;
+static int nthreads = 1;
+static int errors = 0;
+static int unfixed = 0;
+
+static struct fix *fixes = NULL;
+static int nfixes = 0;
+static int fixes_cap = 0;
+static pthread_mutex_t fix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Counts a problem, fixable ones are repaired at the end with -y
+ */
+static void tally(int fixable) {
+	__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	if (!fixable || !repair) {
+		__atomic_add_fetch(&unfixed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void problem(int fixable, const char *fmt, ...) {
+	va_list ap;
+
+	tally(fixable);
+
+	char msg[512];
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	printf("rufs-fsck: %s%s\n", msg, (fixable && repair) ? ", fixed" : "");
+}
+
+static void add_fix(off_t pos, int len, uint32_t val) {
+	if (!repair) {
+		return;
+	}
+
+	pthread_mutex_lock(&fix_lock);
+	if (nfixes == fixes_cap) {
+		fixes_cap = fixes_cap ? (fixes_cap * 2) : 64;
+		fixes = realloc(fixes, fixes_cap * sizeof(struct fix));
+		if (!fixes) {
+			perror("realloc");
+			exit(FSCK_ERROR);
+		}
+	}
+	fixes[nfixes++] = (struct fix){ pos, len, val };
+	pthread_mutex_unlock(&fix_lock);
+}
+
+/*
+ * Contents of block blkno. Blocks past the end of the image read as zeros,
+ * like the DISKFILE does: preallocated blocks may never have been written.
+ */
+static const void *block_at(int blkno) {
+	static const char zero_blk[BLOCK_SIZE_MAX];
+
+	if (blkno >= (int)img_blocks) {
+		return zero_blk;
+	}
+	return img + ((off_t)blkno * BLOCK_SIZE);
+}
+
+/* Whether blkno can hold file data or pointers */
+static int data_block_ok(int blkno) {
+	return blkno >= (int)sb.d_start_blk && blkno < sb.max_dnum;
+}
+
+static void ref(int blkno) {
+	__atomic_add_fetch(&refs[blkno], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Image offset of a field of inode ino, given its offset in both formats
+ */
+static off_t inode_field(int ino, size_t legacy_ofs, size_t compact_ofs) {
+	off_t pos = ((off_t)imap[ino / ipb] * BLOCK_SIZE) + ((ino % ipb) * isize);
+	return pos + ((sb.inode_fmt == INODE_FMT_COMPACT) ? compact_ofs : legacy_ofs);
+}
+
+static off_t inode_ptr_field(int ino, int direct, int i) {
+	if (direct) {
+		return inode_field(ino, offsetof(struct inode, direct_ptr) + (i * sizeof(int)),
+			offsetof(struct dinode, direct_ptr) + (i * sizeof(int)));
+	}
+	return inode_field(ino, offsetof(struct inode, indirect_ptr) + (i * sizeof(int)),
+		offsetof(struct dinode, indirect_ptr) + (i * sizeof(int)));
+}
+
+static void read_inode(int ino, struct inode *node) {
+	const char *disk_inode = img + inode_field(ino, 0, 0);
+
+	if (sb.inode_fmt == INODE_FMT_COMPACT) {
+		dinode_to_inode((const struct dinode *)disk_inode, node);
+	} else {
+		memcpy(node, disk_inode, sizeof(struct inode));
+	}
+}
+
+/*
+ * Runs fn(0) .. fn(n - 1) on nthreads threads
+ */
+struct work {
+	int		n;
+	int		next;
+	void	(*fn)(int);
+};
+
+static void *worker(void *arg) {
+	struct work *w = (struct work *)arg;
+
+	for (;;) {
+		int start = __atomic_fetch_add(&w->next, WORK_CHUNK, __ATOMIC_RELAXED);
+		if (start >= w->n) {
+			return NULL;
+		}
+
+		int end = (start + WORK_CHUNK < w->n) ? (start + WORK_CHUNK) : w->n;
+		for (int i = start; i < end; i++) {
+			w->fn(i);
+		}
+	}
+}
+
+static void parallel_for(int n, void (*fn)(int)) {
+	struct work w = { n, 0, fn };
+	pthread_t tids[nthreads];
+
+	for (int t = 1; t < nthreads; t++) {
+		if (pthread_create(&tids[t], NULL, worker, &w) != 0) {
+			perror("pthread_create");
+			exit(FSCK_ERROR);
+		}
+	}
+
+	worker(&w);
+	for (int t = 1; t < nthreads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+}
+
+/*
+ * Pass 1: inode records and directory entries
+ */
+static void add_entry(struct ino_state *st, const struct dirent *d, off_t pos) {
+	if (st->nents == st->cap) {
+		st->cap = st->cap ? (st->cap * 2) : 16;
+		st->ents = realloc(st->ents, st->cap * sizeof(struct entry));
+		if (!st->ents) {
+			perror("realloc");
+			exit(FSCK_ERROR);
+		}
+	}
+	st->ents[st->nents++] = (struct entry){ d->ino, d->len, d->name, pos };
+}
+
+static void read_dir_block(int ino, int blkno) {
+	const struct dirent *ents = (const struct dirent *)block_at(blkno);
+
+	for (int i = 0; i < DIRENTS; i++) {
+		if (ents[i].valid) {
+			add_entry(&inos[ino], &ents[i], ((off_t)blkno * BLOCK_SIZE) + (i * sizeof(struct dirent)));
+		}
+	}
+}
+
+static void scan_inode(int ino) {
+	struct ino_state *st = &inos[ino];
+	struct inode *node = &st->node;
+
+	st->used = get_bitmap(ibmap, ino);
+	read_inode(ino, node);
+	if (!node->valid) {
+		return;
+	}
+
+	if (node->ino != ino || (node->type != S_IFDIR && node->type != S_IFREG)) {
+		problem(1, "inode %d has a bad header (ino %d, type %o)", ino, node->ino, node->type);
+		add_fix(inode_field(ino, offsetof(struct inode, valid), offsetof(struct dinode, valid)), 2, 0);
+		return;
+	}
+	st->ok = 1;
+
+	if (node->type != S_IFDIR) {
+		return;
+	}
+
+	// Bad pointers are reported by pass 3, here they are only skipped
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (data_block_ok(node->direct_ptr[i])) {
+			read_dir_block(ino, node->direct_ptr[i]);
+		}
+	}
+
+	for (int k = 0; k < DIR_IND_PTRS; k++) {
+		if (!data_block_ok(node->indirect_ptr[k])) {
+			continue;
+		}
+
+		const int *ptrs = (const int *)block_at(node->indirect_ptr[k]);
+		for (int i = 0; i < PTRS; i++) {
+			if (data_block_ok(ptrs[i])) {
+				read_dir_block(ino, ptrs[i]);
+			}
+		}
+	}
+}
+
+/*
+ * Pass 2: the directory tree, walked from the root
+ */
+static int cmp_entry(const void *a, const void *b) {
+	const struct entry *x = *(const struct entry **)a;
+	const struct entry *y = *(const struct entry **)b;
+
+	if (x->len != y->len) {
+		return (x->len < y->len) ? -1 : 1;
+	}
+	return memcmp(x->name, y->name, x->len);
+}
+
+static void drop_entry(int dir, const struct entry *e, const char *why) {
+	problem(1, "directory %d: entry \"%.*s\" -> %d %s", dir, (int)e->len, e->name, e->ino, why);
+	add_fix(e->pos + offsetof(struct dirent, valid), 2, 0);
+}
+
+static void check_dir(int dir, int parent, int *queue, int *tail) {
+	struct ino_state *st = &inos[dir];
+	struct entry **named = malloc((st->nents + 1) * sizeof(struct entry *));
+	int nnamed = 0;
+	int has_dot = 0;
+
+	if (!named) {
+		perror("malloc");
+		exit(FSCK_ERROR);
+	}
+
+	for (int i = 0; i < st->nents; i++) {
+		struct entry *e = &st->ents[i];
+
+		if (e->len == 0 || e->len >= sizeof(((struct dirent *)0)->name) || strnlen(e->name, e->len + 1) != e->len) {
+			drop_entry(dir, e, "has a bad name");
+			continue;
+		}
+
+		if (e->len == 1 && e->name[0] == '.') {
+			if (e->ino != dir) {
+				problem(1, "directory %d: . points to %d", dir, e->ino);
+				add_fix(e->pos + offsetof(struct dirent, ino), 2, dir);
+			}
+			has_dot = 1;
+			continue;
+		}
+
+		if (e->len == 2 && e->name[0] == '.' && e->name[1] == '.') {
+			if (e->ino != parent) {
+				problem(1, "directory %d: .. points to %d instead of %d", dir, e->ino, parent);
+				add_fix(e->pos + offsetof(struct dirent, ino), 2, parent);
+			}
+			continue;
+		}
+
+		named[nnamed++] = e;
+	}
+
+	if (!has_dot) {
+		problem(0, "directory %d has no . entry", dir);
+	}
+
+	// Duplicate names: the first entry wins
+	qsort(named, nnamed, sizeof(struct entry *), cmp_entry);
+	for (int i = 0; i < nnamed; i++) {
+		struct entry *e = named[i];
+
+		if (i > 0 && cmp_entry(&named[i - 1], &named[i]) == 0) {
+			drop_entry(dir, e, "duplicates an earlier name");
+			named[i] = named[i - 1];
+			continue;
+		}
+
+		if (e->ino >= sb.max_inum || !inos[e->ino].ok) {
+			drop_entry(dir, e, "names a free inode");
+			continue;
+		}
+
+		struct ino_state *child = &inos[e->ino];
+		if (child->node.type == S_IFDIR) {
+			if (child->reached || e->ino == 0) {
+				drop_entry(dir, e, "is a second link to a directory");
+				continue;
+			}
+			queue[(*tail)++] = e->ino;
+			queue[(*tail)++] = dir;
+		}
+
+		child->reached = 1;
+		child->names++;
+	}
+
+	free(named);
+}
+
+static void check_tree() {
+	int *queue = malloc(2 * sb.max_inum * sizeof(int));
+	int head = 0, tail = 0;
+
+	if (!queue) {
+		perror("malloc");
+		exit(FSCK_ERROR);
+	}
+
+	if (!inos[0].ok || inos[0].node.type != S_IFDIR) {
+		problem(0, "root inode is missing or not a directory");
+		free(queue);
+		return;
+	}
+
+	// The root has no .. entry of its own
+	inos[0].reached = 1;
+	check_dir(0, 0, queue, &tail);
+
+	while (head < tail) {
+		int dir = queue[head++];
+		int parent = queue[head++];
+		check_dir(dir, parent, queue, &tail);
+	}
+	free(queue);
+
+	for (int ino = 0; ino < sb.max_inum; ino++) {
+		struct ino_state *st = &inos[ino];
+
+		if (st->ok && !st->reached) {
+			problem(1, "inode %d is not linked from any directory", ino);
+			add_fix(inode_field(ino, offsetof(struct inode, valid), offsetof(struct dinode, valid)), 2, 0);
+		}
+
+		if (st->used != st->reached) {
+			problem(1, "inode %d is marked %s in the inode bitmap", ino, st->used ? "used" : "free");
+		}
+
+		if (st->reached && st->node.type == S_IFREG && st->node.link != st->names) {
+			problem(1, "inode %d has link count %u, %u entries name it", ino, st->node.link, st->names);
+			add_fix(inode_field(ino, offsetof(struct inode, link), offsetof(struct dinode, link)), 4, st->names);
+		}
+	}
+}
+
+/*
+ * Pass 3: block maps of the reachable inodes
+ */
+static void bad_ptr(int ino, off_t pos, int blkno) {
+	problem(1, "inode %d: block pointer %d is out of range", ino, blkno);
+	add_fix(pos, sizeof(int), 0);
+}
+
+/*
+ * Counts the map entries ptrs[0..n) of ino, found at image offset pos. The
+ * entry after the first block of a compressed cluster holds minus the length
+ * of the run it starts.
+ */
+static void scan_entries(int ino, const int *ptrs, int n, int first_idx, off_t pos) {
+	int compressed = inos[ino].node.flags & INODE_COMPRESSED;
+
+	for (int i = 0; i < n; i++) {
+		int e = ptrs[i];
+		if (e == 0) {
+			continue;
+		}
+
+		if (e > 0) {
+			if (data_block_ok(e)) {
+				ref(e);
+			} else {
+				bad_ptr(ino, pos + (i * sizeof(int)), e);
+			}
+			continue;
+		}
+
+		int run_ok = compressed && i > 0 && ((first_idx + i) % CLUSTER_BLOCKS) == 1 &&
+			-e <= CLUSTER_BLOCKS && data_block_ok(ptrs[i - 1]) && data_block_ok(ptrs[i - 1] - e - 1);
+		if (!run_ok) {
+			bad_ptr(ino, pos + (i * sizeof(int)), e);
+			continue;
+		}
+
+		for (int j = 1; j < -e; j++) {
+			ref(ptrs[i - 1] + j);
+		}
+	}
+}
+
+static int scan_ptr_block(int ino, int blkno, off_t pos) {
+	if (!data_block_ok(blkno)) {
+		bad_ptr(ino, pos, blkno);
+		return 0;
+	}
+
+	ref(blkno);
+	return 1;
+}
+
+static void scan_blocks(int ino) {
+	struct ino_state *st = &inos[ino];
+	struct inode *node = &st->node;
+
+	if (!st->reached || (node->type == S_IFREG && (node->flags & INODE_INLINE))) {
+		return;
+	}
+
+	int dir = (node->type == S_IFDIR);
+	int ind_ptrs = dir ? DIR_IND_PTRS : FILE_IND_PTRS;
+
+	scan_entries(ino, node->direct_ptr, DIRECT_PTRS, 0, inode_ptr_field(ino, 1, 0));
+
+	for (int k = 0; k < ind_ptrs; k++) {
+		int blkno = node->indirect_ptr[k];
+		if (blkno && scan_ptr_block(ino, blkno, inode_ptr_field(ino, 0, k))) {
+			scan_entries(ino, block_at(blkno), PTRS, DIRECT_PTRS + (k * PTRS), (off_t)blkno * BLOCK_SIZE);
+		}
+	}
+
+	int dind = node->indirect_ptr[FILE_DIND_SLOT];
+	if (dir || !dind || !scan_ptr_block(ino, dind, inode_ptr_field(ino, 0, FILE_DIND_SLOT))) {
+		return;
+	}
+
+	const int *ind = (const int *)block_at(dind);
+	for (int j = 0; j < PTRS; j++) {
+		off_t pos = ((off_t)dind * BLOCK_SIZE) + (j * sizeof(int));
+		if (ind[j] && scan_ptr_block(ino, ind[j], pos)) {
+			int first_idx = DIRECT_PTRS + (FILE_IND_PTRS * PTRS) + (j * PTRS);
+			scan_entries(ino, block_at(ind[j]), PTRS, first_idx, (off_t)ind[j] * BLOCK_SIZE);
+		}
+	}
+}
+
+/*
+ * Pass 4: data bitmap and reference counts against the references found
+ */
+static int check_blocks(uint8_t *want_dbmap, uint16_t *want_refcnt, const uint16_t *refcnt) {
+	int bitmap_bad = 0, refcnt_bad = 0;
+	int reported = 0;
+
+	memset(want_dbmap, 0, BLOCK_SIZE);
+	for (int b = 0; b < (int)sb.d_start_blk; b++) {
+		set_bitmap(want_dbmap, b);
+	}
+
+	// Inode blocks moved by copy-on-write live in the data region
+	for (int i = 0; i < inode_blocks; i++) {
+		if (imap[i] >= (int)sb.d_start_blk) {
+			ref(imap[i]);
+		}
+	}
+
+	for (int s = 0; sb.sn_blocks && s < MAX_SNAPSHOTS; s++) {
+		const struct snapshot *snap = block_at(sb.sn_start_blk + 1 + s);
+		if (!snap->valid) {
+			continue;
+		}
+		for (int i = 0; i < sb.max_dnum / 8; i++) {
+			want_dbmap[i] |= snap->dbmap[i];
+		}
+	}
+
+	for (int b = sb.d_start_blk; b < sb.max_dnum; b++) {
+		if (refs[b]) {
+			set_bitmap(want_dbmap, b);
+		}
+
+		if (get_bitmap(want_dbmap, b) != get_bitmap(dbmap, b)) {
+			bitmap_bad++;
+			if (reported++ < REPORT_LIMIT) {
+				problem(1, "block %d is marked %s in the data bitmap", b, get_bitmap(dbmap, b) ? "used" : "free");
+			} else {
+				tally(1);
+			}
+		}
+
+		if (!refcnt) {
+			if (refs[b] > 1) {
+				problem(0, "block %d is used %u times on an image without reference counts", b, refs[b]);
+			}
+			continue;
+		}
+
+		want_refcnt[b] = (refs[b] > 1) ? ((refs[b] > UINT16_MAX) ? UINT16_MAX : refs[b]) : 0;
+		if (want_refcnt[b] != refcnt[b]) {
+			refcnt_bad++;
+			if (reported++ < REPORT_LIMIT) {
+				problem(1, "block %d has reference count %u, %u references found", b, refcnt[b], refs[b]);
+			} else {
+				tally(1);
+			}
+		}
+	}
+
+	if (reported > REPORT_LIMIT) {
+		printf("rufs-fsck: %d more block problems not shown\n", reported - REPORT_LIMIT);
+	}
+
+	return (bitmap_bad ? 1 : 0) | (refcnt_bad ? 2 : 0);
+}
+
+/*
+ * Pass 5: block checksums, written with their blocks and trusted unless a
+ * repair left them stale. A mismatch in a block the other passes accept is
+ * repaired by having the daemon rebuild the table on the next mount.
+ */
+static const uint32_t *csum_table;
+static const uint8_t *csum_dbmap;
+
+static void check_csum(int b) {
+	if (!get_bitmap((bitmap_t)csum_dbmap, b) || csum_table[b] == 0) {
+		return;
+	}
+
+	uint32_t crc = crc32c(0, block_at(b), BLOCK_SIZE);
+	if ((crc ? crc : 1) != csum_table[b]) {
+		problem(1, "block %d does not match its checksum", b);
+	}
+}
+
+static int write_at(off_t pos, const void *buf, size_t len) {
+	if (pwrite(img_fd, buf, len, pos) != (ssize_t)len) {
+		perror("pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+static int load_image(const char *path) {
+	struct stat st;
+
+	img_fd = open(path, repair ? O_RDWR : O_RDONLY);
+	if (img_fd < 0 || fstat(img_fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	// The superblock starts the image whatever its block size
+	if (pread(img_fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+		fprintf(stderr, "rufs-fsck: %s is empty\n", path);
+		return -1;
+	}
+
+	int bsize = sb.block_size ? (int)sb.block_size : BLOCK_SIZE_MIN;
+	if (!block_size_ok(bsize)) {
+		fprintf(stderr, "rufs-fsck: %s: unsupported block size %d\n", path, bsize);
+		return -1;
+	}
+#ifndef RUFS_BLOCK_SIZE
+	block_size = bsize;
+#endif
+
+	img_blocks = st.st_size / BLOCK_SIZE;
+	if (img_blocks == 0) {
+		fprintf(stderr, "rufs-fsck: %s is empty\n", path);
+		return -1;
+	}
+
+	// MAP_POPULATE reads the whole image up front, in large sequential reads
+	img = mmap(NULL, (size_t)img_blocks * BLOCK_SIZE, PROT_READ, MAP_SHARED | MAP_POPULATE, img_fd, 0);
+	if (img == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (sb.magic_num != MAGIC_NUM || sb.max_inum == 0 || sb.max_inum > MAX_INUM ||
+		sb.max_dnum == 0 || sb.max_dnum > MAX_DNUM || sb.d_start_blk >= img_blocks) {
+		fprintf(stderr, "rufs-fsck: %s: bad superblock\n", path);
+		return -1;
+	}
+
+	if ((sb.rc_blocks && (sb.rc_start_blk + sb.rc_blocks > img_blocks || sb.rc_blocks * BLOCK_SIZE < sb.max_dnum * sizeof(uint16_t) ||
+			sb.rc_blocks > ((MAX_DNUM * sizeof(uint16_t)) + BLOCK_SIZE - 1) / BLOCK_SIZE)) ||
+		(sb.cs_blocks && (sb.cs_start_blk + sb.cs_blocks > img_blocks || sb.cs_blocks * BLOCK_SIZE < sb.max_dnum * sizeof(uint32_t))) ||
+		(sb.sn_blocks && sb.sn_start_blk + 1 + MAX_SNAPSHOTS > img_blocks)) {
+		fprintf(stderr, "rufs-fsck: %s: bad region in the superblock\n", path);
+		return -1;
+	}
+
+	isize = (sb.inode_fmt == INODE_FMT_COMPACT) ? sizeof(struct dinode) : sizeof(struct inode);
+	ipb = BLOCK_SIZE / isize;
+	inode_blocks = (sb.max_inum + ipb - 1) / ipb;
+	if (inode_blocks > MAX_INODE_BLOCKS || sb.i_start_blk + inode_blocks > sb.d_start_blk) {
+		fprintf(stderr, "rufs-fsck: %s: bad inode region\n", path);
+		return -1;
+	}
+
+	for (int i = 0; i < inode_blocks; i++) {
+		imap[i] = sb.sn_blocks ? ((const int *)block_at(sb.sn_start_blk))[i] : (int)(sb.i_start_blk + i);
+		if (imap[i] < (int)sb.i_start_blk || imap[i] >= (int)img_blocks) {
+			fprintf(stderr, "rufs-fsck: %s: inode block %d is at bad block %d\n", path, i, imap[i]);
+			return -1;
+		}
+	}
+
+	memcpy(ibmap, block_at(sb.i_bitmap_blk), BLOCK_SIZE);
+	memcpy(dbmap, block_at(sb.d_bitmap_blk), BLOCK_SIZE);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int force = 0;
+	int opt;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "nypfj:")) != -1) {
+		switch (opt) {
+			case 'n': repair = 0; break;
+			case 'y': case 'p': repair = 1; break;
+			case 'f': force = 1; break;
+			case 'j': nthreads = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n | -y | -p] [-f] [-j threads] <diskfile>\n", argv[0]);
+				return FSCK_ERROR;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-n | -y | -p] [-f] [-j threads] <diskfile>\n", argv[0]);
+		return FSCK_ERROR;
+	}
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	const char *path = argv[optind];
+	if (load_image(path) < 0) {
+		return FSCK_ERROR;
+	}
+
+	if ((sb.fs_state & FS_CLEAN) && !force) {
+		printf("rufs-fsck: %s is clean\n", path);
+		return FSCK_OK;
+	}
+
+	inos = calloc(sb.max_inum, sizeof(struct ino_state));
+	refs = calloc(MAX_DNUM, sizeof(uint32_t));
+	if (!inos || !refs) {
+		perror("calloc");
+		return FSCK_ERROR;
+	}
+
+	parallel_for(sb.max_inum, scan_inode);
+	check_tree();
+	parallel_for(sb.max_inum, scan_blocks);
+
+	const uint16_t *refcnt = sb.rc_blocks ? (const uint16_t *)block_at(sb.rc_start_blk) : NULL;
+	static uint8_t want_dbmap[BLOCK_SIZE_MAX];
+	static uint16_t want_refcnt[MAX_DNUM];
+	int blocks_bad = check_blocks(want_dbmap, want_refcnt, refcnt);
+
+	if (sb.cs_blocks && (sb.cs_state & CSUM_CLEAN)) {
+		csum_table = (const uint32_t *)block_at(sb.cs_start_blk);
+		csum_dbmap = want_dbmap;
+		int n = (sb.max_dnum < img_blocks) ? sb.max_dnum : img_blocks;
+		parallel_for(n, check_csum);
+	}
+
+	if (repair && errors > unfixed) {
+		// The inode bitmap is rebuilt from what the tree reaches
+		for (int ino = 0; ino < sb.max_inum; ino++) {
+			if (inos[ino].reached) {
+				set_bitmap(ibmap, ino);
+			} else {
+				unset_bitmap(ibmap, ino);
+			}
+		}
+
+		for (int i = 0; i < nfixes; i++) {
+			if (write_at(fixes[i].pos, &fixes[i].val, fixes[i].len) < 0) {
+				return FSCK_ERROR;
+			}
+		}
+
+		if (write_at((off_t)sb.i_bitmap_blk * BLOCK_SIZE, ibmap, BLOCK_SIZE) < 0 ||
+			((blocks_bad & 1) && write_at((off_t)sb.d_bitmap_blk * BLOCK_SIZE, want_dbmap, BLOCK_SIZE) < 0) ||
+			((blocks_bad & 2) && write_at((off_t)sb.rc_start_blk * BLOCK_SIZE, want_refcnt, sb.rc_blocks * BLOCK_SIZE) < 0)) {
+			return FSCK_ERROR;
+		}
+	}
+
+	if (repair && (errors > unfixed || unfixed == 0)) {
+		// Blocks written here, the superblock too, have stale checksums
+		// until rufs_init() rebuilds the table
+		sb.cs_state &= ~CSUM_CLEAN;
+		if (unfixed == 0) {
+			sb.fs_state |= FS_CLEAN;
+		}
+
+		if (write_at(0, &sb, sizeof(sb)) < 0 || fsync(img_fd) < 0) {
+			return FSCK_ERROR;
+		}
+	}
+
+	printf("rufs-fsck: %s: %d inodes, %d problems, %d left\n", path, sb.max_inum, errors, unfixed);
+
+	if (errors == 0) {
+		return FSCK_OK;
+	}
+
+	return (unfixed == 0) ? FSCK_FIXED : FSCK_UNFIXED;
+}
@@ -0,0 +1,657 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_mkfs.c
+ *
+ *	Builds a populated RUFS DISKFILE from a host directory without mounting
+ *	it. The tree is numbered breadth first, directory blocks are laid out
+ *	first in the same order, then every file gets its pointer blocks followed
+ *	by its data in one contiguous run. File data is read in large chunks and
+ *	written with one pwrite() per run, metadata regions are written once at
+ *	the end.
+ *
+ *	The image has the layout rufs_mkfs() gives a new DISKFILE. Files of up to
+ *	96 bytes are stored inline and all-zero blocks are left as holes. Only
+ *	regular files and directories are copied, other file types are skipped.
+ *
+ *	Usage:
+ *	  ./rufs-mkfs [-i inode_format] [-C csum] [-b block_size] [-f] <srcdir> <diskfile>
+ *
+ *	  inode_format: compact (default) or legacy
+ *	  block_size: bytes per block, a power of two from 4096 (default) to 65536
+ *	  csum: block checksums, off, meta (default) or data
+ *	  -f: overwrite an existing diskfile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "crc32c.h"
+
+/* rufs.h declares its own struct dirent */
+#define dirent rufs_dirent
+#include "rufs.h"
+#undef dirent
+
+#define PTRS (BLOCK_SIZE / sizeof(int))
+#define DIRENTS (BLOCK_SIZE / sizeof(struct rufs_dirent))
+
+/* Files up to this many bytes keep their data inside the inode */
+#define INLINE_MAX (sizeof(((struct inode *)0)->inline_data))
+
+/* Longest name a struct rufs_dirent holds with its terminator */
+#define NAME_MAX_LEN (sizeof(((struct rufs_dirent *)0)->name) - 1)
+
+/* Fixed blocks in front of the inode region */
+#define SU_BLK_IDX 0
+#define IBMAP_IDX 1
+#define DBMAP_IDX 2
+#define INODE_IDX 3
+
+/* File data read per read() call */
+#define CHUNK_BLOCKS 256
+
+/* Hidden directory snapshots are browsed under, reserved in the root */
+#define SNAP_DIR ".snapshots"
+
+/* A file or directory of the source tree, nodes[i] becomes inode i */
+struct node {
+	char		*path;				/* host path */
+	char		*name;				/* name in the parent directory */
+	int			parent;				/* inode of the parent directory */
+	struct stat	st;
+	int			*children;			/* inodes of a directory's entries */
+	int			nchildren;
+	int			cap;
+	struct inode	inode;			/* inode written to the image */
+};
+
+/* Pointer blocks of one file or directory, laid out in front of its data */
+struct ptr_map {
+	int		first;					/* block number of the first pointer block */
+	int		nsingle;				/* single indirect blocks */
+	int		ndouble;				/* blocks below the double indirect block */
+	int		nblocks;				/* pointer blocks in total */
+	int		*ptrs;					/* contents, nblocks * PTRS entries */
+};
+
+#ifndef RUFS_BLOCK_SIZE
+/* rufs-mkfs does not link block.o */
+int block_size = BLOCK_SIZE_MIN;
+#endif
+
+static struct node nodes[MAX_INUM];
+static int nnodes = 0;
+
+static int img_fd = -1;
+static struct stat img_st;
+static int csum_mode = CSUM_META;
+static int inode_fmt = INODE_FMT_COMPACT;
+
+/* Region layout, as in rufs_mkfs() */
+static int isize;
+static int inode_blocks;
+static int rc_start, rc_blocks;
+static int cs_start, cs_blocks;
+static int sn_start, sn_blocks;
+static int d_start;
+
+static uint8_t dbmap[BLOCK_SIZE_MAX];
+static uint32_t *csum_table;
+static int next_blk;				/* next free data block */
+
+static void *zalloc(size_t n) {
+	void *p = calloc(1, n ? n : 1);
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void init_layout() {
+	isize = (inode_fmt == INODE_FMT_COMPACT) ? sizeof(struct dinode) : sizeof(struct inode);
+	inode_blocks = ((MAX_INUM * isize) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	rc_start = INODE_IDX + inode_blocks;
+	rc_blocks = ((MAX_DNUM * sizeof(uint16_t)) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	cs_start = rc_start + rc_blocks;
+	cs_blocks = ((MAX_DNUM * sizeof(uint32_t)) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	sn_start = cs_start + cs_blocks;
+	sn_blocks = (inode_blocks <= MAX_INODE_BLOCKS) ? (1 + MAX_SNAPSHOTS) : 0;
+	d_start = sn_start + 1 + MAX_SNAPSHOTS;
+
+	for (int b = 0; b < d_start; b++) {
+		set_bitmap(dbmap, b);
+	}
+	next_blk = d_start;
+
+	csum_table = zalloc(cs_blocks * BLOCK_SIZE);
+}
+
+static int alloc_blocks(int count) {
+	if (next_blk + count > MAX_DNUM) {
+		fprintf(stderr, "rufs-mkfs: the source tree does not fit in %d blocks\n", MAX_DNUM);
+		exit(1);
+	}
+
+	int blkno = next_blk;
+	for (int i = 0; i < count; i++) {
+		set_bitmap(dbmap, next_blk++);
+	}
+	return blkno;
+}
+
+static void csum_block(int blkno, const void *buf, int checked) {
+	if (!checked || csum_mode == CSUM_OFF) {
+		return;
+	}
+
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	csum_table[blkno] = crc ? crc : 1;
+}
+
+static void write_blocks(int blkno, const void *buf, int count, int checked) {
+	size_t len = (size_t)count * BLOCK_SIZE;
+
+	if (pwrite(img_fd, buf, len, (off_t)blkno * BLOCK_SIZE) != (ssize_t)len) {
+		perror("pwrite");
+		exit(1);
+	}
+
+	for (int i = 0; i < count; i++) {
+		csum_block(blkno + i, (const char *)buf + ((size_t)i * BLOCK_SIZE), checked);
+	}
+}
+
+/*
+ * Source tree
+ */
+static int add_node(const char *path, const char *name, int parent, const struct stat *st) {
+	if (nnodes == MAX_INUM) {
+		fprintf(stderr, "rufs-mkfs: the source tree has more than %d files and directories\n", MAX_INUM);
+		exit(1);
+	}
+
+	struct node *n = &nodes[nnodes];
+	n->path = strdup(path);
+	n->name = strdup(name);
+	n->parent = parent;
+	n->st = *st;
+	if (!n->path || !n->name) {
+		perror("strdup");
+		exit(1);
+	}
+
+	if (parent >= 0) {
+		struct node *p = &nodes[parent];
+		if (p->nchildren == p->cap) {
+			p->cap = p->cap ? (p->cap * 2) : 16;
+			p->children = realloc(p->children, p->cap * sizeof(int));
+			if (!p->children) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		p->children[p->nchildren++] = nnodes;
+	}
+
+	return nnodes++;
+}
+
+static int cmp_name(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Adds the entries of directory ino, in name order so images are reproducible
+ */
+static void read_source_dir(int ino) {
+	DIR *dir = opendir(nodes[ino].path);
+	if (!dir) {
+		perror(nodes[ino].path);
+		exit(1);
+	}
+
+	char **names = NULL;
+	int n = 0, cap = 0;
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? (cap * 2) : 64;
+			names = realloc(names, cap * sizeof(char *));
+			if (!names) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		names[n] = strdup(d->d_name);
+		if (!names[n]) {
+			perror("strdup");
+			exit(1);
+		}
+		n++;
+	}
+	closedir(dir);
+
+	qsort(names, n, sizeof(char *), cmp_name);
+
+	for (int i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		struct stat st;
+
+		if (snprintf(path, sizeof(path), "%s/%s", nodes[ino].path, names[i]) >= (int)sizeof(path)) {
+			fprintf(stderr, "rufs-mkfs: skipping %s/%s: path too long\n", nodes[ino].path, names[i]);
+		} else if (lstat(path, &st) < 0) {
+			fprintf(stderr, "rufs-mkfs: skipping %s: %s\n", path, strerror(errno));
+		} else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "rufs-mkfs: skipping %s: not a regular file or directory\n", path);
+		} else if (strlen(names[i]) > NAME_MAX_LEN) {
+			fprintf(stderr, "rufs-mkfs: skipping %s: name longer than %zu bytes\n", path, NAME_MAX_LEN);
+		} else if (ino == 0 && sn_blocks && strcmp(names[i], SNAP_DIR) == 0) {
+			fprintf(stderr, "rufs-mkfs: skipping %s: name is reserved for snapshots\n", path);
+		} else if (st.st_dev == img_st.st_dev && st.st_ino == img_st.st_ino) {
+			// The image being written may sit inside the source tree
+		} else if (S_ISREG(st.st_mode) && st.st_size > (off_t)(DIRECT_PTRS + (FILE_IND_PTRS * PTRS) + (PTRS * PTRS)) * BLOCK_SIZE) {
+			fprintf(stderr, "rufs-mkfs: skipping %s: file too large\n", path);
+		} else {
+			add_node(path, names[i], ino, &st);
+		}
+		free(names[i]);
+	}
+
+	free(names);
+}
+
+/* Nodes are numbered breadth first, so nodes itself is the queue */
+static void read_source_tree(const char *root) {
+	struct stat st;
+
+	if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "rufs-mkfs: %s is not a directory\n", root);
+		exit(1);
+	}
+
+	add_node(root, ".", -1, &st);
+	for (int ino = 0; ino < nnodes; ino++) {
+		if (S_ISDIR(nodes[ino].st.st_mode)) {
+			read_source_dir(ino);
+		}
+	}
+}
+
+/*
+ * Block maps
+ */
+
+/*
+ * Reserves the pointer blocks for count blocks of a file or directory and
+ * points the indirect slots of node at them
+ */
+static void plan_ptrs(struct inode *node, struct ptr_map *map, int count, int nsingle, int dind) {
+	int left = (count > DIRECT_PTRS) ? (count - DIRECT_PTRS) : 0;
+
+	memset(map, '\0', sizeof(struct ptr_map));
+	map->nsingle = (left + PTRS - 1) / PTRS;
+	if (map->nsingle > nsingle) {
+		map->nsingle = nsingle;
+	}
+	left -= map->nsingle * PTRS;
+
+	if (left > 0) {
+		map->ndouble = (left + PTRS - 1) / PTRS;
+	}
+
+	map->nblocks = map->nsingle + (map->ndouble ? (1 + map->ndouble) : 0);
+	if (map->nblocks == 0) {
+		return;
+	}
+
+	map->first = alloc_blocks(map->nblocks);
+	map->ptrs = zalloc((size_t)map->nblocks * BLOCK_SIZE);
+
+	for (int k = 0; k < map->nsingle; k++) {
+		node->indirect_ptr[k] = map->first + k;
+	}
+
+	if (map->ndouble) {
+		int *top = map->ptrs + (map->nsingle * PTRS);
+		node->indirect_ptr[dind] = map->first + map->nsingle;
+		for (int c = 0; c < map->ndouble; c++) {
+			top[c] = map->first + map->nsingle + 1 + c;
+		}
+	}
+}
+
+static void set_entry(struct inode *node, struct ptr_map *map, int idx, int blkno) {
+	if (idx < DIRECT_PTRS) {
+		node->direct_ptr[idx] = blkno;
+		return;
+	}
+
+	idx -= DIRECT_PTRS;
+	if (idx < map->nsingle * (int)PTRS) {
+		map->ptrs[idx] = blkno;
+		return;
+	}
+
+	idx -= map->nsingle * PTRS;
+	map->ptrs[((map->nsingle + 1 + (idx / PTRS)) * PTRS) + (idx % PTRS)] = blkno;
+}
+
+static void write_ptrs(struct ptr_map *map) {
+	if (map->nblocks) {
+		write_blocks(map->first, map->ptrs, map->nblocks, 1);
+		free(map->ptrs);
+	}
+}
+
+/*
+ * Directories, their blocks come first in breadth first order
+ */
+static void build_dir(int ino) {
+	struct node *n = &nodes[ino];
+	struct inode *node = &n->inode;
+	int nents = n->nchildren + ((ino == 0) ? 1 : 2);
+	int count = (nents + DIRENTS - 1) / DIRENTS;
+
+	node->ino = ino;
+	node->valid = 1;
+	node->type = S_IFDIR;
+	node->link = (ino == 0) ? 0 : 2;
+	node->size = count;
+	node->vstat.st_atime = n->st.st_atime;
+	node->vstat.st_mtime = n->st.st_mtime;
+
+	struct ptr_map map;
+	plan_ptrs(node, &map, count, DIR_IND_PTRS, -1);
+
+	struct rufs_dirent *ents = zalloc((size_t)count * BLOCK_SIZE);
+	int e = 0;
+
+	ents[e].ino = ino;
+	ents[e].valid = 1;
+	strcpy(ents[e].name, ".");
+	ents[e++].len = 1;
+
+	// The root has no .. entry
+	if (ino != 0) {
+		ents[e].ino = n->parent;
+		ents[e].valid = 1;
+		strcpy(ents[e].name, "..");
+		ents[e++].len = 2;
+	}
+
+	for (int i = 0; i < n->nchildren; i++, e++) {
+		struct node *c = &nodes[n->children[i]];
+		ents[e].ino = n->children[i];
+		ents[e].valid = 1;
+		ents[e].len = strlen(c->name);
+		memcpy(ents[e].name, c->name, ents[e].len + 1);
+	}
+
+	int first = alloc_blocks(count);
+	for (int i = 0; i < count; i++) {
+		set_entry(node, &map, i, first + i);
+	}
+
+	// Entries are packed DIRENTS to a block, with the tail of each block unused
+	char *blks = zalloc((size_t)count * BLOCK_SIZE);
+	for (int i = 0; i < count; i++) {
+		int k = (nents - (i * DIRENTS) < (int)DIRENTS) ? (nents - (i * DIRENTS)) : (int)DIRENTS;
+		memcpy(blks + ((size_t)i * BLOCK_SIZE), ents + (i * DIRENTS), k * sizeof(struct rufs_dirent));
+	}
+
+	write_ptrs(&map);
+	write_blocks(first, blks, count, 1);
+	free(blks);
+	free(ents);
+}
+
+/*
+ * Files, each one gets its pointer blocks and then its data in one run
+ */
+static int block_is_zero(const char *blk) {
+	static const char zero[BLOCK_SIZE_MAX];
+	return memcmp(blk, zero, BLOCK_SIZE) == 0;
+}
+
+static void build_file(int ino, char *buf) {
+	struct node *n = &nodes[ino];
+	struct inode *node = &n->inode;
+	off_t size = n->st.st_size;
+
+	node->ino = ino;
+	node->valid = 1;
+	node->type = S_IFREG;
+	node->link = 1;
+	node->vstat.st_size = size;
+	node->vstat.st_atime = n->st.st_atime;
+	node->vstat.st_mtime = n->st.st_mtime;
+
+	int fd = open(n->path, O_RDONLY);
+	if (fd < 0) {
+		perror(n->path);
+		exit(1);
+	}
+
+	if (size <= (off_t)INLINE_MAX) {
+		node->flags = INODE_INLINE;
+		if (size > 0 && read(fd, node->inline_data, size) != size) {
+			perror(n->path);
+			exit(1);
+		}
+		close(fd);
+		return;
+	}
+
+	int count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	node->size = count;
+
+	struct ptr_map map;
+	plan_ptrs(node, &map, count, FILE_IND_PTRS, FILE_DIND_SLOT);
+
+	for (int idx = 0; idx < count; idx += CHUNK_BLOCKS) {
+		int nblk = (count - idx < CHUNK_BLOCKS) ? (count - idx) : CHUNK_BLOCKS;
+		size_t want = (size_t)nblk * BLOCK_SIZE;
+		size_t got = 0;
+
+		while (got < want) {
+			ssize_t r = read(fd, buf + got, want - got);
+			if (r < 0) {
+				perror(n->path);
+				exit(1);
+			}
+			if (r == 0) {
+				break;
+			}
+			got += r;
+		}
+		memset(buf + got, '\0', want - got);
+
+		// Consecutive non-zero blocks go out in one write
+		int run = -1;
+		for (int i = 0; i <= nblk; i++) {
+			int hole = (i == nblk) || block_is_zero(buf + ((size_t)i * BLOCK_SIZE));
+			if (!hole && run < 0) {
+				run = i;
+			}
+			if (hole && run >= 0) {
+				int first = alloc_blocks(i - run);
+				for (int j = run; j < i; j++) {
+					set_entry(node, &map, idx + j, first + (j - run));
+				}
+				write_blocks(first, buf + ((size_t)run * BLOCK_SIZE), i - run, csum_mode == CSUM_DATA);
+				run = -1;
+			}
+		}
+	}
+
+	close(fd);
+	write_ptrs(&map);
+}
+
+/*
+ * Metadata regions
+ */
+static void write_metadata() {
+	char *blk = zalloc(BLOCK_SIZE);
+
+	// Inode bitmap
+	for (int ino = 0; ino < nnodes; ino++) {
+		set_bitmap((bitmap_t)blk, ino);
+	}
+	write_blocks(IBMAP_IDX, blk, 1, 1);
+
+	// Inode region
+	char *region = zalloc((size_t)inode_blocks * BLOCK_SIZE);
+	for (int ino = 0; ino < nnodes; ino++) {
+		void *disk_inode = region + ((size_t)ino * isize);
+		if (inode_fmt == INODE_FMT_COMPACT) {
+			inode_to_dinode(&nodes[ino].inode, (struct dinode *)disk_inode);
+		} else {
+			memcpy(disk_inode, &nodes[ino].inode, sizeof(struct inode));
+		}
+	}
+	write_blocks(INODE_IDX, region, inode_blocks, 1);
+	free(region);
+
+	// Nothing is shared yet, every reference count is 0
+	region = zalloc((size_t)rc_blocks * BLOCK_SIZE);
+	write_blocks(rc_start, region, rc_blocks, 1);
+	free(region);
+
+	// The live inode map points at the inode region, no snapshot records
+	if (sn_blocks) {
+		memset(blk, '\0', BLOCK_SIZE);
+		for (int i = 0; i < inode_blocks; i++) {
+			((int *)blk)[i] = INODE_IDX + i;
+		}
+		write_blocks(sn_start, blk, 1, 1);
+
+		memset(blk, '\0', BLOCK_SIZE);
+		for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+			write_blocks(sn_start + 1 + s, blk, 1, 1);
+		}
+	}
+
+	write_blocks(DBMAP_IDX, dbmap, 1, 1);
+
+	struct superblock *sb = (struct superblock *)blk;
+	memset(blk, '\0', BLOCK_SIZE);
+	sb->magic_num = MAGIC_NUM;
+	sb->max_inum = MAX_INUM;
+	sb->max_dnum = MAX_DNUM;
+	sb->i_bitmap_blk = IBMAP_IDX;
+	sb->d_bitmap_blk = DBMAP_IDX;
+	sb->i_start_blk = INODE_IDX;
+	sb->d_start_blk = d_start;
+	sb->inode_fmt = inode_fmt;
+	sb->inode_size = isize;
+	sb->block_size = BLOCK_SIZE;
+	sb->rc_start_blk = rc_start;
+	sb->rc_blocks = rc_blocks;
+	sb->cs_start_blk = cs_start;
+	sb->cs_blocks = cs_blocks;
+	sb->cs_state = CSUM_CLEAN;
+	sb->sn_start_blk = sn_start;
+	sb->sn_blocks = sn_blocks;
+	sb->fs_state = FS_CLEAN;
+	write_blocks(SU_BLK_IDX, blk, 1, 1);
+
+	// Last, the table holds the checksum of every block written above
+	if (pwrite(img_fd, csum_table, (size_t)cs_blocks * BLOCK_SIZE, (off_t)cs_start * BLOCK_SIZE) != (ssize_t)cs_blocks * BLOCK_SIZE) {
+		perror("pwrite");
+		exit(1);
+	}
+
+	free(blk);
+}
+
+int main(int argc, char **argv) {
+	int force = 0;
+	int bsize = BLOCK_SIZE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:C:b:f")) != -1) {
+		switch (opt) {
+			case 'i': inode_fmt = (strcmp(optarg, "legacy") == 0) ? INODE_FMT_LEGACY : INODE_FMT_COMPACT; break;
+			case 'C':
+				csum_mode = (strcmp(optarg, "off") == 0) ? CSUM_OFF :
+					(strcmp(optarg, "data") == 0) ? CSUM_DATA : CSUM_META;
+				break;
+			case 'b': bsize = atoi(optarg); break;
+			case 'f': force = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-i inode_format] [-C csum] [-b block_size] [-f] <srcdir> <diskfile>\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 2) {
+		fprintf(stderr, "usage: %s [-i inode_format] [-C csum] [-b block_size] [-f] <srcdir> <diskfile>\n", argv[0]);
+		return 1;
+	}
+
+	if (!block_size_ok(bsize)) {
+		fprintf(stderr, "rufs-mkfs: cannot make an image with %d byte blocks\n", bsize);
+		return 1;
+	}
+#ifndef RUFS_BLOCK_SIZE
+	block_size = bsize;
+#endif
+
+	const char *src = argv[optind];
+	const char *path = argv[optind + 1];
+
+	img_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | (force ? 0 : O_EXCL), 0644);
+	if (img_fd < 0 || fstat(img_fd, &img_st) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	init_layout();
+	read_source_tree(src);
+
+	for (int ino = 0; ino < nnodes; ino++) {
+		if (S_ISDIR(nodes[ino].st.st_mode)) {
+			build_dir(ino);
+		}
+	}
+
+	char *buf = zalloc((size_t)CHUNK_BLOCKS * BLOCK_SIZE);
+	for (int ino = 0; ino < nnodes; ino++) {
+		if (S_ISREG(nodes[ino].st.st_mode)) {
+			build_file(ino, buf);
+		}
+	}
+	free(buf);
+
+	write_metadata();
+
+	// Same size as a DISKFILE made by the daemon, unless the data runs past it
+	off_t end = (off_t)next_blk * BLOCK_SIZE;
+	if (ftruncate(img_fd, (end > DISK_SIZE) ? end : DISK_SIZE) < 0 || fsync(img_fd) < 0) {
+		perror(path);
+		return 1;
+	}
+	close(img_fd);
+
+	int files = 0;
+	for (int ino = 0; ino < nnodes; ino++) {
+		files += S_ISREG(nodes[ino].st.st_mode);
+	}
+
+	printf("rufs-mkfs: %s: %d files, %d directories, %d of %d blocks used\n",
+		path, files, nnodes - files, next_blk, MAX_DNUM);
+	return 0;
+}